@@ -339,7 +339,9 @@ SUPPORTED_CONFIGS = (
         kernel_options={
             "KernelDebugBuild": False,
             "KernelVerificationBuild": False,
-            "KernelBenchmarks": "track_utilisation"
+            "KernelBenchmarks": "track_utilisation",
+            # Needed for benchmarks to report their results
+            "KernelPrinting": True,
         },
         kernel_options_arch={
             KernelArch.AARCH64: {
@@ -356,6 +358,9 @@ EXAMPLES = {
     "passive_server": Path("example/passive_server"),
     "hierarchy": Path("example/hierarchy"),
     "timer": Path("example/timer"),
+    "benchmark": Path("example/benchmark"),
+    "utilisation": Path("example/utilisation"),
+    "timer_service": Path("example/timer_service"),
 }
 
 
@@ -543,7 +548,7 @@ def build_elf_component(
 ) -> None:
     """Build a specific ELF component.
 
-    Right now this is either the loader or the monitor
+    Right now this is either the loader, the monitor or the logger
     """
     sel4_dir = root_dir / "board" / board.name / config.name
     build_dir = build_dir / board.name / config.name / component_name
@@ -580,6 +585,27 @@ def build_doc(root_dir: Path):
     assert r == 0
 
 
+def build_benchmark(
+    root_dir: Path,
+    build_dir: Path,
+    board: BoardInfo,
+    llvm: bool
+) -> None:
+    """Build the benchmark example against the SDK's benchmark configuration."""
+    example_dir = EXAMPLES["benchmark"]
+    build_dir = build_dir / board.name / "benchmark" / "example_benchmark"
+    build_dir.mkdir(exist_ok=True, parents=True)
+
+    r = system(
+        f"make -C {example_dir} BUILD_DIR={build_dir.absolute()} MICROKIT_SDK={root_dir.absolute()} "
+        f"MICROKIT_BOARD={board.name} MICROKIT_CONFIG=benchmark LLVM={llvm}"
+    )
+    if r != 0:
+        raise Exception(
+            f"Error building: benchmark example for board: {board.name}"
+        )
+
+
 def build_lib_component(
     component_name: str,
     root_dir: Path,
@@ -648,6 +674,7 @@ def main() -> None:
     parser.add_argument("--skip-sel4", action="store_true", help="seL4 will not be built")
     parser.add_argument("--skip-docs", action="store_true", help="Docs will not be built")
     parser.add_argument("--skip-tar", action="store_true", help="SDK and source tarballs will not be built")
+    parser.add_argument("--build-benchmarks", action="store_true", help="Build the benchmark example for each board in the benchmark configuration")
     # Read from the version file as unless someone has specified
     # a version, that is the source of truth
     with open("VERSION", "r") as f:
@@ -746,7 +773,8 @@ def main() -> None:
             loader_printing = 1 if config.name == "debug" else 0
             loader_defines = [
                 ("LINK_ADDRESS", hex(board.loader_link_address)),
-                ("PRINTING", loader_printing)
+                ("PRINTING", loader_printing),
+                ("NUM_CPUS", sel4_gen_config["MAX_NUM_NODES"]),
             ]
             # There are some architecture dependent configuration options that the loader
             # needs to know about, so we figure that out here
@@ -764,6 +792,8 @@ def main() -> None:
             build_elf_component("loader", root_dir, build_dir, board, config, args.llvm, loader_defines)
             build_elf_component("monitor", root_dir, build_dir, board, config, args.llvm, [])
             build_lib_component("libmicrokit", root_dir, build_dir, board, config, args.llvm)
+            # The logger is a PD, so it is linked against libmicrokit
+            build_elf_component("logger", root_dir, build_dir, board, config, args.llvm, [])
 
     # Setup the examples
     for example, example_path in EXAMPLES.items():
@@ -779,6 +809,14 @@ def main() -> None:
             copy(p, dest)
             dest.chmod(0o744)
 
+    if args.build_benchmarks:
+        if args.skip_tool:
+            raise Exception("Building the benchmarks requires the tool, it cannot be skipped")
+        if not any(config.name == "benchmark" for config in selected_configs):
+            raise Exception("Building the benchmarks requires the benchmark configuration")
+        for board in selected_boards:
+            build_benchmark(root_dir, build_dir, board, args.llvm)
+
     if not args.skip_tar:
         # At this point we create a tar.gz file
         with tar_open(tar_file, "w:gz") as tar:
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdint.h>
+#include <microkit.h>
+
+/*
+ * Measures the cost of the main libmicrokit communication paths: protected
+ * procedure calls to active and passive servers, and notification round
+ * trips using both microkit_notify and microkit_deferred_notify. When the
+ * kernel is configured for more than one core, each path is also measured
+ * with the other end on a different core.
+ *
+ * The protected procedure calls are timed in a loop from init. The
+ * notification round trips are driven from notified, so that they include
+ * the return to the event loop just as in a real system.
+ */
+
+#define WARMUP 100
+#define ITERATIONS 1000
+
+#define SERVER_CH 0
+#define PASSIVE_SERVER_CH 1
+#define REMOTE_SERVER_CH 2
+#define ECHO_CH 3
+#define ECHO_DEFERRED_CH 4
+#define REMOTE_ECHO_CH 5
+#define REMOTE_ECHO_DEFERRED_CH 6
+
+#if CONFIG_MAX_NUM_NODES > 1
+#define CROSS_CORE 1
+#else
+#define CROSS_CORE 0
+#endif
+
+struct round_trip {
+    const char *name;
+    microkit_channel ch;
+    seL4_Bool deferred;
+};
+
+static const struct round_trip round_trips[] = {
+    { "notify round trip (same core)", ECHO_CH, seL4_False },
+    { "deferred notify round trip (same core)", ECHO_DEFERRED_CH, seL4_True },
+#if CROSS_CORE
+    { "notify round trip (cross core)", REMOTE_ECHO_CH, seL4_False },
+    { "deferred notify round trip (cross core)", REMOTE_ECHO_DEFERRED_CH, seL4_True },
+#endif
+};
+
+#define NUM_ROUND_TRIPS (sizeof(round_trips) / sizeof(round_trips[0]))
+
+static uint64_t samples[ITERATIONS];
+
+/* Progress through the notification round trips */
+static unsigned current_round_trip;
+static unsigned iteration;
+static uint64_t start;
+
+#if defined(CONFIG_ARCH_AARCH64) && defined(CONFIG_EXPORT_PMU_USER)
+#define COUNTER_UNIT "cycles"
+
+static void counter_init(void)
+{
+    uint64_t pmcr;
+    asm volatile("mrs %0, pmcr_el0" : "=r"(pmcr));
+    /* Enable the counters and reset the cycle counter */
+    asm volatile("msr pmcr_el0, %0" :: "r"(pmcr | (1 << 2) | 1));
+    /* Count cycles at all exception levels, so that time in the kernel is included */
+    asm volatile("msr pmccfiltr_el0, %0" :: "r"(0UL));
+    asm volatile("msr pmcntenset_el0, %0" :: "r"(1UL << 31));
+    asm volatile("isb");
+}
+
+static inline uint64_t counter_read(void)
+{
+    uint64_t cycles;
+    asm volatile("isb; mrs %0, pmccntr_el0" : "=r"(cycles));
+    return cycles;
+}
+#elif defined(CONFIG_ARCH_AARCH64)
+/* The PMU is only exported in the benchmark configuration, fall back to the generic timer */
+#define COUNTER_UNIT "timer ticks"
+
+static void counter_init(void)
+{
+}
+
+static inline uint64_t counter_read(void)
+{
+    uint64_t ticks;
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(ticks));
+    return ticks;
+}
+#elif defined(CONFIG_ARCH_RISCV)
+#define COUNTER_UNIT "cycles"
+
+static void counter_init(void)
+{
+}
+
+static inline uint64_t counter_read(void)
+{
+    uint64_t cycles;
+    asm volatile("rdcycle %0" : "=r"(cycles));
+    return cycles;
+}
+#else
+#error "Unsupported architecture"
+#endif
+
+static void put64(uint64_t x)
+{
+    char buffer[21];
+    unsigned i = sizeof(buffer) - 1;
+    buffer[i] = 0;
+    do {
+        buffer[--i] = '0' + (x % 10);
+        x /= 10;
+    } while (x);
+    microkit_dbg_puts(&buffer[i]);
+}
+
+static void sort(uint64_t *values, unsigned count)
+{
+    /* Shell sort, fast enough for the number of samples we take */
+    for (unsigned gap = count / 2; gap > 0; gap /= 2) {
+        for (unsigned i = gap; i < count; i++) {
+            uint64_t value = values[i];
+            unsigned j = i;
+            while (j >= gap && values[j - gap] > value) {
+                values[j] = values[j - gap];
+                j -= gap;
+            }
+            values[j] = value;
+        }
+    }
+}
+
+static void report(const char *name)
+{
+    sort(samples, ITERATIONS);
+
+    microkit_dbg_puts("BENCH|");
+    microkit_dbg_puts(name);
+    microkit_dbg_puts(": min ");
+    put64(samples[0]);
+    microkit_dbg_puts(" median ");
+    put64(samples[ITERATIONS / 2]);
+    microkit_dbg_puts(" p99 ");
+    put64(samples[(ITERATIONS * 99) / 100]);
+    microkit_dbg_puts(" max ");
+    put64(samples[ITERATIONS - 1]);
+    microkit_dbg_puts(" " COUNTER_UNIT "\n");
+}
+
+static void bench_ppcall(const char *name, microkit_channel ch)
+{
+    for (unsigned i = 0; i < WARMUP + ITERATIONS; i++) {
+        uint64_t before = counter_read();
+        (void) microkit_ppcall(ch, microkit_msginfo_new(0, 0));
+        uint64_t after = counter_read();
+        if (i >= WARMUP) {
+            samples[i - WARMUP] = after - before;
+        }
+    }
+
+    report(name);
+}
+
+static void round_trip_send(void)
+{
+    const struct round_trip *rt = &round_trips[current_round_trip];
+
+    start = counter_read();
+    if (rt->deferred) {
+        microkit_deferred_notify(rt->ch);
+    } else {
+        microkit_notify(rt->ch);
+    }
+}
+
+void init(void)
+{
+    counter_init();
+
+    bench_ppcall("ppcall (same core)", SERVER_CH);
+    bench_ppcall("ppcall to passive server (same core)", PASSIVE_SERVER_CH);
+#if CROSS_CORE
+    bench_ppcall("ppcall (cross core)", REMOTE_SERVER_CH);
+#endif
+
+    current_round_trip = 0;
+    iteration = 0;
+    round_trip_send();
+}
+
+void notified(microkit_channel ch)
+{
+    uint64_t end = counter_read();
+    const struct round_trip *rt = &round_trips[current_round_trip];
+
+    if (current_round_trip == NUM_ROUND_TRIPS || ch != rt->ch) {
+        microkit_dbg_puts("BENCH|ERROR: received a notification on an unexpected channel\n");
+        return;
+    }
+
+    if (iteration >= WARMUP) {
+        samples[iteration - WARMUP] = end - start;
+    }
+    iteration++;
+
+    if (iteration == WARMUP + ITERATIONS) {
+        report(rt->name);
+        iteration = 0;
+        current_round_trip++;
+        if (current_round_trip == NUM_ROUND_TRIPS) {
+            microkit_dbg_puts("BENCH|DONE\n");
+            return;
+        }
+    }
+
+    round_trip_send();
+}
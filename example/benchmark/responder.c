@@ -0,0 +1,39 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <microkit.h>
+
+/*
+ * The other end of every benchmark: replies to protected procedure calls
+ * and echoes notifications straight back, doing no other work so that only
+ * the cost of the kernel and libmicrokit paths is measured.
+ */
+
+#define NOTIFY_CH 0
+#define DEFERRED_NOTIFY_CH 1
+
+void init(void)
+{
+}
+
+void notified(microkit_channel ch)
+{
+    switch (ch) {
+    case NOTIFY_CH:
+        microkit_notify(ch);
+        break;
+    case DEFERRED_NOTIFY_CH:
+        microkit_deferred_notify(ch);
+        break;
+    default:
+        microkit_dbg_puts(microkit_name);
+        microkit_dbg_puts("|ERROR: received a notification on an unexpected channel\n");
+    }
+}
+
+microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo)
+{
+    return microkit_msginfo_new(0, 0);
+}
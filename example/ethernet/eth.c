@@ -6,10 +6,15 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <microkit.h>
+#include <microkit_ring.h>
 
-#define OUTPUT_CH 1 /* output from this PD -- becomes input for peer */
-#define INPUT_CH 2 /* input to this PD -- comes from peer output */
+#include "pool.h"
+
+#define RX_CH 1 /* received frames, to the pass-through PD */
+#define TX_CH 2 /* frames to transmit, from the pass-through PD */
 #define IRQ_CH 3
+#define DONE_CH 4 /* buffers we are finished with, to the pass-through PD */
+#define FREE_CH 5 /* empty buffers to receive into, from the pass-through PD */
 
 uintptr_t ring_buffer_vaddr;
 uintptr_t packet_buffer_vaddr;
@@ -17,30 +22,40 @@ uintptr_t packet_buffer_vaddr;
 uintptr_t ring_buffer_paddr;
 uintptr_t packet_buffer_paddr;
 
+uintptr_t rx_ring_vaddr;
+uintptr_t tx_ring_vaddr;
+uintptr_t done_ring_vaddr;
+uintptr_t free_ring_vaddr;
+
+static microkit_ring rx_ring;
+static microkit_ring tx_ring;
+static microkit_ring done_ring;
+static microkit_ring free_ring;
+
 /* Note: in theory 256 should be allowed, but it doesn't work for some reason */
 #define RBD_COUNT 128
 #define TBD_COUNT 128
 
-#define BUFFER_MAX 1024
-#define BUFFER_SIZE (2 * 1024)
-#define DATA_OFFSET 64
+#define TX_BATCH 32
 
+/* Next descriptor to receive into, and next one to give a buffer to */
 static unsigned rbd_index = 0;
+static unsigned rbd_fill_index = 0;
+static unsigned rx_filled = 0;
+/* Next descriptor to transmit from, and next one to reclaim */
 static unsigned tbd_index = 0;
+static unsigned tbd_clean_index = 0;
+static unsigned tx_in_flight = 0;
+
+/* Offset in the packet buffer pool of the buffer given to each descriptor */
+static uint64_t rbd_buffer[RBD_COUNT];
+static uint64_t tbd_buffer[TBD_COUNT];
 
 static uint8_t mac[6];
 
 static uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 static uint8_t my_ip[4] = { 10, 141, 2, 80 };
 
-/* Make the minimum frame buffer 2k. This is a bit of a waste of memory, but ensure alignment */
-#define PACKET_BUFFER_SIZE (2 * 1024)
-
-static uint8_t temp_packet[PACKET_BUFFER_SIZE] __attribute__((aligned(64)));
-
-static unsigned output_index = 0;
-static unsigned input_index = 0;
-
 
 /* A small selection of ehtertype that we might see
  * by no means exhaustive, but probably only ever
@@ -53,13 +68,6 @@ static unsigned input_index = 0;
 #define ETHERTYPE_RARP 0x8035
 #define ETHERTYPE_IPV6 0x86DD
 
-uint64_t output_buffer_vaddr;
-uint64_t input_buffer_vaddr;
-
-#define OUTPUT_BUFFER output_buffer_vaddr
-#define INPUT_BUFFER input_buffer_vaddr
-
-
 static inline uint64_t
 get_sys_counter(void)
 {
@@ -72,11 +80,6 @@ get_sys_counter(void)
     return r;
 }
 
-struct buffer_descriptor {
-    uint16_t data_length;
-    uint16_t flags;
-};
-
 struct rbd {
     uint16_t data_length;
     uint16_t flags;
@@ -255,7 +258,7 @@ struct regs {
 
 
 _Static_assert((sizeof(struct rbd) * RBD_COUNT + sizeof(struct tbd) * TBD_COUNT) <= 0x1000, "Expect rx+tx ring to fit in single 4K page");
-_Static_assert((RBD_COUNT + TBD_COUNT) * PACKET_BUFFER_SIZE <= 0x200000, "Expect rx+tx buffers to fit in single 2MB page");
+_Static_assert(POOL_SIZE <= 0x200000, "Expect packet buffer pool to fit in single 2MB page");
 
 volatile uint64_t *shared_counter = (uint64_t *)(uintptr_t)0x1600000;
 volatile uint32_t *eth_raw = (uint32_t *)(uintptr_t)0x2000000;
@@ -539,31 +542,6 @@ dump_hex(const uint8_t *d, unsigned int length)
     }
 }
 
-/* NOTE: This assumes we are copying to / from packet buffers, so we know we can doing unrolled copies */
-static void
-mycpy(void *dst, void *src, unsigned int length)
-{
-    uint64_t *d = dst;
-    uint64_t *s = src;
-    int i = 0;
-    int l = length / 64;
-    if (length % 64) {
-        l++;
-    }
-    while (l) {
-        d[i] = s[i];
-        d[i + 1] = s[i + 1];
-        d[i + 2] = s[i + 2];
-        d[i + 3] = s[i + 3];
-        d[i + 4] = s[i + 4];
-        d[i + 5] = s[i + 5];
-        d[i + 6] = s[i + 6];
-        d[i + 7] = s[i + 7];
-        l--;
-        i += 8;
-    }
-}
-
 static int
 mycmp(char *a, char *b) {
     int i = 0;
@@ -577,18 +555,19 @@ mycmp(char *a, char *b) {
 }
 
 
-static void
-send_frame(uint8_t *d, unsigned int length)
+/*
+ * Transmit the frame in the given packet buffer. Ownership of the buffer
+ * passes to the transmit ring until the frame has been sent.
+ */
+static bool
+send_frame(uint64_t buffer, unsigned int length)
 {
     uint16_t flags;
-    void *packet;
-
-    flags = tbd[tbd_index].flags;
 
-    if (flags & (1 << 15)) {
+    if (tx_in_flight == TBD_COUNT) {
         microkit_dbg_puts(microkit_name);
         microkit_dbg_puts(": ran out of tx buffers!!\n");
-        return;
+        return false;
     }
 
 #if 0
@@ -604,10 +583,6 @@ send_frame(uint8_t *d, unsigned int length)
     microkit_dbg_puts("\n");
 #endif
 
-    packet = (void *)(uintptr_t)(packet_buffer_vaddr + ((RBD_COUNT + tbd_index) * PACKET_BUFFER_SIZE));
-    mycpy(packet, d, length);
-    seL4_ARM_VSpace_CleanInvalidate_Data(3, (uintptr_t)packet, ((uintptr_t)packet) + length);
-
     flags = (
         (1 << 15) | /* ready */
         (1 << 11) | /* last in frame */
@@ -617,19 +592,96 @@ send_frame(uint8_t *d, unsigned int length)
         flags |= (1 << 13) /* wrap */;
     }
 
+    tbd_buffer[tbd_index] = buffer;
+    tbd[tbd_index].addr = packet_buffer_paddr + buffer;
     tbd[tbd_index].data_length = length;
     tbd[tbd_index].flags = flags;
 
-    /* read back flags */
-    flags = tbd[tbd_index].flags;
-
     /* SEND */
     eth->tdar = (1 << 24);
 
+    tx_in_flight++;
     tbd_index++;
     if (tbd_index == TBD_COUNT) {
         tbd_index = 0;
     }
+
+    return true;
+}
+
+/* Hand a buffer back to the pass-through PD so it can be reused */
+static void
+release_buffer(uint64_t buffer)
+{
+    microkit_ring_entry entry = { .addr = buffer };
+    /* Rings can hold the whole pool, so this cannot fail */
+    microkit_ring_enqueue(&done_ring, entry);
+}
+
+/* Release the buffers of any frames that have finished transmitting */
+static void
+tx_reclaim(void)
+{
+    while (tx_in_flight > 0 && (tbd[tbd_clean_index].flags & (1 << 15)) == 0) {
+        release_buffer(tbd_buffer[tbd_clean_index]);
+        tx_in_flight--;
+        tbd_clean_index++;
+        if (tbd_clean_index == TBD_COUNT) {
+            tbd_clean_index = 0;
+        }
+    }
+    microkit_ring_notify(&done_ring);
+}
+
+/* Transmit frames handed to us by the pass-through PD for as long as there are free descriptors */
+static void
+handle_tx(void)
+{
+    microkit_ring_entry batch[TX_BATCH];
+
+    do {
+        while (tx_in_flight < TBD_COUNT) {
+            seL4_Word space = TBD_COUNT - tx_in_flight;
+            seL4_Word count = microkit_ring_dequeue_batch(&tx_ring, batch, space < TX_BATCH ? space : TX_BATCH);
+            if (count == 0) {
+                break;
+            }
+            for (seL4_Word i = 0; i < count; i++) {
+                send_frame(batch[i].addr, batch[i].len);
+            }
+        }
+        /* When the descriptors are all in use we are woken by the tx interrupt instead */
+    } while (tx_in_flight < TBD_COUNT && !microkit_ring_consumer_sleep(&tx_ring));
+}
+
+/* Give empty buffers from the pass-through PD to any receive descriptors without one */
+static void
+rx_refill(void)
+{
+    microkit_ring_entry buffer;
+
+    do {
+        while (rx_filled < RBD_COUNT && microkit_ring_dequeue(&free_ring, &buffer)) {
+            uint16_t flags = (1 << 15);
+            if (rbd_fill_index == RBD_COUNT - 1) {
+                flags |= (1 << 13);
+            }
+
+            rbd_buffer[rbd_fill_index] = buffer.addr;
+            rbd[rbd_fill_index].addr = packet_buffer_paddr + buffer.addr;
+            rbd[rbd_fill_index].data_length = 0;
+            rbd[rbd_fill_index].flags = flags;
+
+            rx_filled++;
+            rbd_fill_index++;
+            if (rbd_fill_index == RBD_COUNT) {
+                rbd_fill_index = 0;
+            }
+        }
+    } while (rx_filled < RBD_COUNT && !microkit_ring_consumer_sleep(&free_ring));
+
+    /* kick the rx engine if necessary */
+    eth->rdar = (1 << 24);
 }
 
 
@@ -644,30 +696,17 @@ eth_setup(void)
     rbd = (void *)ring_buffer_vaddr;
     tbd = (void *)(ring_buffer_vaddr + (sizeof(struct rbd) * RBD_COUNT));
 
+    /* Descriptors are given buffers from the packet buffer pool as they become available */
     for (unsigned i = 0; i < RBD_COUNT; i++) {
         rbd[i].data_length = 0;
-        rbd[i].flags = (1UL << 15);
-        rbd[i].addr = packet_buffer_paddr + (i * PACKET_BUFFER_SIZE);
-#if 0
-        microkit_dbg_puts("ETH: ");
-        microkit_dbg_puts(microkit_name);
-        microkit_dbg_puts("  rbd[i].addr ");
-        puthex32(rbd[i].addr);
-        microkit_dbg_puts("\n");
-#endif
+        rbd[i].flags = 0;
+        rbd[i].addr = 0;
     }
 
     for (unsigned i = 0; i < TBD_COUNT; i++) {
         tbd[i].data_length = 0;
         tbd[i].flags = 0;
-        tbd[i].addr = packet_buffer_paddr + ((RBD_COUNT + i) * PACKET_BUFFER_SIZE);
-#if 0
-        microkit_dbg_puts("ETH: ");
-        microkit_dbg_puts(microkit_name);
-        microkit_dbg_puts("  tbd[i].addr ");
-        puthex32(rbd[i].addr);
-        microkit_dbg_puts("\n");
-#endif
+        tbd[i].addr = 0;
     }
 
     rbd[RBD_COUNT-1].flags |= (1UL << 13);
@@ -696,7 +735,7 @@ eth_setup(void)
     dump_reg("rcr", eth->rcr);
     dump_reg("ecr", eth->ecr);
 
-    eth->rdar = (1 << 24);
+    rx_refill();
 
     microkit_dbg_puts(microkit_name);
     microkit_dbg_puts(": init complete -- waiting for interrupt\n");
@@ -709,10 +748,12 @@ handle_rx(microkit_channel ch, volatile struct regs *eth)
     int r;
 
     /* received at least one frame, iterate through all receive descriptor buffers */
-    for (;;) {
+    while (rx_filled > 0) {
         void *packet;
+        uint64_t buffer;
         uint16_t packet_length;
         bool pass_through = true;
+        bool replied = false;
 
         flags = rbd[rbd_index].flags;
         packet_length = rbd[rbd_index].data_length;
@@ -757,11 +798,11 @@ handle_rx(microkit_channel ch, volatile struct regs *eth)
             puthex16(rbd_index);
             microkit_dbg_puts("\n");
             for (;;) { }
-            goto make_avail;
         }
 
 
-        packet = (void *)(packet_buffer_vaddr + (rbd_index * PACKET_BUFFER_SIZE));
+        buffer = rbd_buffer[rbd_index];
+        packet = (void *)(packet_buffer_vaddr + buffer);
         r = seL4_ARM_VSpace_Invalidate_Data(3, (uintptr_t)packet, ((uintptr_t)packet) + packet_length);
         if (r != 0) {
             microkit_dbg_puts("ERR: I\n");
@@ -836,21 +877,16 @@ handle_rx(microkit_channel ch, volatile struct regs *eth)
         #if 0
                             microkit_dbg_puts("HELP: ARP packet we should reply to\n");
         #endif
-                            mycpy(temp_packet, packet,  rbd[rbd_index].data_length);
-
-                            struct eth_header *snd_hdr = (struct eth_header *)&temp_packet;
-                            /* set the MAC addresses */
-                            set_mac(snd_hdr->dest_mac, hdr->src_mac);
-                            set_mac(snd_hdr->src_mac, mac);
-                            struct arp *snd_a = (struct arp *)&snd_hdr->payload[0];
-                            snd_a->oper = swap16(2);
-                            set_mac(snd_a->sha, mac);
-                            set_ip(snd_a->spa, my_ip);
-
-                            set_mac(snd_a->tha, a->sha);
-                            set_ip(snd_a->tpa, a->spa);
-
-                            send_frame(temp_packet, rbd[rbd_index].data_length);
+                            /* Reply in place, reusing the received buffer */
+                            set_mac(hdr->dest_mac, hdr->src_mac);
+                            set_mac(hdr->src_mac, mac);
+                            a->oper = swap16(2);
+                            set_mac(a->tha, a->sha);
+                            set_ip(a->tpa, a->spa);
+                            set_mac(a->sha, mac);
+                            set_ip(a->spa, my_ip);
+
+                            replied = true;
                         }
 
                     }
@@ -894,30 +930,27 @@ handle_rx(microkit_channel ch, volatile struct regs *eth)
         #if 0
                                 microkit_dbg_puts("ICMP ECHO REQUEST\n");
         #endif
-                                mycpy(temp_packet, packet,  rbd[rbd_index].data_length);
-
-                                struct eth_header *snd_hdr = (struct eth_header *)&temp_packet;
-                                /* set the MAC addresses */
-                                set_mac(snd_hdr->dest_mac, hdr->src_mac);
-                                set_mac(snd_hdr->src_mac, mac);
-                                struct ip *snd_ip = (struct ip *)&snd_hdr->payload[0];
+                                uint8_t source_address[4];
 
-                                set_mac(snd_ip->source_address, i->dest_address);
-                                set_ip(snd_ip->dest_address, i->source_address);
+                                /* Reply in place, reusing the received buffer */
+                                set_mac(hdr->dest_mac, hdr->src_mac);
+                                set_mac(hdr->src_mac, mac);
 
-                                struct icmp *snd_icmp = (struct icmp *)(&snd_hdr->payload[header_len]);
+                                set_ip(source_address, i->source_address);
+                                set_ip(i->source_address, i->dest_address);
+                                set_ip(i->dest_address, source_address);
 
                                 /* Set reply */
-                                snd_icmp->type = 0;
+                                icmp->type = 0;
 
-                                snd_icmp->checksum = 0;
-                                snd_icmp->checksum = cksum((uint8_t *) snd_icmp, swap16(i->len) - header_len);//sizeof(struct icmp));
+                                icmp->checksum = 0;
+                                icmp->checksum = cksum((uint8_t *) icmp, swap16(i->len) - header_len);//sizeof(struct icmp));
         #if 0
                                 microkit_dbg_puts("CHECKSUM: ");
-                                puthex16(snd_icmp->checksum);
+                                puthex16(icmp->checksum);
                                 microkit_dbg_puts("\n");
         #endif
-                                send_frame(temp_packet, rbd[rbd_index].data_length);
+                                replied = true;
                             }
                         }
 
@@ -930,42 +963,35 @@ handle_rx(microkit_channel ch, volatile struct regs *eth)
         }
 #endif
 
-        if (pass_through) {
-            /* Try and send */
-            volatile struct buffer_descriptor *bd = (void *)(uintptr_t)(OUTPUT_BUFFER + (BUFFER_SIZE * output_index));
-            volatile void *output_packet = (void *)(uintptr_t)(OUTPUT_BUFFER + (BUFFER_SIZE * output_index) + DATA_OFFSET);
-            if (bd->flags == 1) {
-                microkit_dbg_puts("ETH: ");
-                microkit_dbg_puts(microkit_name);
-                microkit_dbg_puts("dropping packet, no space in channel buffer\n");
-            } else {
-                bd->data_length = rbd[rbd_index].data_length - 4; /* For the frame check sequence */
-                mycpy((void *)output_packet, packet, bd->data_length);
-                bd->flags = 1;
-                output_index++;
-                if (output_index == BUFFER_MAX) {
-                    output_index = 0;
-                }
-                microkit_notify(OUTPUT_CH);
+        if (replied) {
+            seL4_ARM_VSpace_CleanInvalidate_Data(3, (uintptr_t)packet, ((uintptr_t)packet) + packet_length);
+            if (!send_frame(buffer, packet_length)) {
+                release_buffer(buffer);
             }
+        } else if (pass_through) {
+            /* Hand the buffer itself to the pass-through PD */
+            microkit_ring_entry entry = {
+                .addr = buffer,
+                .len = packet_length - 4, /* For the frame check sequence */
+            };
+            /* Rings can hold the whole pool, so this cannot fail */
+            microkit_ring_enqueue(&rx_ring, entry);
+        } else {
+            release_buffer(buffer);
         }
 
-make_avail:
-        /* make it available */
-        flags = (1 << 15);
-        if (rbd_index == RBD_COUNT - 1) {
-            flags |= (1 << 13);
-        }
-        rbd[rbd_index].flags = flags;
-
+        /* The descriptor has no buffer until it is refilled */
+        rx_filled--;
         rbd_index++;
         if (rbd_index == RBD_COUNT) {
             rbd_index = 0;
         }
     }
 
-    /* kick the rx engine if necessary */
-    eth->rdar = (1 << 24);
+    microkit_ring_notify(&rx_ring);
+    microkit_ring_notify(&done_ring);
+
+    rx_refill();
 }
 
 static void
@@ -999,6 +1025,9 @@ handle_eth(microkit_channel ch, volatile struct regs *eth)
     }
 
     if (eir & (1 << 27)) {
+        /* Frames have been sent, so descriptors may be free for more */
+        tx_reclaim();
+        handle_tx();
     }
 
     microkit_irq_ack(ch);
@@ -1020,7 +1049,15 @@ init(void)
     microkit_dbg_puts(microkit_name);
     microkit_dbg_puts(": elf PD init function running\n");
 
+    microkit_ring_init(&rx_ring, rx_ring_vaddr, POOL_RING_SIZE, RX_CH);
+    microkit_ring_init(&tx_ring, tx_ring_vaddr, POOL_RING_SIZE, TX_CH);
+    microkit_ring_init(&done_ring, done_ring_vaddr, POOL_RING_SIZE, DONE_CH);
+    microkit_ring_init(&free_ring, free_ring_vaddr, POOL_RING_SIZE, FREE_CH);
+
     eth_setup();
+
+    /* Ask to be notified of frames to transmit */
+    handle_tx();
 }
 
 void
@@ -1032,41 +1069,12 @@ notified(microkit_channel ch)
             handle_eth(ch, eth);
             break;
 
-        case INPUT_CH:
-#if 0
-            microkit_dbg_puts("ETH: ");
-            microkit_dbg_puts(microkit_name);
-            microkit_dbg_puts("  got input notification\n");
-#endif
-            for (;;) {
-                volatile struct buffer_descriptor *bd = (void *)(uintptr_t)(INPUT_BUFFER + (BUFFER_SIZE * input_index));
-                volatile void *pkt = (void *)(uintptr_t)(INPUT_BUFFER + (BUFFER_SIZE * input_index) + DATA_OFFSET);
-                if (bd->flags == 0) {
-                    break;
-                }
-#if 0
-                microkit_dbg_puts("ETH: packet: ");
-                puthex16(input_index);
-                microkit_dbg_puts("packet length: ");
-                puthex16(bd->data_length);
-                microkit_dbg_puts("\n");
-#endif
-                send_frame((void*)pkt, bd->data_length);
-                bd->flags = 0;
-
-                input_index++;
-                if (input_index == BUFFER_MAX) {
-                    input_index = 0;
-                }
-            }
+        case TX_CH:
+            handle_tx();
             break;
 
-        case OUTPUT_CH:
-#if 0
-            microkit_dbg_puts("ETH: ");
-            microkit_dbg_puts(microkit_name);
-            microkit_dbg_puts("got output ack (is this needed?)\n");
-#endif
+        case FREE_CH:
+            rx_refill();
             break;
 
         default:
@@ -6,11 +6,17 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <microkit.h>
+#include <microkit_clock.h>
 
 #define IRQ_CH 3
 
+/* The counter runs from the 24 MHz crystal, with no prescaling */
+#define GPT_FREQUENCY 24000000
+
 uintptr_t gpt_regs;
 uintptr_t gpt_regs_clk;
+/* Published for the other PDs to read the time from, see microkit_clock.h */
+uintptr_t clock_page;
 static volatile uint32_t *gpt;
 static volatile uint32_t *lpcg;
 
@@ -56,6 +62,26 @@ puthex32(uint32_t x)
     microkit_dbg_puts(buffer);
 }
 
+static uint64_t get_ticks(void) {
+    /* FIXME: If an overflow interrupt happens in the middle here we are in trouble */
+    uint64_t overflow = overflow_count;
+    uint32_t sr1 = gpt[SR];
+    uint32_t cnt = gpt[CNT];
+    uint32_t sr2 = gpt[SR];
+    if ((sr2 & (1 << 5)) && (!(sr1 & (1 << 5)))) {
+        /* rolled-over during - 64-bit time must be the overflow */
+        cnt = gpt[CNT];
+        overflow++;
+    }
+    return (overflow << 32) | cnt;
+}
+
+static void
+publish_clock(void)
+{
+    microkit_clock_publish((microkit_clock *) clock_page, get_ticks(), GPT_FREQUENCY, CNT * sizeof(uint32_t));
+}
+
 void
 init(void)
 {
@@ -69,15 +95,24 @@ init(void)
 
 
     uint32_t cr = (
+        (1 << 10) | // Enable 24 MHz crystal
         (1 << 9) | // Free run mode
-        (1 << 6) | // Peripheral clocks
+        (5 << 6) | // 24 MHz crystal clock
         (1) // Enable
     );
+    gpt[PR] = 0;
     gpt[CR] = cr;
 
+    /*
+     * Readers of the clock extend the low 32 bits of the counter themselves,
+     * so it is published twice in each 32-bit epoch, on rollover and half way
+     */
+    gpt[OCR2] = 0x80000000;
     gpt[IR] = (
-        (1 << 5) // rollover interrupt
+        (1 << 5) | // rollover interrupt
+        (1 << 1) // output compare 2 interrupt
     );
+    publish_clock();
 
     microkit_dbg_puts("CR: ");
     puthex32(gpt[0]);
@@ -101,6 +136,9 @@ notified(microkit_channel ch)
                 overflow_count++;
                 /* FIXME: set the next timeout if required */
             }
+            if (sr & ((1 << 5) | (1 << 1))) {
+                publish_clock();
+            }
             if (sr & 1) {
                 gpt[IR] &= ~1;
                 timeout_active = false;
@@ -146,20 +184,6 @@ notified(microkit_channel ch)
     }
 }
 
-static uint64_t get_ticks(void) {
-    /* FIXME: If an overflow interrupt happens in the middle here we are in trouble */
-    uint64_t overflow = overflow_count;
-    uint32_t sr1 = gpt[SR];
-    uint32_t cnt = gpt[CNT];
-    uint32_t sr2 = gpt[SR];
-    if ((sr2 & (1 << 5)) && (!(sr1 & (1 << 5)))) {
-        /* rolled-over during - 64-bit time must be the overflow */
-        cnt = gpt[CNT];
-        overflow++;
-    }
-    return (overflow << 32) | cnt;
-}
-
 seL4_MessageInfo_t
 protected(microkit_channel ch, microkit_msginfo msginfo)
 {
@@ -5,40 +5,56 @@
  */
 #include <stdint.h>
 #include <microkit.h>
+#include <microkit_ring.h>
+#include <microkit_clock.h>
 
-#define GPT_CH 0
-#define OUTER_INPUT_CH 1
-#define OUTER_OUTPUT_CH 2
-#define INNER_INPUT_CH 3
-#define INNER_OUTPUT_CH 4
-
-#define BUFFER_SIZE (2 * 1024)
-#define DATA_OFFSET 64
-
-#define OUTER_INPUT outer_input_vaddr
-#define OUTER_OUTPUT outer_output_vaddr
-#define INNER_INPUT inner_input_vaddr
-#define INNER_OUTPUT inner_output_vaddr
-
-
-#define BUFFER_MAX 1024
+#include "pool.h"
 
-unsigned outer_input_index = 0;
-unsigned inner_input_index = 0;
-
-unsigned outer_output_index = 0;
-unsigned inner_output_index = 0;
+#define GPT_CH 0
+#define OUTER_RX_CH 1
+#define OUTER_TX_CH 2
+#define INNER_RX_CH 3
+#define INNER_TX_CH 4
+#define OUTER_DONE_CH 5
+#define OUTER_FREE_CH 6
+#define INNER_DONE_CH 7
+#define INNER_FREE_CH 8
 
-uintptr_t outer_input_vaddr;
-uintptr_t outer_output_vaddr;
-uintptr_t inner_input_vaddr;
-uintptr_t inner_output_vaddr;
+#define BATCH 32
 
-struct buffer_descriptor {
-    uint16_t data_length;
-    uint16_t flags;
+/*
+ * Frames are forwarded by handing their buffer in the shared packet buffer
+ * pool from one driver to the other, see pool.h. This PD never touches the
+ * payload, the pool is only mapped for inspecting frames when debugging.
+ */
+uintptr_t packet_pool_vaddr;
+
+uintptr_t outer_rx_vaddr;
+uintptr_t outer_tx_vaddr;
+uintptr_t outer_done_vaddr;
+uintptr_t outer_free_vaddr;
+uintptr_t inner_rx_vaddr;
+uintptr_t inner_tx_vaddr;
+uintptr_t inner_done_vaddr;
+uintptr_t inner_free_vaddr;
+
+static microkit_ring outer_rx;
+static microkit_ring outer_tx;
+static microkit_ring outer_done;
+static microkit_ring outer_free;
+static microkit_ring inner_rx;
+static microkit_ring inner_tx;
+static microkit_ring inner_done;
+static microkit_ring inner_free;
+
+struct pass_stats {
+    uint64_t frames;
+    uint64_t bytes;
 };
 
+static struct pass_stats outer_to_inner;
+static struct pass_stats inner_to_outer;
+static uint64_t stats_start;
 
 volatile uint64_t *shared_counter = (uint64_t *)(uintptr_t)0x1800000;
 
@@ -107,31 +123,6 @@ puthex64(uint64_t x)
     microkit_dbg_puts(buffer);
 }
 
-static void
-mycpy(volatile void *dst, volatile void *src, unsigned int length)
-{
-    volatile uint64_t *d = dst;
-    volatile uint64_t *s = src;
-    int i = 0;
-    int l = length / 64;
-    if (length % 64) {
-        l++;
-    }
-    while (l) {
-        d[i] = s[i];
-        d[i + 1] = s[i + 1];
-        d[i + 2] = s[i + 2];
-        d[i + 3] = s[i + 3];
-        d[i + 4] = s[i + 4];
-        d[i + 5] = s[i + 5];
-        d[i + 6] = s[i + 6];
-        d[i + 7] = s[i + 7];
-        l--;
-        i += 8;
-    }
-}
-
-
 static void
 dump_hex(const uint8_t *d, unsigned int length)
 {
@@ -157,15 +148,38 @@ dump_hex(const uint8_t *d, unsigned int length)
     }
 }
 
-#define GPT_CHANNEL 0
+static void
+putdec(uint64_t x)
+{
+    char buffer[21];
+    unsigned i = sizeof(buffer) - 1;
+    buffer[i] = 0;
+    do {
+        buffer[--i] = '0' + (x % 10);
+        x /= 10;
+    } while (x);
+    microkit_dbg_puts(&buffer[i]);
+}
 
 static inline uint64_t
-gpt_ticks(void)
+get_sys_counter(void)
 {
-    (void) microkit_ppcall(GPT_CHANNEL, microkit_msginfo_new(0, 0));
-    return microkit_mr_get(0);
+    uint64_t r;
+    asm volatile ("isb sy" : : : "memory");
+    asm volatile("mrs %0, cntpct_el0" : "=r" (r));
+    return r;
 }
 
+static inline uint64_t
+get_sys_counter_freq(void)
+{
+    uint64_t r;
+    asm volatile("mrs %0, cntfrq_el0" : "=r" (r));
+    return r;
+}
+
+#define GPT_CHANNEL 0
+
 static inline void
 gpt_timer(uint64_t timeout)
 {
@@ -173,107 +187,142 @@ gpt_timer(uint64_t timeout)
     (void) microkit_ppcall(GPT_CHANNEL, microkit_msginfo_new(1, 1));
 }
 
-
-void
-init(void)
+static void
+report_stats(const char *name, struct pass_stats *stats, uint64_t elapsed)
 {
-    microkit_dbg_puts("pass protection domain init function running\n");
+    microkit_dbg_puts("PASS: ");
+    microkit_dbg_puts(name);
+    microkit_dbg_puts(": ");
+    putdec(stats->frames);
+    microkit_dbg_puts(" frames, ");
+    putdec(stats->bytes);
+    microkit_dbg_puts(" bytes, ");
+    putdec(elapsed ? stats->bytes * get_sys_counter_freq() / elapsed / 1024 : 0);
+    microkit_dbg_puts(" KiB/s\n");
+
+    stats->frames = 0;
+    stats->bytes = 0;
+}
 
-    /* Example calling a PP */
-    microkit_dbg_puts("ticks: ");
-    puthex32(gpt_ticks());
-    microkit_dbg_puts("\n");
+/* Print how much was forwarded in each direction since the last report */
+static void
+report_throughput(void)
+{
+    uint64_t now = get_sys_counter();
+    uint64_t elapsed = now - stats_start;
 
-    gpt_timer(0x1000000);
+    report_stats("outer -> inner", &outer_to_inner, elapsed);
+    report_stats("inner -> outer", &inner_to_outer, elapsed);
+    stats_start = now;
 }
 
-void
-notified(microkit_channel ch)
+/* Hand every frame a driver has received to the other driver to transmit */
+static void
+forward(microkit_ring *rx, microkit_ring *tx, struct pass_stats *stats)
 {
-    switch (ch) {
-        case GPT_CH:
-            microkit_dbg_puts("tick! ticks=");
-            puthex64(gpt_ticks());
-            microkit_dbg_puts("\n");
-            gpt_timer(0x1000000);
-
-        case OUTER_INPUT_CH:
+    microkit_ring_entry batch[BATCH];
+    seL4_Word count;
 
-            for (;;) {
-                volatile struct buffer_descriptor *bd = (void *)(uintptr_t)(OUTER_INPUT + (BUFFER_SIZE * outer_input_index));
-                volatile void *pkt = (void *)(uintptr_t)(OUTER_INPUT + (BUFFER_SIZE * outer_input_index) + DATA_OFFSET);
-                if (bd->flags == 0) {
-                    break;
-                }
+    do {
+        while ((count = microkit_ring_dequeue_batch(rx, batch, BATCH)) != 0) {
+            for (seL4_Word i = 0; i < count; i++) {
+                stats->bytes += batch[i].len;
+            }
+            stats->frames += count;
 
-                outer_input_index++;
-                if (outer_input_index == BUFFER_MAX) {
-                    outer_input_index = 0;
-                }
+            /* Rings can hold the whole pool, so this cannot fail */
+            microkit_ring_enqueue_batch(tx, batch, count);
+            microkit_ring_notify(tx);
+        }
+    } while (!microkit_ring_consumer_sleep(rx));
+}
 
-                volatile struct buffer_descriptor *obd = (void *)(uintptr_t)(INNER_OUTPUT + (BUFFER_SIZE * inner_output_index));
-                volatile void *opkt = (void *)(uintptr_t)(INNER_OUTPUT + (BUFFER_SIZE * inner_output_index) + DATA_OFFSET);
-                if (obd->flags == 1) {
-                    microkit_dbg_puts("PASS: outer can't pass buffer (no space for inner)\n");
+/* Return buffers a driver has finished with to the free ring of their home driver */
+static void
+return_buffers(microkit_ring *done)
+{
+    microkit_ring_entry batch[BATCH];
+    seL4_Word count;
+
+    do {
+        while ((count = microkit_ring_dequeue_batch(done, batch, BATCH)) != 0) {
+            for (seL4_Word i = 0; i < count; i++) {
+                if (batch[i].addr / POOL_BUFFER_SIZE < POOL_INNER_FIRST) {
+                    microkit_ring_enqueue(&outer_free, batch[i]);
                 } else {
-                    obd->data_length = bd->data_length;
-
-                    mycpy(opkt, pkt, bd->data_length);
-                    obd->flags = 1;
-
-                    microkit_notify(INNER_OUTPUT_CH);
-
-                    inner_output_index++;
-                    if (inner_output_index == BUFFER_MAX) {
-                        inner_output_index = 0;
-                    }
+                    microkit_ring_enqueue(&inner_free, batch[i]);
                 }
-                bd->flags = 0;
             }
+            microkit_ring_notify(&outer_free);
+            microkit_ring_notify(&inner_free);
+        }
+    } while (!microkit_ring_consumer_sleep(done));
+}
 
-            break;
+void
+init(void)
+{
+    microkit_dbg_puts("pass protection domain init function running\n");
 
-        case OUTER_OUTPUT_CH:
-            microkit_dbg_puts("outer output\n");
-            break;
+    microkit_ring_init(&outer_rx, outer_rx_vaddr, POOL_RING_SIZE, OUTER_RX_CH);
+    microkit_ring_init(&outer_tx, outer_tx_vaddr, POOL_RING_SIZE, OUTER_TX_CH);
+    microkit_ring_init(&outer_done, outer_done_vaddr, POOL_RING_SIZE, OUTER_DONE_CH);
+    microkit_ring_init(&outer_free, outer_free_vaddr, POOL_RING_SIZE, OUTER_FREE_CH);
+    microkit_ring_init(&inner_rx, inner_rx_vaddr, POOL_RING_SIZE, INNER_RX_CH);
+    microkit_ring_init(&inner_tx, inner_tx_vaddr, POOL_RING_SIZE, INNER_TX_CH);
+    microkit_ring_init(&inner_done, inner_done_vaddr, POOL_RING_SIZE, INNER_DONE_CH);
+    microkit_ring_init(&inner_free, inner_free_vaddr, POOL_RING_SIZE, INNER_FREE_CH);
+
+    /* Give each driver its half of the pool to receive into */
+    for (uint64_t i = 0; i < POOL_BUFFER_COUNT; i++) {
+        microkit_ring_entry buffer = { .addr = i * POOL_BUFFER_SIZE };
+        microkit_ring_enqueue(i < POOL_INNER_FIRST ? &outer_free : &inner_free, buffer);
+    }
+    microkit_ring_notify(&outer_free);
+    microkit_ring_notify(&inner_free);
 
-        case INNER_INPUT_CH:
-            for (;;) {
-                volatile struct buffer_descriptor *bd = (void *)(uintptr_t)(INNER_INPUT + (BUFFER_SIZE * inner_input_index));
-                volatile void *pkt = (void *)(uintptr_t)(INNER_INPUT + (BUFFER_SIZE * inner_input_index) + DATA_OFFSET);
-                if (bd->flags == 0) {
-                    break;
-                }
+    /* Drain anything the drivers sent before we started, and ask to be notified of more */
+    forward(&outer_rx, &inner_tx, &outer_to_inner);
+    forward(&inner_rx, &outer_tx, &inner_to_outer);
+    return_buffers(&outer_done);
+    return_buffers(&inner_done);
 
-                inner_input_index++;
-                if (inner_input_index == BUFFER_MAX) {
-                    inner_input_index = 0;
-                }
+    /* The time is read from the clock published by the GPT PD, without calling it */
+    microkit_dbg_puts("time: ");
+    putdec(microkit_time_now());
+    microkit_dbg_puts(" ns\n");
 
-                volatile struct buffer_descriptor *obd = (void *)(uintptr_t)(OUTER_OUTPUT + (BUFFER_SIZE * outer_output_index));
-                volatile void *opkt = (void *)(uintptr_t)(OUTER_OUTPUT + (BUFFER_SIZE * outer_output_index) + DATA_OFFSET);
-                if (obd->flags == 1) {
-                    microkit_dbg_puts("PASS: inner can't pass buffer (no space for outer)\n");
-                } else {
-                    obd->data_length = bd->data_length;
-                    mycpy(opkt, pkt, bd->data_length);
-                    obd->flags = 1;
+    /* Example calling a PP */
+    stats_start = get_sys_counter();
+    gpt_timer(0x1000000);
+}
 
-                    microkit_notify(OUTER_OUTPUT_CH);
+void
+notified(microkit_channel ch)
+{
+    switch (ch) {
+        case GPT_CH:
+            microkit_dbg_puts("tick! time=");
+            putdec(microkit_time_now());
+            microkit_dbg_puts(" ns\n");
+            report_throughput();
+            gpt_timer(0x1000000);
+            break;
 
-                    outer_output_index++;
-                    if (outer_output_index == BUFFER_MAX) {
-                        outer_output_index = 0;
-                    }
-                }
+        case OUTER_RX_CH:
+            forward(&outer_rx, &inner_tx, &outer_to_inner);
+            break;
 
-                bd->flags = 0;
+        case INNER_RX_CH:
+            forward(&inner_rx, &outer_tx, &inner_to_outer);
+            break;
 
-            }
+        case OUTER_DONE_CH:
+            return_buffers(&outer_done);
             break;
 
-        case INNER_OUTPUT_CH:
-            microkit_dbg_puts("inner output\n");
+        case INNER_DONE_CH:
+            return_buffers(&inner_done);
             break;
 
         default:
@@ -281,4 +330,4 @@ notified(microkit_channel ch)
             break;
         /* ignore any other channels */
     }
-}
\ No newline at end of file
+}
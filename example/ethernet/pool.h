@@ -0,0 +1,40 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Layout of the packet buffer pool shared by the ethernet drivers and the
+ * pass-through PD.
+ *
+ * Frames are never copied between PDs. Instead ownership of a buffer moves
+ * with a ring entry whose 'addr' is the offset of the buffer in the pool and
+ * whose 'len' is the length of the frame. Each driver has four rings to the
+ * pass-through PD:
+ *
+ *   rx:   frames the driver received, to be forwarded
+ *   tx:   frames for the driver to transmit
+ *   done: buffers the driver has finished with (transmitted or dropped)
+ *   free: empty buffers for the driver to receive into
+ *
+ * Every buffer has a home driver, which it is returned to on the free ring
+ * once it is done with, so buffers do not drift from one driver to the other
+ * when traffic is asymmetric.
+ */
+
+#pragma once
+
+#define POOL_BUFFER_SIZE (2 * 1024)
+#define POOL_BUFFER_COUNT 1024
+#define POOL_SIZE (POOL_BUFFER_SIZE * POOL_BUFFER_COUNT)
+
+/* The first half of the pool belongs to eth_outer, the second to eth_inner */
+#define POOL_OUTER_FIRST 0
+#define POOL_INNER_FIRST (POOL_BUFFER_COUNT / 2)
+
+/*
+ * Must match the sizes of the rings in ethernet.system. Every ring can hold
+ * the entire pool, so enqueuing a buffer never fails.
+ */
+#define POOL_RING_SIZE 0x5000
@@ -6,10 +6,19 @@
 #include <stdint.h>
 #include <microkit.h>
 
+/* Both are changed before crashing, the restarter resets them to their initial values */
+static uint32_t magic = 0x600df00d;
+static uint8_t starts;
+
 void init(void)
 {
     int *x = 0;
     microkit_dbg_puts("crasher, starting\n");
+    starts++;
+    if (magic != 0x600df00d || starts != 1) {
+        microkit_dbg_puts("crasher: memory was not reset\n");
+    }
+    magic = 0;
     /* Crash! */
     *x = 1;
 }
@@ -49,13 +49,13 @@ seL4_Bool fault(microkit_child child, microkit_msginfo msginfo, microkit_msginfo
     microkit_dbg_puts("\n");
     restart_count++;
     if (restart_count < 10) {
-        microkit_pd_restart(child, 0x200000);
-        microkit_dbg_puts("restarter: restarted\n");
+        microkit_pd_reset(child);
+        microkit_dbg_puts("restarter: reset\n");
     } else {
         microkit_pd_stop(child);
         microkit_dbg_puts("restarter: too many restarts - PD stopped\n");
     }
 
-    /* We explicitly restart the thread so we do not need to 'reply' to the fault. */
+    /* We explicitly reset the thread so we do not need to 'reply' to the fault. */
     return seL4_False;
 }
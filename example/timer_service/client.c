@@ -0,0 +1,81 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdint.h>
+#include <microkit.h>
+#include <microkit_clock.h>
+#include "timer_service.h"
+
+/*
+ * Uses the timer service for two one-shot timeouts and a periodic timer,
+ * which is cancelled after it has expired a few times. The time is read from
+ * the clock published by the service, without calling it.
+ */
+
+#define TIMER_CH 0
+
+#define NS_IN_MS 1000000ULL
+
+#define ONE_SHOT_SHORT 0
+#define ONE_SHOT_LONG 1
+#define PERIODIC 2
+
+#define PERIODIC_COUNT 5
+
+static unsigned periodic_count;
+
+static void put64(uint64_t x)
+{
+    char buffer[21];
+    unsigned i = sizeof(buffer) - 1;
+    buffer[i] = 0;
+    do {
+        buffer[--i] = '0' + (x % 10);
+        x /= 10;
+    } while (x);
+    microkit_dbg_puts(&buffer[i]);
+}
+
+static void report(const char *what)
+{
+    microkit_dbg_puts(microkit_name);
+    microkit_dbg_puts("|");
+    microkit_dbg_puts(what);
+    microkit_dbg_puts(" at ");
+    put64(microkit_time_now() / NS_IN_MS);
+    microkit_dbg_puts(" ms\n");
+}
+
+void init(void)
+{
+    report("setting timeouts");
+    timer_service_set_timeout(TIMER_CH, ONE_SHOT_SHORT, 1000 * NS_IN_MS, 0);
+    timer_service_set_timeout(TIMER_CH, ONE_SHOT_LONG, 2500 * NS_IN_MS, 0);
+    timer_service_set_periodic(TIMER_CH, PERIODIC, 300 * NS_IN_MS);
+}
+
+void notified(microkit_channel ch)
+{
+    if (ch != TIMER_CH) {
+        microkit_dbg_puts("CLIENT|ERROR: unexpected notification\n");
+        return;
+    }
+
+    uint32_t expired = timer_service_expired(TIMER_CH);
+    if (expired & (1U << ONE_SHOT_SHORT)) {
+        report("short timeout expired");
+    }
+    if (expired & (1U << ONE_SHOT_LONG)) {
+        report("long timeout expired");
+    }
+    if (expired & (1U << PERIODIC)) {
+        report("periodic timeout expired");
+        periodic_count++;
+        if (periodic_count == PERIODIC_COUNT) {
+            timer_service_cancel(TIMER_CH, PERIODIC);
+            report("periodic timeout cancelled");
+        }
+    }
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdint.h>
+#include "timer_driver.h"
+
+/*
+ * Timer driver for the i.MX general purpose timer (GPT) on the TQMa8XQP.
+ *
+ * The GPT has a free running 32-bit counter, extended to 64 bits by counting
+ * rollovers, and a 32-bit compare register. A deadline is only programmed
+ * into the compare register once the counter is in the same 32-bit epoch,
+ * until then the rollover IRQ wakes up the service to program it again.
+ */
+
+uintptr_t gpt_regs;
+static volatile uint32_t *gpt;
+
+#define CR 0
+#define PR 1
+#define SR 2
+#define IR 3
+#define OCR1 4
+#define CNT 9
+
+#define CR_EN (1 << 0)
+#define CR_FRR (1 << 9)
+#define CR_EN_24M (1 << 10)
+#define CR_CLKSRC_24M (5 << 6)
+
+#define SR_OF1 (1 << 0)
+#define SR_ROV (1 << 5)
+
+#define IR_OF1IE (1 << 0)
+#define IR_ROVIE (1 << 5)
+
+/* The counter runs from the 24 MHz crystal, with no prescaling */
+#define GPT_FREQUENCY 24000000ULL
+
+static uint32_t overflow_count;
+
+static uint64_t get_ticks(void)
+{
+    uint64_t overflow = overflow_count;
+    uint32_t cnt = gpt[CNT];
+    if (gpt[SR] & SR_ROV) {
+        /*
+         * The counter has rolled over but the IRQ has not been handled yet.
+         * The count read may have been from either side of the rollover, so
+         * read it again now that it is definitely after it.
+         */
+        cnt = gpt[CNT];
+        overflow++;
+    }
+    return (overflow << 32) | cnt;
+}
+
+void timer_driver_init(void)
+{
+    gpt = (volatile uint32_t *) gpt_regs;
+
+    gpt[CR] = 0;
+    gpt[PR] = 0;
+    gpt[SR] = gpt[SR];
+    gpt[IR] = IR_ROVIE;
+    gpt[CR] = CR_EN_24M | CR_CLKSRC_24M | CR_FRR | CR_EN;
+}
+
+uint64_t timer_driver_frequency(void)
+{
+    return GPT_FREQUENCY;
+}
+
+uint64_t timer_driver_count(void)
+{
+    return get_ticks();
+}
+
+uintptr_t timer_driver_counter_offset(void)
+{
+    return CNT * sizeof(uint32_t);
+}
+
+void timer_driver_set_deadline(uint64_t count)
+{
+    gpt[IR] = IR_ROVIE;
+    gpt[SR] = SR_OF1;
+    if ((count >> 32) == (get_ticks() >> 32)) {
+        gpt[OCR1] = count;
+        gpt[IR] = IR_ROVIE | IR_OF1IE;
+    }
+}
+
+void timer_driver_stop(void)
+{
+    /* The rollover IRQ stays enabled to keep counting epochs */
+    gpt[IR] = IR_ROVIE;
+}
+
+void timer_driver_handle_irq(void)
+{
+    uint32_t sr = gpt[SR];
+    gpt[SR] = sr;
+    if (sr & SR_ROV) {
+        overflow_count++;
+    }
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdint.h>
+#include "timer_driver.h"
+
+/*
+ * Timer driver for the Meson timers on the Odroid-C4.
+ *
+ * Timer E is a 64-bit timestamp counting microseconds. Timer A counts down
+ * a 16-bit timeout in units of 1 us, 10 us, 100 us or 1 ms and raises the IRQ
+ * when it reaches zero, so a deadline is programmed as a timeout relative to
+ * the current time, using the finest unit that it fits in. Deadlines too far
+ * away for even the coarsest unit fire early and are programmed again.
+ */
+
+uintptr_t timer_regs;
+
+#define TIMER_REG_START 0x140
+
+#define TIMER_A_INPUT_CLK 0
+#define TIMER_E_INPUT_CLK 8
+#define TIMER_A_INPUT_CLK_MASK (0b11 << TIMER_A_INPUT_CLK)
+#define TIMER_A_EN (1 << 16)
+#define TIMER_A_MODE (1 << 12)
+
+#define TIMESTAMP_TIMEBASE_1_US 0b001
+
+#define TIMEOUT_MAX 0xffff
+
+/* Timer E counts microseconds */
+#define TIMER_E_FREQUENCY 1000000ULL
+
+typedef struct {
+    uint32_t mux;
+    uint32_t timer_a;
+    uint32_t timer_b;
+    uint32_t timer_c;
+    uint32_t timer_d;
+    uint32_t unused[13];
+    uint32_t timer_e;
+    uint32_t timer_e_hi;
+    uint32_t mux1;
+    uint32_t timer_f;
+    uint32_t timer_g;
+    uint32_t timer_h;
+    uint32_t timer_i;
+} meson_timer_reg_t;
+
+static volatile meson_timer_reg_t *regs;
+
+/* Microseconds per count of timer A for each timeout timebase, finest first */
+static const uint64_t timeout_timebases[] = { 1, 10, 100, 1000 };
+
+void timer_driver_init(void)
+{
+    regs = (void *)(timer_regs + TIMER_REG_START);
+
+    regs->mux = TIMESTAMP_TIMEBASE_1_US << TIMER_E_INPUT_CLK;
+    regs->timer_e = 0;
+}
+
+uint64_t timer_driver_frequency(void)
+{
+    return TIMER_E_FREQUENCY;
+}
+
+uint64_t timer_driver_count(void)
+{
+    uint64_t initial_high = regs->timer_e_hi;
+    uint64_t low = regs->timer_e;
+    uint64_t high = regs->timer_e_hi;
+    if (high != initial_high) {
+        low = regs->timer_e;
+    }
+
+    return (high << 32) | low;
+}
+
+uintptr_t timer_driver_counter_offset(void)
+{
+    return TIMER_REG_START + __builtin_offsetof(meson_timer_reg_t, timer_e);
+}
+
+void timer_driver_set_deadline(uint64_t count)
+{
+    uint64_t now = timer_driver_count();
+    uint64_t timeout_us = count > now ? count - now : 1;
+
+    unsigned timebase = 0;
+    while (timebase < 3 && timeout_us > TIMEOUT_MAX * timeout_timebases[timebase]) {
+        timebase++;
+    }
+    uint64_t timeout = (timeout_us + timeout_timebases[timebase] - 1) / timeout_timebases[timebase];
+    if (timeout > TIMEOUT_MAX) {
+        timeout = TIMEOUT_MAX;
+    }
+
+    /* One-shot, in the chosen timebase */
+    uint32_t mux = regs->mux & ~(TIMER_A_EN | TIMER_A_MODE | TIMER_A_INPUT_CLK_MASK);
+    regs->mux = mux;
+    regs->timer_a = timeout;
+    regs->mux = mux | (timebase << TIMER_A_INPUT_CLK) | TIMER_A_EN;
+}
+
+void timer_driver_stop(void)
+{
+    regs->mux &= ~TIMER_A_EN;
+}
+
+void timer_driver_handle_irq(void)
+{
+    /* Timer A stops by itself after a one-shot timeout, there is nothing to clear */
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <microkit.h>
+#include <microkit_clock.h>
+#include "timer_service.h"
+#include "timer_driver.h"
+
+/*
+ * The timer service, see timer_service.h for the client interface.
+ *
+ * Pending timeouts are kept in a binary min-heap ordered by deadline, so
+ * the earliest deadline, which the hardware is programmed for, is always at
+ * the top. Each timeout records its position in the heap so that it can be
+ * cancelled or replaced without searching for it.
+ *
+ * The IRQ of the timer is on channel 0, every other channel is a client.
+ *
+ * If the service has a clock page, it publishes the clock for clients to
+ * read the time without calling the service, see microkit_clock.h. The
+ * clock has to be published again before the low 32 bits of the counter
+ * wrap, which is done with a periodic timeout of the service's own, in the
+ * slots of channel 0.
+ */
+
+#define IRQ_CH 0
+#define CLOCK_TIMEOUT_HANDLE (IRQ_CH * TIMER_SERVICE_MAX_TIMEOUTS)
+
+#define MAX_CLIENTS MICROKIT_MAX_CHANNELS
+#define NOT_PENDING UINT16_MAX
+
+struct timeout {
+    uint64_t deadline;
+    /* Zero for one-shot timeouts */
+    uint64_t period;
+    /* Index into the heap, or NOT_PENDING */
+    uint16_t heap_index;
+};
+
+static struct timeout timeouts[MAX_CLIENTS][TIMER_SERVICE_MAX_TIMEOUTS];
+/* Timeouts that have expired and not yet been collected by each client */
+static uint32_t expired[MAX_CLIENTS];
+
+/* Each heap entry is a timeout handle, the client's channel times TIMER_SERVICE_MAX_TIMEOUTS plus the id */
+static uint16_t heap[MAX_CLIENTS * TIMER_SERVICE_MAX_TIMEOUTS];
+static unsigned heap_size;
+
+/* Set with setvar_vaddr if the service publishes the clock */
+uintptr_t clock_page;
+
+/* The time is always microkit_clock_ns(count, clock_mult), like for the clients */
+static uint64_t clock_mult;
+
+static uint64_t now(void)
+{
+    return microkit_clock_ns(timer_driver_count(), clock_mult);
+}
+
+static uint64_t ns_to_count_round_up(uint64_t ns, uint64_t frequency)
+{
+    return ns / MICROKIT_NS_IN_S * frequency
+           + ((ns % MICROKIT_NS_IN_S) * frequency + MICROKIT_NS_IN_S - 1) / MICROKIT_NS_IN_S;
+}
+
+/* A count at which the time is at least 'ns', so that the IRQ is never raised before it */
+static uint64_t ns_to_count(uint64_t ns)
+{
+    uint64_t frequency = timer_driver_frequency();
+    uint64_t count = ns_to_count_round_up(ns, frequency);
+
+    /* clock_mult is rounded down, so the count can be a little short, more so the longer the uptime */
+    uint64_t time;
+    while ((time = microkit_clock_ns(count, clock_mult)) < ns) {
+        count += ns_to_count_round_up(ns - time, frequency);
+    }
+    return count;
+}
+
+static void publish_clock(void)
+{
+    microkit_clock_publish((microkit_clock *) clock_page, timer_driver_count(), timer_driver_frequency(),
+                           timer_driver_counter_offset());
+}
+
+static inline struct timeout *timeout_from_handle(uint16_t handle)
+{
+    return &timeouts[handle / TIMER_SERVICE_MAX_TIMEOUTS][handle % TIMER_SERVICE_MAX_TIMEOUTS];
+}
+
+static inline uint64_t heap_deadline(unsigned i)
+{
+    return timeout_from_handle(heap[i])->deadline;
+}
+
+static inline void heap_set(unsigned i, uint16_t handle)
+{
+    heap[i] = handle;
+    timeout_from_handle(handle)->heap_index = i;
+}
+
+static void heap_sift_up(unsigned i)
+{
+    uint16_t handle = heap[i];
+    uint64_t deadline = timeout_from_handle(handle)->deadline;
+
+    while (i > 0) {
+        unsigned parent = (i - 1) / 2;
+        if (heap_deadline(parent) <= deadline) {
+            break;
+        }
+        heap_set(i, heap[parent]);
+        i = parent;
+    }
+    heap_set(i, handle);
+}
+
+static void heap_sift_down(unsigned i)
+{
+    uint16_t handle = heap[i];
+    uint64_t deadline = timeout_from_handle(handle)->deadline;
+
+    for (;;) {
+        unsigned child = 2 * i + 1;
+        if (child >= heap_size) {
+            break;
+        }
+        if (child + 1 < heap_size && heap_deadline(child + 1) < heap_deadline(child)) {
+            child++;
+        }
+        if (deadline <= heap_deadline(child)) {
+            break;
+        }
+        heap_set(i, heap[child]);
+        i = child;
+    }
+    heap_set(i, handle);
+}
+
+static void heap_insert(uint16_t handle)
+{
+    heap[heap_size] = handle;
+    heap_size++;
+    heap_sift_up(heap_size - 1);
+}
+
+static void heap_remove(uint16_t handle)
+{
+    struct timeout *timeout = timeout_from_handle(handle);
+    unsigned i = timeout->heap_index;
+
+    timeout->heap_index = NOT_PENDING;
+    heap_size--;
+    if (i == heap_size) {
+        return;
+    }
+    /* Move the last entry into the hole, it may belong either above or below it */
+    uint16_t moved = heap[heap_size];
+    heap_set(i, moved);
+    heap_sift_up(i);
+    heap_sift_down(timeout_from_handle(moved)->heap_index);
+}
+
+/*
+ * Expire every timeout whose deadline has passed, notify their clients, and
+ * program the hardware for the earliest deadline left.
+ */
+static void service_timeouts(void)
+{
+    uint64_t notify = 0;
+
+    for (;;) {
+        uint64_t time = now();
+        while (heap_size > 0 && heap_deadline(0) <= time) {
+            uint16_t handle = heap[0];
+            struct timeout *timeout = timeout_from_handle(handle);
+            microkit_channel client = handle / TIMER_SERVICE_MAX_TIMEOUTS;
+
+            if (handle == CLOCK_TIMEOUT_HANDLE) {
+                publish_clock();
+            } else {
+                expired[client] |= 1U << (handle % TIMER_SERVICE_MAX_TIMEOUTS);
+                notify |= 1ULL << client;
+            }
+
+            if (timeout->period != 0) {
+                /* Skip any periods that were missed entirely, they are reported once */
+                uint64_t missed = (time - timeout->deadline) / timeout->period;
+                timeout->deadline += (missed + 1) * timeout->period;
+                heap_sift_down(0);
+            } else {
+                heap_remove(handle);
+            }
+        }
+
+        if (heap_size == 0) {
+            timer_driver_stop();
+            break;
+        }
+
+        uint64_t next = heap_deadline(0);
+        timer_driver_set_deadline(ns_to_count(next));
+        /* If the deadline passed while it was being programmed the IRQ might never come */
+        if (now() < next) {
+            break;
+        }
+    }
+
+    while (notify != 0) {
+        microkit_notify(__builtin_ctzll(notify));
+        notify &= notify - 1;
+    }
+}
+
+static seL4_Word set_timeout(microkit_channel client, seL4_Word id, uint64_t timeout, uint64_t period)
+{
+    if (id >= TIMER_SERVICE_MAX_TIMEOUTS) {
+        return TIMER_SERVICE_INVALID_ID;
+    }
+
+    uint16_t handle = client * TIMER_SERVICE_MAX_TIMEOUTS + id;
+    struct timeout *t = &timeouts[client][id];
+    uint16_t top = heap_size > 0 ? heap[0] : NOT_PENDING;
+
+    if (t->heap_index != NOT_PENDING) {
+        heap_remove(handle);
+    }
+    t->deadline = now() + timeout;
+    t->period = period;
+    heap_insert(handle);
+
+    /* The hardware only needs to be reprogrammed if the earliest deadline has changed */
+    if (heap[0] != top || handle == top) {
+        service_timeouts();
+    }
+
+    return TIMER_SERVICE_OK;
+}
+
+static seL4_Word cancel(microkit_channel client, seL4_Word id)
+{
+    if (id >= TIMER_SERVICE_MAX_TIMEOUTS) {
+        return TIMER_SERVICE_INVALID_ID;
+    }
+
+    struct timeout *t = &timeouts[client][id];
+    expired[client] &= ~(1U << id);
+    if (t->heap_index == NOT_PENDING) {
+        return TIMER_SERVICE_OK;
+    }
+
+    bool was_top = t->heap_index == 0;
+    heap_remove(client * TIMER_SERVICE_MAX_TIMEOUTS + id);
+    if (was_top) {
+        service_timeouts();
+    }
+
+    return TIMER_SERVICE_OK;
+}
+
+void init(void)
+{
+    for (unsigned client = 0; client < MAX_CLIENTS; client++) {
+        for (unsigned id = 0; id < TIMER_SERVICE_MAX_TIMEOUTS; id++) {
+            timeouts[client][id].heap_index = NOT_PENDING;
+        }
+    }
+
+    timer_driver_init();
+    clock_mult = microkit_clock_mult(timer_driver_frequency());
+
+    if (clock_page != 0) {
+        publish_clock();
+        struct timeout *t = timeout_from_handle(CLOCK_TIMEOUT_HANDLE);
+        t->period = microkit_clock_ns(1ULL << 31, clock_mult);
+        t->deadline = now() + t->period;
+        heap_insert(CLOCK_TIMEOUT_HANDLE);
+        service_timeouts();
+    }
+}
+
+void notified(microkit_channel ch)
+{
+    switch (ch) {
+    case IRQ_CH:
+        timer_driver_handle_irq();
+        microkit_irq_ack(ch);
+        service_timeouts();
+        break;
+    default:
+        microkit_dbg_puts("TIMER_SERVICE|ERROR: unexpected notification\n");
+    }
+}
+
+microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo)
+{
+    seL4_Word result;
+
+    switch (microkit_msginfo_get_label(msginfo)) {
+    case TIMER_SERVICE_TIME_NOW:
+        microkit_mr_set(0, now());
+        return microkit_msginfo_new(TIMER_SERVICE_OK, 1);
+    case TIMER_SERVICE_SET_TIMEOUT:
+        result = set_timeout(ch, microkit_mr_get(0), microkit_mr_get(1), microkit_mr_get(2));
+        return microkit_msginfo_new(result, 0);
+    case TIMER_SERVICE_CANCEL:
+        result = cancel(ch, microkit_mr_get(0));
+        return microkit_msginfo_new(result, 0);
+    case TIMER_SERVICE_EXPIRED:
+        microkit_mr_set(0, expired[ch]);
+        expired[ch] = 0;
+        return microkit_msginfo_new(TIMER_SERVICE_OK, 1);
+    default:
+        return microkit_msginfo_new(TIMER_SERVICE_INVALID_REQUEST, 0);
+    }
+}
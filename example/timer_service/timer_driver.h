@@ -0,0 +1,43 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Interface between the timer service and the driver for the hardware
+ * timer it runs on. The driver deals only in counts of the hardware
+ * counter, the service converts them to and from nanoseconds.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+void timer_driver_init(void);
+
+/* Frequency of the counter in Hz */
+uint64_t timer_driver_frequency(void);
+
+/* The counter, extended to 64 bits, which reads zero when the driver is initialised */
+uint64_t timer_driver_count(void);
+
+/*
+ * Byte offset of the low 32 bits of the counter in the device registers, so
+ * that clients can read it themselves, see microkit_clock.h.
+ */
+uintptr_t timer_driver_counter_offset(void);
+
+/*
+ * Raise the timer IRQ when, or after, the counter reaches 'count'. The
+ * driver may also raise it earlier, for example when the deadline is further
+ * away than the hardware can count, as the service programs the next
+ * deadline after every IRQ.
+ */
+void timer_driver_set_deadline(uint64_t count);
+
+/* Stop raising the IRQ for the last deadline, there is nothing pending */
+void timer_driver_stop(void);
+
+/* Called on every timer IRQ, before it is acknowledged */
+void timer_driver_handle_irq(void);
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Client library for the timer service.
+ *
+ * The timer service multiplexes a single hardware timer between many
+ * clients. Each client has TIMER_SERVICE_MAX_TIMEOUTS timeouts, identified
+ * by the client, which may all be pending at once and may be one-shot or
+ * periodic. Times are in nanoseconds.
+ *
+ * When any of a client's timeouts expire the service notifies the client on
+ * its channel to the service, after which the client calls
+ * timer_service_expired to find out which ones did.
+ *
+ * Every function takes the client's channel to the service, which must be
+ * able to make protected procedure calls.
+ *
+ * The service can also publish its clock, in which case a client that maps
+ * the clock page and the counter can read the same time with
+ * microkit_time_now, which is much cheaper than timer_service_time_now.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <microkit.h>
+
+#define TIMER_SERVICE_MAX_TIMEOUTS 32
+
+/* Message labels of the protected procedure calls to the service */
+#define TIMER_SERVICE_TIME_NOW 0
+#define TIMER_SERVICE_SET_TIMEOUT 1
+#define TIMER_SERVICE_CANCEL 2
+#define TIMER_SERVICE_EXPIRED 3
+
+/* Label of the reply */
+#define TIMER_SERVICE_OK 0
+#define TIMER_SERVICE_INVALID_ID 1
+#define TIMER_SERVICE_INVALID_REQUEST 2
+
+static inline uint64_t timer_service_time_now(microkit_channel ch)
+{
+    (void) microkit_ppcall(ch, microkit_msginfo_new(TIMER_SERVICE_TIME_NOW, 0));
+    return microkit_mr_get(0);
+}
+
+/*
+ * Set timeout 'id' to expire 'timeout' nanoseconds from now, and then every
+ * 'period' nanoseconds if 'period' is non-zero. This replaces the timeout if
+ * it is already pending.
+ */
+static inline seL4_Word timer_service_set_timeout(microkit_channel ch, unsigned id, uint64_t timeout,
+                                                  uint64_t period)
+{
+    microkit_mr_set(0, id);
+    microkit_mr_set(1, timeout);
+    microkit_mr_set(2, period);
+    microkit_msginfo reply = microkit_ppcall(ch, microkit_msginfo_new(TIMER_SERVICE_SET_TIMEOUT, 3));
+    return microkit_msginfo_get_label(reply);
+}
+
+static inline seL4_Word timer_service_set_periodic(microkit_channel ch, unsigned id, uint64_t period)
+{
+    return timer_service_set_timeout(ch, id, period, period);
+}
+
+/* Cancel timeout 'id', which is not reported as expired even if it already has */
+static inline seL4_Word timer_service_cancel(microkit_channel ch, unsigned id)
+{
+    microkit_mr_set(0, id);
+    microkit_msginfo reply = microkit_ppcall(ch, microkit_msginfo_new(TIMER_SERVICE_CANCEL, 1));
+    return microkit_msginfo_get_label(reply);
+}
+
+/*
+ * Returns the timeouts that have expired since the last call, with bit 'id'
+ * set for timeout 'id'. A periodic timeout that expired more than once is
+ * only reported once.
+ */
+static inline uint32_t timer_service_expired(microkit_channel ch)
+{
+    (void) microkit_ppcall(ch, microkit_msginfo_new(TIMER_SERVICE_EXPIRED, 0));
+    return microkit_mr_get(0);
+}
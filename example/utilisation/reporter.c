@@ -0,0 +1,136 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdint.h>
+#include <microkit.h>
+
+/*
+ * Periodically prints how the cycles of its core were shared between the PDs
+ * on that core, the kernel and the idle thread.
+ *
+ * The reporter must be declared with utilisation_reporter="true" in the SDF,
+ * which gives it the TCB of every PD along with the same table of PD names as
+ * the monitor. The kernel only accounts utilisation on a core once a
+ * measurement period has been started on that core, so a system with more
+ * than one core needs a reporter on each core it wants to measure.
+ *
+ * The reporting period is the period of the reporter's scheduling context.
+ * Once it has reported, the reporter yields the rest of its budget and runs
+ * again at its next replenishment.
+ */
+
+#define MAX_PDS 64
+#define MAX_NAME_LEN 64
+
+/* Patched by the tool. As with the monitor, PD i is at index i + 1. */
+char pd_names[MAX_PDS][MAX_NAME_LEN];
+seL4_Word pd_names_len;
+seL4_Word pd_cpus[MAX_PDS];
+
+static seL4_Word cpu;
+
+static void put64(uint64_t x)
+{
+    char buffer[21];
+    unsigned i = sizeof(buffer) - 1;
+    buffer[i] = 0;
+    do {
+        buffer[--i] = '0' + (x % 10);
+        x /= 10;
+    } while (x);
+    microkit_dbg_puts(&buffer[i]);
+}
+
+/* Print 'part' as a percentage of 'total' to one decimal place */
+static void put_share(uint64_t part, uint64_t total)
+{
+    uint64_t permille = total ? (part * 1000) / total : 0;
+    put64(permille / 10);
+    microkit_dbg_putc('.');
+    put64(permille % 10);
+    microkit_dbg_putc('%');
+}
+
+static seL4_Bool names_equal(const char *a, const char *b)
+{
+    for (unsigned i = 0; i < MAX_NAME_LEN; i++) {
+        if (a[i] != b[i]) {
+            return seL4_False;
+        }
+        if (a[i] == 0) {
+            return seL4_True;
+        }
+    }
+    return seL4_True;
+}
+
+static void start_period(void)
+{
+    microkit_benchmark_start();
+    for (seL4_Word pd = 0; pd < pd_names_len; pd++) {
+        if (pd_cpus[pd + 1] == cpu) {
+            microkit_benchmark_reset_utilisation(BASE_UTILISATION_TCB_CAP + pd);
+        }
+    }
+}
+
+static void report(void)
+{
+    microkit_benchmark_utilisation core;
+    microkit_benchmark_get_utilisation(TCB_CAP, &core);
+
+    microkit_dbg_puts("UTIL|core ");
+    put64(cpu);
+    microkit_dbg_puts(": busy ");
+    put_share(core.total - core.idle, core.total);
+    microkit_dbg_puts(" kernel ");
+    put_share(core.total_kernel, core.total);
+    microkit_dbg_puts(" idle ");
+    put_share(core.idle, core.total);
+    microkit_dbg_puts(" (");
+    put64(core.total);
+    microkit_dbg_puts(" cycles)\n");
+
+    for (seL4_Word pd = 0; pd < pd_names_len; pd++) {
+        if (pd_cpus[pd + 1] != cpu) {
+            continue;
+        }
+        microkit_benchmark_utilisation util;
+        microkit_benchmark_get_utilisation(BASE_UTILISATION_TCB_CAP + pd, &util);
+        microkit_dbg_puts("UTIL|core ");
+        put64(cpu);
+        microkit_dbg_puts("|");
+        microkit_dbg_puts(pd_names[pd + 1]);
+        microkit_dbg_puts(": ");
+        put_share(util.thread, core.total);
+        microkit_dbg_puts(" kernel ");
+        put_share(util.thread_kernel, core.total);
+        microkit_dbg_puts(" schedules ");
+        put64(util.thread_schedules);
+        microkit_dbg_puts("\n");
+    }
+}
+
+void init(void)
+{
+    for (seL4_Word pd = 0; pd < pd_names_len; pd++) {
+        if (names_equal(pd_names[pd + 1], microkit_name)) {
+            cpu = pd_cpus[pd + 1];
+        }
+    }
+
+    start_period();
+    for (;;) {
+        /* Wait for the next period */
+        seL4_Yield();
+        microkit_benchmark_stop();
+        report();
+        start_period();
+    }
+}
+
+void notified(microkit_channel ch)
+{
+}
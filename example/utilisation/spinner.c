@@ -0,0 +1,24 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <microkit.h>
+
+/*
+ * Spins forever, so that it uses all of the budget of its scheduling
+ * context. Its share of the core should match its budget divided by its
+ * period.
+ */
+
+void init(void)
+{
+    volatile seL4_Word count = 0;
+    for (;;) {
+        count++;
+    }
+}
+
+void notified(microkit_channel ch)
+{
+}
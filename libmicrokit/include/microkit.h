@@ -20,12 +20,16 @@ typedef seL4_MessageInfo_t microkit_msginfo;
 #define TCB_CAP 6
 /* Only valid when the PD has been configured to make SMC calls */
 #define ARM_SMC_CAP 7
+/* Only valid when the system has a logger */
+#define LOGGER_CAP 8
 #define BASE_OUTPUT_NOTIFICATION_CAP 10
 #define BASE_ENDPOINT_CAP 74
 #define BASE_IRQ_CAP 138
 #define BASE_TCB_CAP 202
 #define BASE_VM_TCB_CAP 266
 #define BASE_VCPU_CAP 330
+/* Only valid for utilisation reporters in the 'benchmark' configuration */
+#define BASE_UTILISATION_TCB_CAP 394
 
 #define MICROKIT_MAX_CHANNELS 62
 #define MICROKIT_MAX_CHANNEL_ID (MICROKIT_MAX_CHANNELS - 1)
@@ -34,6 +38,8 @@ typedef seL4_MessageInfo_t microkit_msginfo;
 /* User provided functions */
 void init(void);
 void notified(microkit_channel ch);
+/* Optional alternative to notified, called once with all the notified channels */
+void notified_set(seL4_Word channels);
 microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo);
 seL4_Bool fault(microkit_child child, microkit_msginfo msginfo, microkit_msginfo *reply_msginfo);
 
@@ -42,6 +48,9 @@ extern char microkit_name[MICROKIT_PD_NAME_LENGTH];
 extern seL4_Bool microkit_have_signal;
 extern seL4_CPtr microkit_signal_cap;
 extern seL4_MessageInfo_t microkit_signal_msg;
+/* Any other deferred signals, as bit masks of channels. These are flushed just before the next Recv syscall */
+extern seL4_Word microkit_deferred_notifications;
+extern seL4_Word microkit_deferred_irq_acks;
 
 /* Symbols for error checking libmicrokit API calls. Patched by the Microkit tool
  * to set bits corresponding to valid channels for this PD. */
@@ -49,6 +58,34 @@ extern seL4_Word microkit_irqs;
 extern seL4_Word microkit_notifications;
 extern seL4_Word microkit_pps;
 
+/*
+ * Events recorded in the trace buffer of the PD, if it has one. See
+ * microkit_trace.h for the layout of the buffer.
+ */
+#define MICROKIT_TRACE_NOTIFY 1
+#define MICROKIT_TRACE_IRQ_ACK 2
+#define MICROKIT_TRACE_PPCALL_BEGIN 3
+#define MICROKIT_TRACE_PPCALL_END 4
+#define MICROKIT_TRACE_NOTIFIED 5
+#define MICROKIT_TRACE_PROTECTED_BEGIN 6
+#define MICROKIT_TRACE_PROTECTED_END 7
+#define MICROKIT_TRACE_FAULT 8
+
+/* Patched by the tool when the PD has a trace buffer */
+extern seL4_Word microkit_trace_buffer;
+
+void microkit_internal_clock_init(void);
+void microkit_internal_trace_init(void);
+void microkit_internal_trace_write(seL4_Uint8 event, microkit_channel ch, seL4_Uint32 arg);
+
+/* Tracing costs a single branch when the PD does not have a trace buffer */
+static inline void microkit_internal_trace(seL4_Uint8 event, microkit_channel ch, seL4_Uint32 arg)
+{
+    if (microkit_trace_buffer != 0) {
+        microkit_internal_trace_write(event, ch, arg);
+    }
+}
+
 /*
  * Output a single character on the debug console.
  */
@@ -91,6 +128,7 @@ static inline void microkit_notify(microkit_channel ch)
         microkit_dbg_puts("'\n");
         return;
     }
+    microkit_internal_trace(MICROKIT_TRACE_NOTIFY, ch, 0);
     seL4_Signal(BASE_OUTPUT_NOTIFICATION_CAP + ch);
 }
 
@@ -103,6 +141,7 @@ static inline void microkit_irq_ack(microkit_channel ch)
         microkit_dbg_puts("'\n");
         return;
     }
+    microkit_internal_trace(MICROKIT_TRACE_IRQ_ACK, ch, 0);
     seL4_IRQHandler_Ack(BASE_IRQ_CAP + ch);
 }
 
@@ -135,6 +174,35 @@ static inline void microkit_pd_stop(microkit_child pd)
     }
 }
 
+/*
+ * What a parent needs to reset each of its children with the reset
+ * attribute, indexed by the child's identifier. Patched by the tool into a
+ * parent that calls microkit_pd_reset.
+ */
+#define MICROKIT_PD_RESET_MAX_CHILDREN 64
+#define MICROKIT_PD_RESET_MAX_REGIONS 4
+
+typedef struct microkit_pd_reset_region {
+    /* Where the region of the child is mapped in the parent */
+    seL4_Word vaddr;
+    /* Where the pristine copy of the region is mapped in the parent, or 0 if the region is zeroed */
+    seL4_Word pristine;
+    seL4_Word size;
+} microkit_pd_reset_region;
+
+typedef struct microkit_pd_reset_info {
+    /* Zero if the child cannot be reset */
+    seL4_Word entry_point;
+    seL4_Word stack_top;
+    seL4_Word num_regions;
+    microkit_pd_reset_region regions[MICROKIT_PD_RESET_MAX_REGIONS];
+} microkit_pd_reset_info;
+
+extern microkit_pd_reset_info microkit_pd_resets[MICROKIT_PD_RESET_MAX_CHILDREN];
+
+/* Restore the child's writable memory to its initial state and restart it from its entry point */
+void microkit_pd_reset(microkit_child pd);
+
 static inline microkit_msginfo microkit_ppcall(microkit_channel ch, microkit_msginfo msginfo)
 {
     if (ch > MICROKIT_MAX_CHANNEL_ID || (microkit_pps & (1ULL << ch)) == 0) {
@@ -144,7 +212,10 @@ static inline microkit_msginfo microkit_ppcall(microkit_channel ch, microkit_msg
         microkit_dbg_puts("'\n");
         return seL4_MessageInfo_new(0, 0, 0, 0);
     }
-    return seL4_Call(BASE_ENDPOINT_CAP + ch, msginfo);
+    microkit_internal_trace(MICROKIT_TRACE_PPCALL_BEGIN, ch, seL4_MessageInfo_get_label(msginfo));
+    msginfo = seL4_Call(BASE_ENDPOINT_CAP + ch, msginfo);
+    microkit_internal_trace(MICROKIT_TRACE_PPCALL_END, ch, seL4_MessageInfo_get_label(msginfo));
+    return msginfo;
 }
 
 static inline microkit_msginfo microkit_msginfo_new(seL4_Word label, seL4_Uint16 count)
@@ -259,6 +330,101 @@ static inline void microkit_arm_smc_call(seL4_ARM_SMCContext *args, seL4_ARM_SMC
 }
 #endif
 
+#if defined(CONFIG_BENCHMARK_TRACK_UTILISATION)
+#include <sel4/benchmark_utilisation_types.h>
+
+/*
+ * Utilisation of a thread, and of the core it runs on, in cycles. The thread
+ * counters accumulate from when the thread's utilisation was last reset. The
+ * total and kernel counters cover the measurement period on the calling core,
+ * and are only valid once the period has been stopped.
+ */
+typedef struct microkit_benchmark_utilisation {
+    seL4_Uint64 thread;
+    seL4_Uint64 thread_kernel;
+    seL4_Uint64 thread_schedules;
+    seL4_Uint64 thread_kernel_entries;
+    /* Cycles spent idle on the core the thread runs on */
+    seL4_Uint64 idle;
+    seL4_Uint64 total;
+    seL4_Uint64 total_kernel;
+    seL4_Uint64 total_schedules;
+    seL4_Uint64 total_kernel_entries;
+} microkit_benchmark_utilisation;
+
+/*
+ * Start a new measurement period on the calling core. This resets the total,
+ * kernel and idle counters of the core, as well as the utilisation of the
+ * calling thread, but not of any other thread.
+ */
+static inline void microkit_benchmark_start(void)
+{
+    seL4_BenchmarkResetLog();
+}
+
+/*
+ * Stop the measurement period on the calling core, no more cycles are
+ * accounted to any thread on the core until it is started again.
+ */
+static inline void microkit_benchmark_stop(void)
+{
+    (void) seL4_BenchmarkFinalizeLog();
+}
+
+/*
+ * Reset the utilisation of the thread 'tcb', which is TCB_CAP for the calling
+ * PD itself.
+ */
+static inline void microkit_benchmark_reset_utilisation(seL4_CPtr tcb)
+{
+    seL4_BenchmarkResetThreadUtilisation(tcb);
+}
+
+#if defined(CONFIG_DEBUG_BUILD)
+static inline void microkit_benchmark_reset_all_utilisation(void)
+{
+    seL4_BenchmarkResetAllThreadsUtilisation();
+}
+#endif
+
+/*
+ * Read the utilisation of the thread 'tcb'. The kernel returns the counters in
+ * the IPC buffer, so this overwrites any message being built.
+ */
+static inline void microkit_benchmark_get_utilisation(seL4_CPtr tcb, microkit_benchmark_utilisation *util)
+{
+    seL4_BenchmarkGetThreadUtilisation(tcb);
+
+    seL4_Uint64 *buffer = (seL4_Uint64 *) &seL4_GetIPCBuffer()->msg[0];
+    util->thread = buffer[BENCHMARK_TCB_UTILISATION];
+    util->thread_kernel = buffer[BENCHMARK_TCB_KERNEL_UTILISATION];
+    util->thread_schedules = buffer[BENCHMARK_TCB_NUMBER_SCHEDULES];
+    util->thread_kernel_entries = buffer[BENCHMARK_TCB_NUMBER_KERNEL_ENTRIES];
+    util->idle = buffer[BENCHMARK_IDLE_TCBCPU_UTILISATION];
+    util->total = buffer[BENCHMARK_TOTAL_UTILISATION];
+    util->total_kernel = buffer[BENCHMARK_TOTAL_KERNEL_UTILISATION];
+    util->total_schedules = buffer[BENCHMARK_TOTAL_NUMBER_SCHEDULES];
+    util->total_kernel_entries = buffer[BENCHMARK_TOTAL_NUMBER_KERNEL_ENTRIES];
+}
+#endif
+
+/*
+ * Moves the signal that is to be combined with the next Recv syscall, if
+ * any, to the deferred signals that are flushed before it.
+ */
+static inline void microkit_internal_queue_signal(void)
+{
+    if (!microkit_have_signal) {
+        return;
+    }
+    if (seL4_MessageInfo_get_label(microkit_signal_msg) == IRQAckIRQ) {
+        microkit_deferred_irq_acks |= 1ULL << (microkit_signal_cap - BASE_IRQ_CAP);
+    } else {
+        microkit_deferred_notifications |= 1ULL << (microkit_signal_cap - BASE_OUTPUT_NOTIFICATION_CAP);
+    }
+    microkit_have_signal = seL4_False;
+}
+
 static inline void microkit_deferred_notify(microkit_channel ch)
 {
     if (ch > MICROKIT_MAX_CHANNEL_ID || (microkit_notifications & (1ULL << ch)) == 0) {
@@ -268,6 +434,14 @@ static inline void microkit_deferred_notify(microkit_channel ch)
         microkit_dbg_puts("'\n");
         return;
     }
+    /* Recorded when requested rather than when sent, an arg of 1 marks it as deferred */
+    microkit_internal_trace(MICROKIT_TRACE_NOTIFY, ch, 1);
+    /* The most recently deferred signal is combined with the next Recv syscall */
+    if (microkit_have_signal && microkit_signal_cap == BASE_OUTPUT_NOTIFICATION_CAP + ch) {
+        return;
+    }
+    microkit_internal_queue_signal();
+    microkit_deferred_notifications &= ~(1ULL << ch);
     microkit_have_signal = seL4_True;
     microkit_signal_msg = seL4_MessageInfo_new(0, 0, 0, 0);
     microkit_signal_cap = (BASE_OUTPUT_NOTIFICATION_CAP + ch);
@@ -282,6 +456,12 @@ static inline void microkit_deferred_irq_ack(microkit_channel ch)
         microkit_dbg_puts("'\n");
         return;
     }
+    microkit_internal_trace(MICROKIT_TRACE_IRQ_ACK, ch, 1);
+    if (microkit_have_signal && microkit_signal_cap == BASE_IRQ_CAP + ch) {
+        return;
+    }
+    microkit_internal_queue_signal();
+    microkit_deferred_irq_acks &= ~(1ULL << ch);
     microkit_have_signal = seL4_True;
     microkit_signal_msg = seL4_MessageInfo_new(IRQAckIRQ, 0, 0, 0);
     microkit_signal_cap = (BASE_IRQ_CAP + ch);
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Reading the time without a system call.
+ *
+ * microkit_time_now returns the time in nanoseconds by reading a counter and
+ * converting it with the parameters in a clock page. By default the counter
+ * is the architectural timer and the clock page is private to the PD, so the
+ * time is since the counter was started, usually at boot.
+ *
+ * A PD that drives a timer device can instead publish a clock page for other
+ * PDs, with microkit_clock_publish. The clients map the clock page read-only
+ * with setvar_vaddr="microkit_clock_page", and the page of device registers
+ * containing the counter read-only with setvar_vaddr="microkit_clock_counter".
+ * The clients read the low 32 bits of the counter themselves and extend them
+ * to 64 bits using the count when the clock was last published, so the
+ * publisher must publish the clock again at least every 2^31 counts.
+ *
+ * The clock page is protected by a sequence lock, a reader retries if it
+ * read the clock page while it was being published.
+ *
+ * On RISC-V the frequency of the architectural timer is not known, so a PD
+ * must have a published clock page, otherwise microkit_time_now returns 0.
+ */
+
+#pragma once
+
+#include <microkit.h>
+
+#define MICROKIT_NS_IN_S 1000000000ULL
+/* Fractional bits of microkit_clock.mult */
+#define MICROKIT_CLOCK_SHIFT 32
+
+typedef struct microkit_clock {
+    /* Odd while the clock page is being published */
+    seL4_Word seq;
+    /* Value of the counter, extended to 64 bits, when the clock was published */
+    seL4_Uint64 base_count;
+    /* Time in nanoseconds at base_count, and the fraction of a nanosecond dropped from it */
+    seL4_Uint64 base_ns;
+    seL4_Uint64 base_frac;
+    /* Nanoseconds per count, as a fixed point number */
+    seL4_Uint64 mult;
+    /* Byte offset of the low 32 bits of the counter in the page at microkit_clock_counter */
+    seL4_Word counter_offset;
+} microkit_clock;
+
+/* Set with setvar_vaddr in the SDF, see above */
+extern seL4_Word microkit_clock_page;
+extern seL4_Word microkit_clock_counter;
+
+static inline seL4_Uint64 microkit_clock_mult(seL4_Uint64 frequency)
+{
+    return (MICROKIT_NS_IN_S << MICROKIT_CLOCK_SHIFT) / frequency;
+}
+
+/* Convert a number of counts to nanoseconds, which does not overflow for any number of counts */
+static inline seL4_Uint64 microkit_clock_ns(seL4_Uint64 counts, seL4_Uint64 mult)
+{
+    return ((unsigned __int128) counts * mult) >> MICROKIT_CLOCK_SHIFT;
+}
+
+static inline seL4_Uint64 microkit_internal_arch_counter(void)
+{
+    seL4_Uint64 count;
+#if defined(CONFIG_ARCH_AARCH64)
+    asm volatile("mrs %0, cntpct_el0" : "=r"(count));
+#elif defined(CONFIG_ARCH_RISCV)
+    asm volatile("rdtime %0" : "=r"(count));
+#else
+#error "Unsupported architecture"
+#endif
+    return count;
+}
+
+static inline seL4_Uint64 microkit_time_now(void)
+{
+    const volatile microkit_clock *clock = (const volatile microkit_clock *) microkit_clock_page;
+
+    for (;;) {
+        seL4_Word seq = __atomic_load_n(&clock->seq, __ATOMIC_ACQUIRE);
+        seL4_Uint64 base_count = clock->base_count;
+        seL4_Uint64 base_ns = clock->base_ns;
+        seL4_Uint64 base_frac = clock->base_frac;
+        seL4_Uint64 mult = clock->mult;
+        seL4_Uint64 count;
+
+        if (microkit_clock_counter != 0) {
+            seL4_Uint32 low = *(volatile seL4_Uint32 *)(microkit_clock_counter + clock->counter_offset);
+            count = base_count + (seL4_Uint32)(low - (seL4_Uint32) base_count);
+        } else {
+            count = microkit_internal_arch_counter();
+        }
+
+        /* Finish reading the clock page before checking that it did not change */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((seq & 1) == 0 && __atomic_load_n(&clock->seq, __ATOMIC_RELAXED) == seq) {
+            return base_ns + (((unsigned __int128)(count - base_count) * mult + base_frac) >> MICROKIT_CLOCK_SHIFT);
+        }
+    }
+}
+
+/*
+ * Publish that the counter runs at 'frequency' Hz and currently reads
+ * 'count'. The time is the number of nanoseconds since the counter read
+ * zero, which is exactly microkit_clock_ns(count, microkit_clock_mult(frequency))
+ * no matter how often the clock is published, so it never goes backwards.
+ * Only the owner of the clock page may call this.
+ */
+static inline void microkit_clock_publish(microkit_clock *clock, seL4_Uint64 count, seL4_Uint64 frequency,
+                                          seL4_Word counter_offset)
+{
+    seL4_Uint64 mult = microkit_clock_mult(frequency);
+    unsigned __int128 base = (unsigned __int128) count * mult;
+
+    __atomic_store_n(&clock->seq, clock->seq + 1, __ATOMIC_RELAXED);
+    /* Make the odd sequence number visible before any of the updates */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    clock->base_count = count;
+    clock->base_ns = base >> MICROKIT_CLOCK_SHIFT;
+    clock->base_frac = (seL4_Uint32) base;
+    clock->mult = mult;
+    clock->counter_offset = counter_offset;
+    __atomic_store_n(&clock->seq, clock->seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Layout of the log buffers used when the system has a logger.
+ *
+ * Each PD gets its own log buffer, shared with the logger PD, which the
+ * microkit_dbg_* functions write to instead of making a system call per
+ * character. The logger prints the buffers to the debug console whenever it
+ * gets to run, which with the default priority is when nothing else is.
+ *
+ * The buffer is a byte ring with free-running indices: the PD only writes the
+ * tail and the logger only writes the head. The PD only notifies the logger
+ * when it has finished a line, or has had to drop output, and the logger has
+ * said that it is going to sleep.
+ */
+
+#pragma once
+
+#include <microkit.h>
+
+#define MICROKIT_LOG_CACHE_LINE 64
+
+typedef struct microkit_log_shared {
+    /* Written only by the PD */
+    seL4_Word tail __attribute__((aligned(MICROKIT_LOG_CACHE_LINE)));
+    /* Number of bytes dropped because the buffer was full */
+    seL4_Word dropped;
+    /* Written only by the logger, other than clearing logger_sleeping */
+    seL4_Word head __attribute__((aligned(MICROKIT_LOG_CACHE_LINE)));
+    seL4_Word logger_sleeping;
+    char data[] __attribute__((aligned(MICROKIT_LOG_CACHE_LINE)));
+} microkit_log_shared;
+
+static inline seL4_Word microkit_log_capacity(seL4_Word size)
+{
+    return size - sizeof(microkit_log_shared);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Single-producer, single-consumer ring of descriptors in memory shared
+ * between two PDs.
+ *
+ * The producer only ever writes the tail index and the consumer only ever
+ * writes the head index, each on its own cache line, so the ring needs no
+ * locks. The consumer notifies the producer that it is about to go to sleep
+ * by setting a flag, and the producer only signals the channel when that flag
+ * is set, so a busy consumer does not cost the producer a system call per
+ * enqueue.
+ *
+ * A ring is usually declared in the SDF with the 'ring' element, which
+ * creates the backing memory region, maps it into both PDs and creates the
+ * channel between them. Both PDs must call microkit_ring_init with the same
+ * size.
+ */
+
+#pragma once
+
+#include <microkit.h>
+
+#define MICROKIT_RING_CACHE_LINE 64
+
+typedef struct microkit_ring_entry {
+    seL4_Uint64 addr;
+    seL4_Uint32 len;
+    seL4_Uint32 cookie;
+} microkit_ring_entry;
+
+/* Layout of the memory region backing the ring */
+typedef struct microkit_ring_shared {
+    /* Written only by the producer */
+    seL4_Word tail __attribute__((aligned(MICROKIT_RING_CACHE_LINE)));
+    /* Written only by the consumer */
+    seL4_Word head __attribute__((aligned(MICROKIT_RING_CACHE_LINE)));
+    /*
+     * Set by the consumer and cleared by the producer, so it is on a cache line
+     * of its own rather than sharing one with either index. Otherwise clearing
+     * it would pull the consumer's head line over to the producer and back.
+     */
+    seL4_Word consumer_sleeping __attribute__((aligned(MICROKIT_RING_CACHE_LINE)));
+    microkit_ring_entry entries[] __attribute__((aligned(MICROKIT_RING_CACHE_LINE)));
+} microkit_ring_shared;
+
+/* Private to each end of the ring */
+typedef struct microkit_ring {
+    microkit_ring_shared *shared;
+    seL4_Word mask;
+    microkit_channel ch;
+} microkit_ring;
+
+/*
+ * Initialise one end of a ring backed by 'size' bytes of shared memory at
+ * 'vaddr', signalling on channel 'ch'. The number of entries is the largest
+ * power of two that fits. The shared memory must be zero when the ring is
+ * first used, which is the case for memory regions created by the tool.
+ */
+static inline void microkit_ring_init(microkit_ring *ring, seL4_Word vaddr, seL4_Word size, microkit_channel ch)
+{
+    seL4_Word capacity = (size - sizeof(microkit_ring_shared)) / sizeof(microkit_ring_entry);
+    if (size <= sizeof(microkit_ring_shared) || capacity == 0) {
+        microkit_dbg_puts(microkit_name);
+        microkit_dbg_puts(" microkit_ring_init: ring is too small\n");
+        microkit_internal_crash(seL4_RangeError);
+    }
+
+    ring->shared = (microkit_ring_shared *)vaddr;
+    ring->mask = (1UL << (63 - __builtin_clzl(capacity))) - 1;
+    ring->ch = ch;
+}
+
+static inline seL4_Word microkit_ring_capacity(microkit_ring *ring)
+{
+    return ring->mask + 1;
+}
+
+/*
+ * Producer side. Enqueue up to 'count' entries, returning the number that
+ * fit in the ring.
+ */
+static inline seL4_Word microkit_ring_enqueue_batch(microkit_ring *ring, const microkit_ring_entry *entries,
+                                                    seL4_Word count)
+{
+    microkit_ring_shared *shared = ring->shared;
+    seL4_Word tail = shared->tail;
+    seL4_Word head = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+    seL4_Word space = microkit_ring_capacity(ring) - (tail - head);
+
+    if (count > space) {
+        count = space;
+    }
+    for (seL4_Word i = 0; i < count; i++) {
+        shared->entries[(tail + i) & ring->mask] = entries[i];
+    }
+    /* Publish the entries before the new tail */
+    __atomic_store_n(&shared->tail, tail + count, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+static inline seL4_Bool microkit_ring_enqueue(microkit_ring *ring, microkit_ring_entry entry)
+{
+    return microkit_ring_enqueue_batch(ring, &entry, 1) == 1;
+}
+
+/*
+ * Producer side. Signal the consumer if it has gone to sleep waiting for
+ * entries. Call this after a batch of enqueues rather than after each one.
+ */
+static inline void microkit_ring_notify(microkit_ring *ring)
+{
+    /* Order the tail update before reading the flag, see microkit_ring_consumer_sleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->shared->consumer_sleeping, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&ring->shared->consumer_sleeping, 0, __ATOMIC_RELAXED)) {
+        microkit_notify(ring->ch);
+    }
+}
+
+/*
+ * Consumer side. Dequeue up to 'count' entries, returning the number
+ * dequeued.
+ */
+static inline seL4_Word microkit_ring_dequeue_batch(microkit_ring *ring, microkit_ring_entry *entries,
+                                                    seL4_Word count)
+{
+    microkit_ring_shared *shared = ring->shared;
+    seL4_Word head = shared->head;
+    seL4_Word tail = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+
+    if (count > tail - head) {
+        count = tail - head;
+    }
+    for (seL4_Word i = 0; i < count; i++) {
+        entries[i] = shared->entries[(head + i) & ring->mask];
+    }
+    /* Finish reading the entries before handing the slots back */
+    __atomic_store_n(&shared->head, head + count, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+static inline seL4_Bool microkit_ring_dequeue(microkit_ring *ring, microkit_ring_entry *entry)
+{
+    return microkit_ring_dequeue_batch(ring, entry, 1) == 1;
+}
+
+static inline seL4_Bool microkit_ring_empty(microkit_ring *ring)
+{
+    microkit_ring_shared *shared = ring->shared;
+    return __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&shared->head, __ATOMIC_RELAXED);
+}
+
+/*
+ * Consumer side. Ask to be notified when the producer next enqueues. Returns
+ * true if the ring is still empty and the consumer may wait for the
+ * notification, or false if entries arrived in the meantime and should be
+ * dequeued first.
+ */
+static inline seL4_Bool microkit_ring_consumer_sleep(microkit_ring *ring)
+{
+    __atomic_store_n(&ring->shared->consumer_sleeping, 1, __ATOMIC_RELAXED);
+    /* Order setting the flag before re-reading the tail, see microkit_ring_notify */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (microkit_ring_empty(ring)) {
+        return seL4_True;
+    }
+    __atomic_store_n(&ring->shared->consumer_sleeping, 0, __ATOMIC_RELAXED);
+    return seL4_False;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Layout of the trace buffer of a PD.
+ *
+ * A PD is given a trace buffer with the 'trace_size' attribute in the SDF.
+ * libmicrokit then records a timestamped event each time the PD notifies,
+ * acknowledges an IRQ, makes a protected procedure call, or is entered
+ * through one of its entry points. When the buffer is full the oldest
+ * records are overwritten.
+ *
+ * The buffer is never read by the running system. Instead 'microkit trace'
+ * finds the buffers of every PD in a dump of physical memory, with the help
+ * of the report from building the image, and converts them to a trace that
+ * can be viewed in Perfetto or chrome://tracing.
+ */
+
+#pragma once
+
+#include <microkit.h>
+
+/* "MKTRACE1", written once the PD has started */
+#define MICROKIT_TRACE_MAGIC 0x3145434152544b4dULL
+
+typedef struct microkit_trace_record {
+    seL4_Uint64 timestamp;
+    /* One of MICROKIT_TRACE_* */
+    seL4_Uint8 event;
+    /* Channel, or child PD for faults */
+    seL4_Uint8 channel;
+    seL4_Uint16 reserved;
+    /* Message label, where the event has one */
+    seL4_Uint32 arg;
+} microkit_trace_record;
+
+typedef struct microkit_trace_shared {
+    seL4_Uint64 magic;
+    /* Frequency of the timestamps in Hz, zero when it is not known */
+    seL4_Uint64 frequency;
+    /* Number of records ever written, the next is written at count % capacity */
+    seL4_Uint64 count;
+    seL4_Uint64 capacity;
+    microkit_trace_record records[];
+} microkit_trace_shared;
+
+static inline seL4_Word microkit_trace_capacity(seL4_Word size)
+{
+    return (size - sizeof(microkit_trace_shared)) / sizeof(microkit_trace_record);
+}
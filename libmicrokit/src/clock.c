@@ -0,0 +1,31 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <microkit.h>
+#include <microkit_clock.h>
+
+#define __thread
+#include <sel4/sel4.h>
+
+/* Set by the tool from setvar_vaddr when the PD reads a published clock, see microkit_clock.h */
+seL4_Word microkit_clock_page;
+seL4_Word microkit_clock_counter;
+
+/* Used when the PD does not have a published clock */
+static microkit_clock arch_clock;
+
+void microkit_internal_clock_init(void)
+{
+    if (microkit_clock_page != 0) {
+        return;
+    }
+
+#if defined(CONFIG_ARCH_AARCH64)
+    seL4_Uint64 frequency;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    microkit_clock_publish(&arch_clock, 0, frequency, 0);
+#endif
+    microkit_clock_page = (seL4_Word) &arch_clock;
+}
@@ -4,21 +4,82 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 #include <microkit.h>
+#include <microkit_log.h>
 
 #define __thread
 #include <sel4/sel4.h>
 
+/* Patched by the tool when the system has a logger, see microkit_log.h */
+seL4_Word microkit_log_buffer;
+seL4_Word microkit_log_buffer_size;
+
+#if defined(CONFIG_PRINTING)
+/*
+ * Copy as much of 's', up to 'len' bytes or its NUL terminator, as fits into
+ * the log buffer, waking up the logger if a line was finished.
+ */
+static void log_write(const char *s, seL4_Word len)
+{
+    microkit_log_shared *log = (microkit_log_shared *) microkit_log_buffer;
+    seL4_Word capacity = microkit_log_capacity(microkit_log_buffer_size);
+    seL4_Word tail = log->tail;
+    seL4_Word head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+    seL4_Word index = tail % capacity;
+    seL4_Bool wake = seL4_False;
+
+    for (seL4_Word i = 0; i < len && s[i]; i++) {
+        if (tail - head == capacity) {
+            /* Full, drop the rest and let the logger catch up */
+            seL4_Word dropped = 0;
+            while (i + dropped < len && s[i + dropped]) {
+                dropped++;
+            }
+            __atomic_store_n(&log->dropped, log->dropped + dropped, __ATOMIC_RELAXED);
+            wake = seL4_True;
+            break;
+        }
+        log->data[index] = s[i];
+        wake |= s[i] == '\n';
+        tail++;
+        if (++index == capacity) {
+            index = 0;
+        }
+    }
+    /* Publish the data before the new tail */
+    __atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+
+    if (!wake) {
+        return;
+    }
+    /* Order the tail update before reading the flag, as for microkit_ring_notify */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log->logger_sleeping, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&log->logger_sleeping, 0, __ATOMIC_RELAXED)) {
+        seL4_Signal(LOGGER_CAP);
+    }
+}
+#endif
+
 void microkit_dbg_putc(int c)
 {
 #if defined(CONFIG_PRINTING)
+    if (microkit_log_buffer) {
+        char ch = c;
+        log_write(&ch, 1);
+        return;
+    }
     seL4_DebugPutChar(c);
 #endif
 }
 
-
-
 void microkit_dbg_puts(const char *s)
 {
+#if defined(CONFIG_PRINTING)
+    if (microkit_log_buffer) {
+        log_write(s, (seL4_Word) -1);
+        return;
+    }
+#endif
     while (*s) {
         microkit_dbg_putc(*s);
         s++;
@@ -11,6 +11,7 @@
 #include <sel4/sel4.h>
 
 #include <microkit.h>
+#include <microkit_ring.h>
 
 #define INPUT_CAP 1
 #define REPLY_CAP 4
@@ -18,6 +19,9 @@
 #define PD_MASK 0xff
 #define CHANNEL_MASK 0x3f
 
+/* How many times the rings are checked between checks for any other work while polling */
+#define POLL_RECV_INTERVAL 64
+
 /* All globals are prefixed with microkit_* to avoid clashes with user defined globals. */
 
 bool microkit_passive;
@@ -27,11 +31,18 @@ char microkit_name[MICROKIT_PD_NAME_LENGTH];
 seL4_Bool microkit_have_signal = seL4_False;
 seL4_CPtr microkit_signal_cap;
 seL4_MessageInfo_t microkit_signal_msg;
+seL4_Word microkit_deferred_notifications;
+seL4_Word microkit_deferred_irq_acks;
 
 seL4_Word microkit_irqs;
 seL4_Word microkit_notifications;
 seL4_Word microkit_pps;
 
+/* Patched by the tool for PDs with 'poll_us', the rings are indexed by channel */
+seL4_Word microkit_poll_us;
+seL4_Word microkit_poll_channels;
+seL4_Word microkit_poll_rings[MICROKIT_MAX_CHANNELS];
+
 extern seL4_IPCBuffer __sel4_ipc_buffer_obj;
 
 seL4_IPCBuffer *__sel4_ipc_buffer = &__sel4_ipc_buffer_obj;
@@ -39,6 +50,17 @@ seL4_IPCBuffer *__sel4_ipc_buffer = &__sel4_ipc_buffer_obj;
 extern const void (*const __init_array_start [])(void);
 extern const void (*const __init_array_end [])(void);
 
+/* Only called when the PD does not provide notified_set */
+__attribute__((weak)) void notified(microkit_channel ch)
+{
+    microkit_dbg_puts(microkit_name);
+    microkit_dbg_puts(" is missing the 'notified' entry point\n");
+    microkit_internal_crash(0);
+}
+
+/* Optional, this is NULL when the PD does not provide it */
+__attribute__((weak)) void notified_set(seL4_Word channels);
+
 __attribute__((weak)) microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo)
 {
     microkit_dbg_puts(microkit_name);
@@ -63,6 +85,131 @@ static void run_init_funcs(void)
     }
 }
 
+static void flush_deferred_signals(void)
+{
+    while (microkit_deferred_notifications != 0) {
+        microkit_channel ch = __builtin_ctzl(microkit_deferred_notifications);
+        seL4_Signal(BASE_OUTPUT_NOTIFICATION_CAP + ch);
+        microkit_deferred_notifications &= microkit_deferred_notifications - 1;
+    }
+    while (microkit_deferred_irq_acks != 0) {
+        microkit_channel ch = __builtin_ctzl(microkit_deferred_irq_acks);
+        seL4_IRQHandler_Ack(BASE_IRQ_CAP + ch);
+        microkit_deferred_irq_acks &= microkit_deferred_irq_acks - 1;
+    }
+}
+
+#if defined(CONFIG_ARCH_AARCH64)
+static seL4_Word poll_ticks;
+
+static inline seL4_Word poll_timer_read(void)
+{
+    seL4_Word ticks;
+    asm volatile("mrs %0, cntpct_el0" : "=r"(ticks));
+    return ticks;
+}
+
+static void poll_init(void)
+{
+    seL4_Word frequency;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    /* Split so that large values of poll_us cannot overflow */
+    poll_ticks = (microkit_poll_us / 1000000) * frequency + (microkit_poll_us % 1000000) * frequency / 1000000;
+}
+
+static seL4_Word poll_ready(void)
+{
+    seL4_Word ready = 0;
+    for (seL4_Word channels = microkit_poll_channels; channels != 0; channels &= channels - 1) {
+        microkit_channel ch = __builtin_ctzl(channels);
+        microkit_ring_shared *ring = (microkit_ring_shared *) microkit_poll_rings[ch];
+        if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head) {
+            ready |= 1ULL << ch;
+        }
+    }
+    return ready;
+}
+
+static void poll_set_sleeping(seL4_Word sleeping)
+{
+    for (seL4_Word channels = microkit_poll_channels; channels != 0; channels &= channels - 1) {
+        microkit_ring_shared *ring = (microkit_ring_shared *) microkit_poll_rings[__builtin_ctzl(channels)];
+        __atomic_store_n(&ring->consumer_sleeping, sleeping, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Spin for up to microkit_poll_us waiting for entries on the rings the PD
+ * consumes, so that a PD that is kept busy does not pay for blocking and being
+ * woken up for every batch. Anything else, such as a protected procedure call
+ * or an IRQ, is picked up every POLL_RECV_INTERVAL checks so that it does not
+ * have to wait for the polling to time out. Returns true with 'tag' and 'badge'
+ * set as for seL4_Recv if there is work to do.
+ *
+ * The consumer_sleeping flag of each ring is cleared while polling so that the
+ * producers do not signal, which would otherwise leave a notification pending
+ * for entries that polling has already handed to the PD. The flags are only set
+ * again, and the rings rechecked as microkit_ring_consumer_sleep does, when
+ * polling times out. They are left clear when this returns true, so the PD must
+ * not block until it has called this again and it has returned false.
+ */
+static bool poll(seL4_MessageInfo_t *tag, seL4_Word *badge)
+{
+    seL4_Word deadline = poll_timer_read() + poll_ticks;
+    seL4_Word checks = 0;
+    seL4_Word ready;
+
+    poll_set_sleeping(0);
+    do {
+        ready = poll_ready();
+        if (ready != 0) {
+            break;
+        }
+
+        if (++checks % POLL_RECV_INTERVAL == 0) {
+            *tag = seL4_NBRecv(INPUT_CAP, badge, REPLY_CAP);
+            if (*badge != 0) {
+                return true;
+            }
+        }
+    } while ((int64_t)(poll_timer_read() - deadline) < 0);
+
+    if (ready == 0) {
+        poll_set_sleeping(1);
+        /* Order setting the flags before re-reading the tails, see microkit_ring_notify */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        ready = poll_ready();
+        if (ready == 0) {
+            return false;
+        }
+        poll_set_sleeping(0);
+    }
+
+    /* Handled as if the producers had notified */
+    *tag = seL4_MessageInfo_new(0, 0, 0, 0);
+    *badge = ready;
+    return true;
+}
+#else
+/* The tool only allows poll_us on AArch64 */
+static void poll_init(void)
+{
+}
+
+static bool poll(seL4_MessageInfo_t *tag, seL4_Word *badge)
+{
+    return false;
+}
+#endif
+
+static void trace_notified_set(seL4_Word channels)
+{
+    while (channels != 0) {
+        microkit_internal_trace(MICROKIT_TRACE_NOTIFIED, __builtin_ctzl(channels), 0);
+        channels &= channels - 1;
+    }
+}
+
 static void handler_loop(void)
 {
     bool have_reply = false;
@@ -72,7 +219,32 @@ static void handler_loop(void)
         seL4_Word badge;
         seL4_MessageInfo_t tag;
 
+        /*
+         * All but the last deferred signal need their own syscalls. A reply
+         * cannot be combined with a signal, so when there is one the last
+         * deferred signal is sent with the rest before the PD blocks.
+         */
         if (have_reply) {
+            microkit_internal_queue_signal();
+        }
+        flush_deferred_signals();
+
+        if (microkit_poll_channels != 0) {
+            /*
+             * A PD that polls only blocks once poll has set the consumer_sleeping
+             * flags and found the rings empty, so any reply or signal is sent on
+             * its own rather than combined with a blocking receive.
+             */
+            if (have_reply) {
+                seL4_Send(REPLY_CAP, reply_tag);
+            } else if (microkit_have_signal) {
+                seL4_NBSend(microkit_signal_cap, microkit_signal_msg);
+                microkit_have_signal = seL4_False;
+            }
+            if (!poll(&tag, &badge)) {
+                tag = seL4_Recv(INPUT_CAP, &badge, REPLY_CAP);
+            }
+        } else if (have_reply) {
             tag = seL4_ReplyRecv(INPUT_CAP, reply_tag, &badge, REPLY_CAP);
         } else if (microkit_have_signal) {
             tag = seL4_NBSendRecv(microkit_signal_cap, microkit_signal_msg, INPUT_CAP, &badge, REPLY_CAP);
@@ -87,28 +259,41 @@ static void handler_loop(void)
         have_reply = false;
 
         if (is_fault) {
+            microkit_internal_trace(MICROKIT_TRACE_FAULT, badge & PD_MASK, seL4_MessageInfo_get_label(tag));
             seL4_Bool reply_to_fault = fault(badge & PD_MASK, tag, &reply_tag);
             if (reply_to_fault) {
                 have_reply = true;
             }
         } else if (is_endpoint) {
             have_reply = true;
+            microkit_internal_trace(MICROKIT_TRACE_PROTECTED_BEGIN, badge & CHANNEL_MASK,
+                                    seL4_MessageInfo_get_label(tag));
             reply_tag = protected(badge & CHANNEL_MASK, tag);
+            microkit_internal_trace(MICROKIT_TRACE_PROTECTED_END, badge & CHANNEL_MASK,
+                                    seL4_MessageInfo_get_label(reply_tag));
+        } else if (notified_set) {
+            if (microkit_trace_buffer != 0) {
+                trace_notified_set(badge);
+            }
+            notified_set(badge);
         } else {
-            unsigned int idx = 0;
-            do  {
-                if (badge & 1) {
-                    notified(idx);
-                }
-                badge >>= 1;
-                idx++;
-            } while (badge != 0);
+            while (badge != 0) {
+                microkit_internal_trace(MICROKIT_TRACE_NOTIFIED, __builtin_ctzl(badge), 0);
+                notified(__builtin_ctzl(badge));
+                /* Clear the lowest set bit */
+                badge &= badge - 1;
+            }
         }
     }
 }
 
 void main(void)
 {
+    microkit_internal_clock_init();
+    microkit_internal_trace_init();
+    if (microkit_poll_channels != 0) {
+        poll_init();
+    }
     run_init_funcs();
     init();
 
@@ -119,6 +304,8 @@ void main(void)
      * We delay this signal so we are ready waiting on a recv() syscall
      */
     if (microkit_passive) {
+        /* Anything deferred by init is sent before the monitor is signalled */
+        microkit_internal_queue_signal();
         microkit_have_signal = seL4_True;
         microkit_signal_msg = seL4_MessageInfo_new(0, 0, 0, 0);
         microkit_signal_cap = MONITOR_EP;
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <microkit.h>
+
+#define __thread
+#include <sel4/sel4.h>
+
+/*
+ * Only linked into PDs that call microkit_pd_reset, so that other PDs do not
+ * carry the table.
+ */
+microkit_pd_reset_info microkit_pd_resets[MICROKIT_PD_RESET_MAX_CHILDREN];
+
+void microkit_pd_reset(microkit_child pd)
+{
+    seL4_Error err;
+
+    if (pd >= MICROKIT_PD_RESET_MAX_CHILDREN || microkit_pd_resets[pd].entry_point == 0) {
+        microkit_dbg_puts(microkit_name);
+        microkit_dbg_puts(" microkit_pd_reset: child cannot be reset '");
+        microkit_dbg_put32(pd);
+        microkit_dbg_puts("'\n");
+        return;
+    }
+
+    const microkit_pd_reset_info *info = &microkit_pd_resets[pd];
+
+    /* The child must not run, possibly on another core, while its memory is restored */
+    err = seL4_TCB_Suspend(BASE_TCB_CAP + pd);
+    if (err != seL4_NoError) {
+        microkit_dbg_puts("microkit_pd_reset: error suspending TCB\n");
+        microkit_internal_crash(err);
+    }
+
+    /*
+     * The regions are whole pages. The stores are volatile so that the
+     * compiler does not turn the loops into calls to memcpy and memset,
+     * which libmicrokit does not have.
+     */
+    for (seL4_Word i = 0; i < info->num_regions; i++) {
+        const microkit_pd_reset_region *region = &info->regions[i];
+        volatile seL4_Word *dest = (volatile seL4_Word *) region->vaddr;
+        const seL4_Word *pristine = (const seL4_Word *) region->pristine;
+        seL4_Word words = region->size / sizeof(seL4_Word);
+
+        if (region->pristine != 0) {
+            for (seL4_Word j = 0; j < words; j++) {
+                dest[j] = pristine[j];
+            }
+        } else {
+            for (seL4_Word j = 0; j < words; j++) {
+                dest[j] = 0;
+            }
+        }
+    }
+
+    /* Every register is reset, as it was when the child was first started */
+    seL4_UserContext ctxt = {0};
+    ctxt.pc = info->entry_point;
+    ctxt.sp = info->stack_top;
+    err = seL4_TCB_WriteRegisters(
+              BASE_TCB_CAP + pd,
+              seL4_True,
+              0, /* No flags */
+              sizeof(ctxt) / sizeof(seL4_Word),
+              &ctxt
+          );
+    if (err != seL4_NoError) {
+        microkit_dbg_puts("microkit_pd_reset: error writing TCB registers\n");
+        microkit_internal_crash(err);
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <microkit.h>
+#include <microkit_trace.h>
+
+#define __thread
+#include <sel4/sel4.h>
+
+/* Patched by the tool when the PD has a trace buffer, see microkit_trace.h */
+seL4_Word microkit_trace_buffer;
+seL4_Word microkit_trace_buffer_size;
+
+/* Cached so that recording an event does not need to read the buffer header twice */
+static seL4_Word trace_capacity;
+
+#if defined(CONFIG_ARCH_AARCH64)
+/* The generic timer is readable from user level and runs at the same rate on every core */
+static inline seL4_Uint64 trace_timestamp(void)
+{
+    seL4_Uint64 ticks;
+    asm volatile("mrs %0, cntpct_el0" : "=r"(ticks));
+    return ticks;
+}
+
+static inline seL4_Uint64 trace_frequency(void)
+{
+    seL4_Uint64 frequency;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    return frequency;
+}
+#elif defined(CONFIG_ARCH_RISCV)
+static inline seL4_Uint64 trace_timestamp(void)
+{
+    seL4_Uint64 ticks;
+    asm volatile("rdtime %0" : "=r"(ticks));
+    return ticks;
+}
+
+/* The timebase frequency is only known to the platform, 'microkit trace' takes it as an argument */
+static inline seL4_Uint64 trace_frequency(void)
+{
+    return 0;
+}
+#else
+#error "Unsupported architecture"
+#endif
+
+void microkit_internal_trace_init(void)
+{
+    if (microkit_trace_buffer == 0) {
+        return;
+    }
+
+    trace_capacity = microkit_trace_capacity(microkit_trace_buffer_size);
+
+    microkit_trace_shared *trace = (microkit_trace_shared *) microkit_trace_buffer;
+    trace->frequency = trace_frequency();
+    trace->capacity = trace_capacity;
+    /* Records from before a restart are kept, so count is left alone */
+    trace->magic = MICROKIT_TRACE_MAGIC;
+}
+
+void microkit_internal_trace_write(seL4_Uint8 event, microkit_channel ch, seL4_Uint32 arg)
+{
+    microkit_trace_shared *trace = (microkit_trace_shared *) microkit_trace_buffer;
+    seL4_Uint64 count = trace->count;
+    microkit_trace_record *record = &trace->records[count % trace_capacity];
+
+    record->timestamp = trace_timestamp();
+    record->event = event;
+    record->channel = ch;
+    record->reserved = 0;
+    record->arg = arg;
+    /* Nothing reads the buffer while the system runs, so no ordering is needed */
+    trace->count = count + 1;
+}
@@ -80,12 +80,60 @@ typedef void (*sel4_entry)(
     uintptr_t dtb_size,
     uintptr_t extra_device_addr_p,
     uintptr_t extra_device_size
+#if defined(ARCH_riscv64) && NUM_CPUS > 1
+    ,
+    uintptr_t hart_id,
+    uintptr_t core_id
+#endif
 );
 
+/* Allows word accesses to memory that is otherwise accessed as bytes. */
+typedef uint64_t __attribute__((__may_alias__)) copy_word_t;
+
 static void *memcpy(void *dst, const void *src, size_t sz)
 {
     char *dst_ = dst;
     const char *src_ = src;
+
+    /*
+     * Regions are copied before the MMU, and therefore the caches, are
+     * enabled, so every access goes all the way to memory. When the source
+     * and destination are equally aligned (the tool places the data of each
+     * region in the image so that they are) the bulk of the copy is done four
+     * words at a time (which the compiler turns into load/store pair
+     * instructions on AArch64). Word accesses must be aligned while the MMU
+     * is off, so anything else is copied a byte at a time.
+     */
+    if ((((uintptr_t)dst_ ^ (uintptr_t)src_) & (sizeof(copy_word_t) - 1)) == 0) {
+        while (((uintptr_t)dst_ & (sizeof(copy_word_t) - 1)) != 0 && sz > 0) {
+            *dst_++ = *src_++;
+            sz--;
+        }
+
+        copy_word_t *dst_words = (copy_word_t *)dst_;
+        const copy_word_t *src_words = (const copy_word_t *)src_;
+        while (sz >= 4 * sizeof(copy_word_t)) {
+            copy_word_t w0 = src_words[0];
+            copy_word_t w1 = src_words[1];
+            copy_word_t w2 = src_words[2];
+            copy_word_t w3 = src_words[3];
+            dst_words[0] = w0;
+            dst_words[1] = w1;
+            dst_words[2] = w2;
+            dst_words[3] = w3;
+            dst_words += 4;
+            src_words += 4;
+            sz -= 4 * sizeof(copy_word_t);
+        }
+        while (sz >= sizeof(copy_word_t)) {
+            *dst_words++ = *src_words++;
+            sz -= sizeof(copy_word_t);
+        }
+
+        dst_ = (char *)dst_words;
+        src_ = (const char *)src_words;
+    }
+
     while (sz-- > 0) {
         *dst_++ = *src_++;
     }
@@ -93,6 +141,42 @@ static void *memcpy(void *dst, const void *src, size_t sz)
     return dst;
 }
 
+static void *memset(void *dst, int c, size_t sz)
+{
+    char *dst_ = dst;
+    copy_word_t word = (unsigned char)c;
+    word |= word << 8;
+    word |= word << 16;
+    word |= word << 32;
+
+    /* As with memcpy, the bulk of the region is written four aligned words at a time. */
+    while (((uintptr_t)dst_ & (sizeof(copy_word_t) - 1)) != 0 && sz > 0) {
+        *dst_++ = c;
+        sz--;
+    }
+
+    copy_word_t *dst_words = (copy_word_t *)dst_;
+    while (sz >= 4 * sizeof(copy_word_t)) {
+        dst_words[0] = word;
+        dst_words[1] = word;
+        dst_words[2] = word;
+        dst_words[3] = word;
+        dst_words += 4;
+        sz -= 4 * sizeof(copy_word_t);
+    }
+    while (sz >= sizeof(copy_word_t)) {
+        *dst_words++ = word;
+        sz -= sizeof(copy_word_t);
+    }
+
+    dst_ = (char *)dst_words;
+    while (sz-- > 0) {
+        *dst_++ = c;
+    }
+
+    return dst;
+}
+
 void *memmove(void *restrict dest, const void *restrict src, size_t n)
 {
     unsigned char *d = (unsigned char *)dest;
@@ -120,7 +204,8 @@ void *memmove(void *restrict dest, const void *restrict src, size_t n)
     return dest;
 }
 
-char _stack[STACK_SIZE] ALIGN(16);
+/* Each CPU gets its own stack, the primary CPU uses the first one. */
+char _stack[NUM_CPUS][STACK_SIZE] ALIGN(16);
 
 #ifdef ARCH_aarch64
 void switch_to_el1(void);
@@ -381,6 +466,18 @@ static void puthex64(uint64_t val)
     puts(buffer);
 }
 
+static void putdecimal(uint64_t val)
+{
+    char buffer[20 + 1];
+    unsigned i = 20;
+    buffer[i] = 0;
+    do {
+        buffer[--i] = '0' + val % 10;
+        val /= 10;
+    } while (val != 0);
+    puts(&buffer[i]);
+}
+
 #ifdef ARCH_aarch64
 static void puthex(uintptr_t val)
 {
@@ -578,16 +675,80 @@ static void print_loader_data(void)
     }
 }
 
+#ifdef ARCH_aarch64
+static uint64_t timer_count(void)
+{
+    uint64_t count;
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(count) :: "memory");
+    return count;
+}
+
+static uint64_t timer_frequency(void)
+{
+    uint64_t frequency;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    return frequency;
+}
+#elif defined(ARCH_riscv64)
+static uint64_t timer_count(void)
+{
+    uint64_t count;
+    asm volatile("rdtime %0" : "=r"(count) :: "memory");
+    return count;
+}
+
+static uint64_t timer_frequency(void)
+{
+    /* The timebase frequency is only described by the device tree, which we do not parse */
+    return 0;
+}
+#endif
+
+static void print_copy_throughput(uint64_t size, uint64_t ticks)
+{
+    uint64_t frequency = timer_frequency();
+    puts(" (");
+    if (frequency == 0) {
+        putdecimal(ticks);
+        puts(" timer ticks)\n");
+        return;
+    }
+
+    putdecimal(ticks * 1000000 / frequency);
+    puts(" us");
+    if (ticks != 0) {
+        puts(", ");
+        putdecimal(size * frequency / 1024 / ticks);
+        puts(" KiB/s");
+    }
+    puts(")\n");
+}
+
 static void copy_data(void)
 {
     const void *base = &loader_data->regions[loader_data->num_regions];
+    uint64_t total_size = 0;
+    uint64_t total_ticks = 0;
     for (uint32_t i = 0; i < loader_data->num_regions; i++) {
         const struct region *r = &loader_data->regions[i];
-        puts("LDR|INFO: copying region ");
+        /* Zero regions have no data in the image, they are just cleared */
+        puts(r->type == REGION_TYPE_ZERO ? "LDR|INFO: zeroing region " : "LDR|INFO: copying region ");
         puthex32(i);
-        puts("\n");
-        memcpy((void *)(uintptr_t)r->load_addr, base + r->offset, r->size);
+        uint64_t start = timer_count();
+        if (r->type == REGION_TYPE_ZERO) {
+            memset((void *)(uintptr_t)r->load_addr, 0, r->size);
+        } else {
+            memcpy((void *)(uintptr_t)r->load_addr, base + r->offset, r->size);
+        }
+        uint64_t ticks = timer_count() - start;
+        print_copy_throughput(r->size, ticks);
+        total_size += r->size;
+        total_ticks += ticks;
     }
+    puts("LDR|INFO: loaded ");
+    putdecimal(total_size);
+    puts(" bytes");
+    print_copy_throughput(total_size, total_ticks);
 }
 
 #ifdef ARCH_aarch64
@@ -643,8 +804,17 @@ static int ensure_correct_el(void)
 }
 #endif
 
-static void start_kernel(void)
+static void start_kernel(uintptr_t cpu)
 {
+#if defined(ARCH_aarch64) && NUM_CPUS > 1
+    /* seL4 takes the index of the core it is entered on, which selects its
+     * per-core kernel stack, from the thread ID register of the EL it runs at */
+    if (current_el() == EL2) {
+        asm volatile("msr tpidr_el2, %0" :: "r"(cpu));
+    } else {
+        asm volatile("msr tpidr_el1, %0" :: "r"(cpu));
+    }
+#endif
     ((sel4_entry)(loader_data->kernel_entry))(
         loader_data->ui_p_reg_start,
         loader_data->ui_p_reg_end,
@@ -654,10 +824,31 @@ static void start_kernel(void)
         0,
         loader_data->extra_device_addr_p,
         loader_data->extra_device_size
+#if defined(ARCH_riscv64) && NUM_CPUS > 1
+        ,
+        FIRST_HART_ID + cpu,
+        cpu
+#endif
     );
 }
 
 #if defined(BOARD_zcu102) || defined(BOARD_ultra96v2) || defined(BOARD_qemu_virt_aarch64)
+/* Setup for the CPU this is called on, see configure_gicv2 for details. */
+static void configure_gicv2_cpu(void)
+{
+    /* GICD_IGROUP0 covers the SGIs and PPIs and is banked per CPU */
+    *((volatile uint32_t *)(GICD_BASE + 0x80)) = 0xFFFFFFFF;
+
+    /* For any interrupts to go through the interrupt priority mask
+     * must be set appropriately. Only interrupts with priorities less
+     * than this mask will interrupt the CPU.
+     *
+     * seL4 (effectively) sets interrupts to priority 0x80, so it is
+     * important to make sure this is greater than 0x80.
+     */
+    *((volatile uint32_t *)(GICC_BASE + 0x4)) = 0xf0;
+}
+
 static void configure_gicv2(void)
 {
     /* The ZCU102 start in EL3, and then we drop to EL1(NS).
@@ -676,9 +867,9 @@ static void configure_gicv2(void)
      *
      * 0xF901_0000.
      *
-     * Future work: On multicore systems the distributor setup
-     * only needs to be called once, while the GICC registers
-     * should be set for each CPU.
+     * On multicore systems the distributor setup only needs to be
+     * done once, the banked GICD_IGROUP0 and the GICC registers are
+     * set for each CPU in configure_gicv2_cpu.
      */
     puts("LDR|INFO: Setting all interrupts to Group 1\n");
     uint32_t gicd_typer = *((volatile uint32_t *)(GICD_BASE + 0x4));
@@ -687,18 +878,11 @@ static void configure_gicv2(void)
     puthex32(it_lines_number);
     puts("\n");
 
-    for (uint32_t i = 0; i <= it_lines_number; i++) {
+    for (uint32_t i = 1; i <= it_lines_number; i++) {
         *((volatile uint32_t *)(GICD_BASE + 0x80 + (i * 4))) = 0xFFFFFFFF;
     }
 
-    /* For any interrupts to go through the interrupt priority mask
-     * must be set appropriately. Only interrupts with priorities less
-     * than this mask will interrupt the CPU.
-     *
-     * seL4 (effectively) sets interrupts to priority 0x80, so it is
-     * important to make sure this is greater than 0x80.
-     */
-    *((volatile uint32_t *)(GICC_BASE + 0x4)) = 0xf0;
+    configure_gicv2_cpu();
 }
 #endif
 
@@ -766,6 +950,194 @@ void set_exception_handler()
 #endif
 }
 
+#ifdef ARCH_aarch64
+static int enable_mmu_current_el(void)
+{
+    enum el el = current_el();
+    if (el == EL1) {
+        el1_mmu_enable();
+    } else if (el == EL2) {
+        el2_mmu_enable();
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+
+#if NUM_CPUS > 1
+/*
+ * Secondary CPU bring-up.
+ *
+ * The primary CPU starts each secondary CPU one at a time (via PSCI on
+ * AArch64 and the SBI HSM extension on RISC-V) and waits for it to report
+ * that it is up before moving on to the next, this keeps the console output
+ * of each CPU from being interleaved. Once all CPUs are up, the primary
+ * releases them and they all enter the kernel, which does its own
+ * synchronisation of the boot process between cores.
+ *
+ * Everything here happens before any CPU has enabled its MMU, so all
+ * accesses to these variables are uncached.
+ */
+static volatile uintptr_t secondary_cpus_up;
+static volatile uintptr_t secondary_cpus_release;
+
+#ifdef ARCH_aarch64
+#define PSCI_SM64_CPU_ON 0xc4000003
+#define PSCI_SUCCESS 0
+
+void arm_secondary_cpu_entry(void);
+
+static void memory_barrier(void)
+{
+    asm volatile("dsb sy" ::: "memory");
+}
+
+/*
+ * PSCI is implemented by the firmware at the exception level above the one
+ * the loader was started at, so it is called with HVC if the loader was
+ * started at EL1 (e.g QEMU virt without virtualization=on) and with SMC
+ * otherwise. This has to be decided before the loader changes EL.
+ */
+static int psci_use_hvc;
+
+static void psci_init(void)
+{
+    psci_use_hvc = current_el() == EL1;
+}
+
+#define PSCI_CALL(conduit)                                                      \
+    asm volatile(conduit                                                        \
+                 : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3)                       \
+                 :                                                              \
+                 : "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12",     \
+                 "x13", "x14", "x15", "x16", "x17", "memory")
+
+static int psci_cpu_on(uintptr_t target_cpu, uintptr_t entry_point, uintptr_t context_id)
+{
+    register uintptr_t x0 asm("x0") = PSCI_SM64_CPU_ON;
+    register uintptr_t x1 asm("x1") = target_cpu;
+    register uintptr_t x2 asm("x2") = entry_point;
+    register uintptr_t x3 asm("x3") = context_id;
+    if (psci_use_hvc) {
+        PSCI_CALL("hvc #0");
+    } else {
+        PSCI_CALL("smc #0");
+    }
+
+    return (int)x0;
+}
+
+static int start_secondary_cpu(uintptr_t cpu)
+{
+    /* We assume the CPUs are numbered linearly in the affinity 0 field of their MPIDR */
+    return psci_cpu_on(cpu, (uintptr_t)arm_secondary_cpu_entry, cpu) != PSCI_SUCCESS;
+}
+#elif defined(ARCH_riscv64)
+#define SBI_HSM_BASE_EID 0x48534D
+#define SBI_HSM_BASE_HART_START_FID 0
+#define SBI_SUCCESS 0
+
+void riscv_secondary_cpu_entry(void);
+
+static void memory_barrier(void)
+{
+    asm volatile("fence rw, rw" ::: "memory");
+}
+
+static int sbi_hart_start(uintptr_t hart_id, uintptr_t start_addr, uintptr_t opaque)
+{
+    register uintptr_t a0 asm("a0") = hart_id;
+    register uintptr_t a1 asm("a1") = start_addr;
+    register uintptr_t a2 asm("a2") = opaque;
+    register uintptr_t a6 asm("a6") = SBI_HSM_BASE_HART_START_FID;
+    register uintptr_t a7 asm("a7") = SBI_HSM_BASE_EID;
+    asm volatile("ecall"
+                 : "+r"(a0), "+r"(a1)
+                 : "r"(a2), "r"(a6), "r"(a7)
+                 : "memory");
+
+    return (int)a0;
+}
+
+static int start_secondary_cpu(uintptr_t cpu)
+{
+    /* We assume the harts are numbered linearly starting from FIRST_HART_ID */
+    return sbi_hart_start(FIRST_HART_ID + cpu, (uintptr_t)riscv_secondary_cpu_entry, cpu) != SBI_SUCCESS;
+}
+#endif
+
+/* Called from the architecture specific entry point, with the stack for the CPU setup. */
+void secondary_cpu_entry(uintptr_t cpu)
+{
+    set_exception_handler();
+
+#if defined(BOARD_zcu102) || defined(BOARD_ultra96v2) || defined(BOARD_qemu_virt_aarch64)
+    configure_gicv2_cpu();
+#endif
+
+#ifdef ARCH_aarch64
+    if (ensure_correct_el() != 0) {
+        /* The primary CPU will not hear from us and so will not continue booting */
+        for (;;) {
+        }
+    }
+#endif
+
+    secondary_cpus_up++;
+    memory_barrier();
+
+    while (!secondary_cpus_release) {}
+
+#ifdef ARCH_aarch64
+    if (enable_mmu_current_el() != 0) {
+        puts("LDR|ERROR: unknown EL level for MMU enable on CPU ");
+        puthex32(cpu);
+        puts("\n");
+        for (;;) {
+        }
+    }
+#elif defined(ARCH_riscv64)
+    enable_mmu();
+#endif
+
+    start_kernel(cpu);
+
+    for (;;) {
+    }
+}
+
+/* The kernel waits for all of the CPUs it is configured for, so every one is started */
+static int start_secondary_cpus(void)
+{
+    for (uintptr_t cpu = 1; cpu < NUM_CPUS; cpu++) {
+        puts("LDR|INFO: starting CPU ");
+        puthex32(cpu);
+        puts("\n");
+        if (start_secondary_cpu(cpu)) {
+            puts("LDR|ERROR: failed to start CPU ");
+            puthex32(cpu);
+            puts("\n");
+            return 1;
+        }
+        while (secondary_cpus_up != cpu) {}
+        puts("LDR|INFO: CPU ");
+        puthex32(cpu);
+        puts(" is up\n");
+    }
+
+    return 0;
+}
+
+static void release_secondary_cpus(void)
+{
+    memory_barrier();
+    secondary_cpus_release = 1;
+    memory_barrier();
+}
+#endif
+
 int main(void)
 {
     uart_init();
@@ -788,6 +1160,10 @@ int main(void)
 
     print_loader_data();
 
+#if NUM_CPUS > 1 && defined(ARCH_aarch64)
+    psci_init();
+#endif
+
     /* past here we have trashed u-boot so any errors should go to the
      * fail label; it's not possible to return to U-boot
      */
@@ -799,19 +1175,24 @@ int main(void)
 
 #ifdef ARCH_aarch64
     int r;
-    enum el el;
     r = ensure_correct_el();
     if (r != 0) {
         goto fail;
     }
+#endif
+
+#if NUM_CPUS > 1
+    if (start_secondary_cpus() != 0) {
+        goto fail;
+    }
+    /* The secondary CPUs must be released before our MMU, and hence data
+     * cache, is enabled as they are polling uncached memory. */
+    release_secondary_cpus();
+#endif
 
+#ifdef ARCH_aarch64
     puts("LDR|INFO: enabling MMU\n");
-    el = current_el();
-    if (el == EL1) {
-        el1_mmu_enable();
-    } else if (el == EL2) {
-        el2_mmu_enable();
-    } else {
+    if (enable_mmu_current_el() != 0) {
         puts("LDR|ERROR: unknown EL level for MMU enable\n");
     }
 #elif defined(ARCH_riscv64)
@@ -820,7 +1201,7 @@ int main(void)
 #endif
 
     puts("LDR|INFO: jumping to kernel\n");
-    start_kernel();
+    start_kernel(0);
 
     puts("LDR|ERROR: seL4 Loader: Error - KERNEL RETURNED\n");
 
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * The logger prints what every other PD writes to its log buffer, see
+ * microkit_log.h. It is added to the system by the tool when the SDF has a
+ * 'logger' element, and is notified on channel 0 when there is something to
+ * print.
+ */
+#include <microkit.h>
+#include <microkit_log.h>
+
+#define MAX_BUFFERS 64
+
+/* Patched by the tool. The buffers are mapped one after the other. */
+seL4_Word log_buffers;
+seL4_Word log_buffer_size;
+seL4_Word log_buffers_len;
+
+/* How many dropped bytes have been reported for each buffer */
+static seL4_Word dropped_reported[MAX_BUFFERS];
+
+static microkit_log_shared *buffer(seL4_Word i)
+{
+    return (microkit_log_shared *)(log_buffers + i * log_buffer_size);
+}
+
+/*
+ * Returns the end of what can be printed from 'log': everything up to the last
+ * newline, or the whole buffer if it is full and no more can be written.
+ */
+static seL4_Word printable_end(microkit_log_shared *log, seL4_Word head)
+{
+    seL4_Word capacity = microkit_log_capacity(log_buffer_size);
+    seL4_Word tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+
+    if (tail - head == capacity) {
+        return tail;
+    }
+    while (tail != head && log->data[(tail - 1) % capacity] != '\n') {
+        tail--;
+    }
+    return tail;
+}
+
+static void put64(seL4_Word x)
+{
+    char tmp[21];
+    unsigned i = sizeof(tmp) - 1;
+    tmp[i] = 0;
+    do {
+        tmp[--i] = '0' + (x % 10);
+        x /= 10;
+    } while (x);
+    microkit_dbg_puts(&tmp[i]);
+}
+
+static void drain(seL4_Word i)
+{
+    microkit_log_shared *log = buffer(i);
+    seL4_Word capacity = microkit_log_capacity(log_buffer_size);
+    seL4_Word head = log->head;
+    seL4_Word end = printable_end(log, head);
+    seL4_Word index = head % capacity;
+
+    for (; head != end; head++) {
+        microkit_dbg_putc(log->data[index]);
+        if (++index == capacity) {
+            index = 0;
+        }
+    }
+    /* Finish reading the data before handing the space back */
+    __atomic_store_n(&log->head, head, __ATOMIC_RELEASE);
+
+    seL4_Word dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+    if (dropped != dropped_reported[i]) {
+        microkit_dbg_puts("LOGGER|WARNING: dropped ");
+        put64(dropped - dropped_reported[i]);
+        microkit_dbg_puts(" bytes from log buffer ");
+        put64(i);
+        microkit_dbg_puts("\n");
+        dropped_reported[i] = dropped;
+    }
+}
+
+static void drain_all(void)
+{
+    seL4_Bool again;
+    do {
+        for (seL4_Word i = 0; i < log_buffers_len; i++) {
+            drain(i);
+        }
+
+        /* Ask to be notified when a line is next finished */
+        for (seL4_Word i = 0; i < log_buffers_len; i++) {
+            __atomic_store_n(&buffer(i)->logger_sleeping, 1, __ATOMIC_RELAXED);
+        }
+        /* Order setting the flags before re-reading the tails, see log_write in libmicrokit */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        again = seL4_False;
+        for (seL4_Word i = 0; i < log_buffers_len; i++) {
+            microkit_log_shared *log = buffer(i);
+            if (printable_end(log, log->head) != log->head) {
+                again = seL4_True;
+            }
+        }
+    } while (again);
+}
+
+void init(void)
+{
+    if (log_buffers_len > MAX_BUFFERS) {
+        microkit_dbg_puts("LOGGER|ERROR: too many log buffers\n");
+        return;
+    }
+    /* PDs of a higher priority may have already written to their buffers */
+    drain_all();
+}
+
+void notified(microkit_channel ch)
+{
+    drain_all();
+}
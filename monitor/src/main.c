@@ -71,15 +71,19 @@
 
 #define MAX_UNTYPED_REGIONS 256
 
-/* Max words available for bootstrap invocations.
+/* Max bytes available for bootstrap invocations.
  *
  * Only a small number of syscalls is required to
  * get to the point where the main syscalls data
  * is mapped in, so we keep this small.
- *
- * FIXME: This can be smaller once compression is enabled.
  */
-#define BOOTSTRAP_INVOCATION_DATA_SIZE 150
+#define BOOTSTRAP_INVOCATION_DATA_SIZE 512
+
+/* Max words in a single invocation (excluding the command word), this is the
+ * service, caps and MRs along with an increment for each if the invocation
+ * is repeated.
+ */
+#define MAX_INVOCATION_WORDS (2 * (1 + seL4_MsgMaxExtraCaps + seL4_MsgMaxLength))
 
 seL4_IPCBuffer *__sel4_ipc_buffer;
 
@@ -113,10 +117,15 @@ struct untyped_info {
 };
 
 seL4_Word bootstrap_invocation_count;
-seL4_Word bootstrap_invocation_data[BOOTSTRAP_INVOCATION_DATA_SIZE];
+uint8_t bootstrap_invocation_data[BOOTSTRAP_INVOCATION_DATA_SIZE];
 
 seL4_Word system_invocation_count;
-seL4_Word *system_invocation_data = (void *)0x80000000;
+uint8_t *system_invocation_data = (void *)0x80000000;
+
+/* State for decoding the invocation data, see decode_invocation */
+static bool have_prev_invocation;
+static seL4_Word prev_invocation_cmd;
+static seL4_Word invocation_words[MAX_INVOCATION_WORDS];
 
 struct untyped_info untyped_info;
 
@@ -491,7 +500,54 @@ static bool check_untypeds_match(seL4_BootInfo *bi)
     return true;
 }
 
-static unsigned perform_invocation(seL4_Word *invocation_data, unsigned offset, unsigned idx)
+static seL4_Word decode_varint(uint8_t *data, unsigned *offset)
+{
+    seL4_Word value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = data[*offset];
+        *offset += 1;
+        value |= (seL4_Word)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return value;
+}
+
+static seL4_Word decode_zigzag(seL4_Word value)
+{
+    return (value >> 1) ^ -(value & 1);
+}
+
+/*
+ * The invocation data is encoded by the tool to keep it small. Each invocation
+ * is a varint command word (the message tag with the repeat count in the upper
+ * 32 bits) followed by the rest of its words as zig-zag encoded varints. If the
+ * previous invocation had the same command word then each word is the difference
+ * from the corresponding word of the previous invocation.
+ *
+ * The decoded words are left in invocation_words.
+ */
+static unsigned decode_invocation(uint8_t *invocation_data, unsigned offset, seL4_Word cmd, unsigned word_count)
+{
+    if (word_count > MAX_INVOCATION_WORDS) {
+        fail("invocation has too many words");
+    }
+
+    bool is_delta = have_prev_invocation && cmd == prev_invocation_cmd;
+    for (unsigned i = 0; i < word_count; i++) {
+        seL4_Word base = is_delta ? invocation_words[i] : 0;
+        invocation_words[i] = base + decode_zigzag(decode_varint(invocation_data, &offset));
+    }
+
+    have_prev_invocation = true;
+    prev_invocation_cmd = cmd;
+
+    return offset;
+}
+
+static unsigned perform_invocation(uint8_t *invocation_data, unsigned offset, unsigned idx)
 {
     seL4_MessageInfo_t tag, out_tag;
     seL4_Error result;
@@ -501,15 +557,15 @@ static unsigned perform_invocation(seL4_Word *invocation_data, unsigned offset,
     seL4_Word mr3;
     seL4_Word service;
     seL4_Word service_incr;
-    seL4_Word cmd = invocation_data[offset];
+    seL4_Word cmd = decode_varint(invocation_data, &offset);
     seL4_Word iterations = (cmd >> 32) + 1;
     seL4_Word tag0 = cmd & 0xffffffffULL;
     unsigned int cap_offset, cap_incr_offset, cap_count;
     unsigned int mr_offset, mr_incr_offset, mr_count;
+    unsigned int word_count;
     unsigned int next_offset;
 
     tag.words[0] = tag0;
-    service = invocation_data[offset + 1];
     cap_count = seL4_MessageInfo_get_extraCaps(tag);
     mr_count = seL4_MessageInfo_get_length(tag);
 
@@ -523,15 +579,19 @@ static unsigned perform_invocation(seL4_Word *invocation_data, unsigned offset,
     puts("\n");
 #endif
 
-    cap_offset = offset + 2;
+    word_count = 1 + cap_count + mr_count;
+    if (iterations > 1) {
+        word_count *= 2;
+    }
+    next_offset = decode_invocation(invocation_data, offset, cmd, word_count);
+
+    service = invocation_words[0];
+    cap_offset = 1;
     mr_offset = cap_offset + cap_count;
     if (iterations > 1) {
-        service_incr = invocation_data[mr_offset + mr_count];
+        service_incr = invocation_words[mr_offset + mr_count];
         cap_incr_offset = mr_offset + mr_count + 1;
         mr_incr_offset = cap_incr_offset + cap_count;
-        next_offset = mr_incr_offset + mr_count;
-    } else {
-        next_offset = mr_offset + mr_count;
     }
 
     if (seL4_MessageInfo_get_capsUnwrapped(tag) != 0) {
@@ -548,9 +608,9 @@ static unsigned perform_invocation(seL4_Word *invocation_data, unsigned offset,
             call_service += service_incr * i;
         }
         for (unsigned j = 0; j < cap_count; j++) {
-            seL4_Word cap = invocation_data[cap_offset + j];
+            seL4_Word cap = invocation_words[cap_offset + j];
             if (i > 0) {
-                cap += invocation_data[cap_incr_offset + j] * i;
+                cap += invocation_words[cap_incr_offset + j] * i;
             }
 #if 0
             puts("   SetCap: ");
@@ -563,9 +623,9 @@ static unsigned perform_invocation(seL4_Word *invocation_data, unsigned offset,
         }
 
         for (unsigned j = 0; j < mr_count; j++) {
-            seL4_Word mr = invocation_data[mr_offset + j];
+            seL4_Word mr = invocation_words[mr_offset + j];
             if (i > 0) {
-                mr += invocation_data[mr_incr_offset + j] * i;
+                mr += invocation_words[mr_incr_offset + j] * i;
             }
 #if 0
             puts("   SetMR: ");
@@ -1093,6 +1153,8 @@ void main(seL4_BootInfo *bi)
     }
     puts("MON|INFO: completed bootstrap invocations\n");
 
+    /* The system invocations are encoded independently of the bootstrap invocations */
+    have_prev_invocation = false;
     offset = 0;
     for (unsigned idx = 0; idx < system_invocation_count; idx++) {
         offset = perform_invocation(system_invocation_data, offset, idx);
@@ -7,7 +7,9 @@
 use crate::util::bytes_to_struct;
 use std::collections::HashMap;
 use std::fs;
+use std::ops::{Deref, Range};
 use std::path::Path;
+use std::sync::Arc;
 
 #[repr(C, packed)]
 struct ElfHeader32 {
@@ -96,8 +98,110 @@ struct ElfHeader64 {
 
 const ELF_MAGIC: &[u8; 4] = b"\x7FELF";
 
+/// The bytes of an ELF file.
+///
+/// On 64-bit Unix hosts the file is mapped read-only rather than read, so only
+/// the parts of it that are used (the headers, the symbol table and the data
+/// of the loadable segments) are paged in, and the rest, such as debug
+/// information, is never copied. Like any mapping of a file, the file must
+/// not be modified while the tool is running.
+enum ElfBytes {
+    #[cfg(all(unix, target_pointer_width = "64"))]
+    Mapped {
+        ptr: *const u8,
+        len: usize,
+    },
+    Read(Vec<u8>),
+}
+
+// The mapping is private and never written, so it can be shared between
+// threads just like the Vec it stands in for.
+unsafe impl Send for ElfBytes {}
+unsafe impl Sync for ElfBytes {}
+
+#[cfg(all(unix, target_pointer_width = "64"))]
+mod mmap {
+    use std::os::raw::{c_int, c_void};
+
+    const PROT_READ: c_int = 0x1;
+    const MAP_PRIVATE: c_int = 0x2;
+    const MAP_FAILED: *mut c_void = !0 as *mut c_void;
+
+    extern "C" {
+        fn mmap(
+            addr: *mut c_void,
+            len: usize,
+            prot: c_int,
+            flags: c_int,
+            fd: c_int,
+            offset: i64,
+        ) -> *mut c_void;
+        fn munmap(addr: *mut c_void, len: usize) -> c_int;
+    }
+
+    pub fn map(fd: c_int, len: usize) -> std::io::Result<*const u8> {
+        let ptr = unsafe { mmap(std::ptr::null_mut(), len, PROT_READ, MAP_PRIVATE, fd, 0) };
+        if ptr == MAP_FAILED {
+            return Err(std::io::Error::last_os_error());
+        }
+        Ok(ptr as *const u8)
+    }
+
+    pub fn unmap(ptr: *const u8, len: usize) {
+        unsafe { munmap(ptr as *mut c_void, len) };
+    }
+}
+
+impl ElfBytes {
+    fn from_path(path: &Path) -> std::io::Result<ElfBytes> {
+        #[cfg(all(unix, target_pointer_width = "64"))]
+        {
+            use std::os::unix::io::AsRawFd;
+
+            let file = fs::File::open(path)?;
+            let len = file.metadata()?.len() as usize;
+            // An empty mapping is not allowed, it is left to be rejected
+            // as an ELF below.
+            if len > 0 {
+                let ptr = mmap::map(file.as_raw_fd(), len)?;
+                return Ok(ElfBytes::Mapped { ptr, len });
+            }
+        }
+
+        fs::read(path).map(ElfBytes::Read)
+    }
+}
+
+impl Deref for ElfBytes {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            #[cfg(all(unix, target_pointer_width = "64"))]
+            ElfBytes::Mapped { ptr, len } => unsafe { std::slice::from_raw_parts(*ptr, *len) },
+            ElfBytes::Read(bytes) => bytes,
+        }
+    }
+}
+
+impl Drop for ElfBytes {
+    fn drop(&mut self) {
+        #[cfg(all(unix, target_pointer_width = "64"))]
+        if let ElfBytes::Mapped { ptr, len } = self {
+            mmap::unmap(*ptr, *len);
+        }
+    }
+}
+
+/// A segment borrows its initialised data from the bytes of the ELF file,
+/// which are shared by all of its segments. Only a segment that has a symbol
+/// patched gets its own copy of the data, and the zero-initialised part of
+/// the segment past the data is never materialised.
 pub struct ElfSegment {
-    pub data: Vec<u8>,
+    file: Arc<ElfBytes>,
+    file_range: Range<usize>,
+    patched: Option<Vec<u8>>,
+    mem_size: u64,
     pub phys_addr: u64,
     pub virt_addr: u64,
     pub loadable: bool,
@@ -105,8 +209,31 @@ pub struct ElfSegment {
 }
 
 impl ElfSegment {
+    /// The initialised data of the segment, which may be shorter than the
+    /// segment, the rest of the segment is zero.
+    pub fn data(&self) -> &[u8] {
+        match &self.patched {
+            Some(data) => data,
+            None => &self.file[self.file_range.clone()],
+        }
+    }
+
     pub fn mem_size(&self) -> u64 {
-        self.data.len() as u64
+        self.mem_size
+    }
+
+    /// Writes to the segment at the given offset, which must be within the
+    /// segment, copying the data out of the file first if needed.
+    fn write(&mut self, offset: usize, data: &[u8]) {
+        let end = offset + data.len();
+        assert!(end as u64 <= self.mem_size);
+        let patched = self
+            .patched
+            .get_or_insert_with(|| self.file[self.file_range.clone()].to_vec());
+        if patched.len() < end {
+            patched.resize(end, 0);
+        }
+        patched[offset..end].copy_from_slice(data);
     }
 
     pub fn is_writable(&self) -> bool {
@@ -140,8 +267,8 @@ pub struct ElfFile {
 
 impl ElfFile {
     pub fn from_path(path: &Path) -> Result<ElfFile, String> {
-        let bytes = match fs::read(path) {
-            Ok(bytes) => bytes,
+        let bytes = match ElfBytes::from_path(path) {
+            Ok(bytes) => Arc::new(bytes),
             Err(err) => return Err(format!("Failed to read ELF '{}': {}", path.display(), err)),
         };
 
@@ -206,12 +333,11 @@ impl ElfFile {
                 continue;
             }
 
-            let mut segment_data = vec![0; phent.memsz as usize];
-            segment_data[..phent.filesz as usize]
-                .copy_from_slice(&bytes[segment_start..segment_end]);
-
             let segment = ElfSegment {
-                data: segment_data,
+                file: bytes.clone(),
+                file_range: segment_start..segment_end,
+                patched: None,
+                mem_size: phent.memsz,
                 phys_addr: phent.paddr,
                 virt_addr: phent.vaddr,
                 loadable: phent.type_ == 1,
@@ -319,10 +445,10 @@ impl ElfFile {
     pub fn write_symbol(&mut self, variable_name: &str, data: &[u8]) -> Result<(), String> {
         let (vaddr, size) = self.find_symbol(variable_name)?;
         for seg in &mut self.segments {
-            if vaddr >= seg.virt_addr && vaddr + size <= seg.virt_addr + seg.data.len() as u64 {
+            if vaddr >= seg.virt_addr && vaddr + size <= seg.virt_addr + seg.mem_size {
                 let offset = (vaddr - seg.virt_addr) as usize;
                 assert!(data.len() as u64 <= size);
-                seg.data[offset..offset + data.len()].copy_from_slice(data);
+                seg.write(offset, data);
                 return Ok(());
             }
         }
@@ -330,11 +456,14 @@ impl ElfFile {
         Err(format!("No symbol named {variable_name} found"))
     }
 
+    /// Only the initialised data of the segments can be read, not the
+    /// zero-initialised part past it.
     pub fn get_data(&self, vaddr: u64, size: u64) -> Option<&[u8]> {
         for seg in &self.segments {
-            if vaddr >= seg.virt_addr && vaddr + size <= seg.virt_addr + seg.data.len() as u64 {
+            let data = seg.data();
+            if vaddr >= seg.virt_addr && vaddr + size <= seg.virt_addr + data.len() as u64 {
                 let offset = (vaddr - seg.virt_addr) as usize;
-                return Some(&seg.data[offset..offset + size as usize]);
+                return Some(&data[offset..offset + size as usize]);
             }
         }
 
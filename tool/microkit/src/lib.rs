@@ -8,10 +8,12 @@ pub mod elf;
 pub mod loader;
 pub mod sdf;
 pub mod sel4;
+pub mod trace;
 pub mod util;
 
 use sel4::Config;
 use std::cmp::min;
+use std::collections::{BTreeMap, BTreeSet};
 use std::fmt;
 
 // Note that these values are used in the monitor so should also be changed there
@@ -73,8 +75,10 @@ impl Region {
         }
     }
 
-    pub fn data<'a>(&self, elf: &'a elf::ElfFile) -> &'a Vec<u8> {
-        &elf.segments[self.segment_idx].data
+    /// The initialised data of the region, which may be shorter than the
+    /// region, the rest of the region is zero.
+    pub fn data<'a>(&self, elf: &'a elf::ElfFile) -> &'a [u8] {
+        elf.segments[self.segment_idx].data()
     }
 }
 
@@ -158,71 +162,233 @@ impl MemoryRegion {
     }
 }
 
-#[derive(Default)]
-pub struct DisjointMemoryRegion {
-    pub regions: Vec<MemoryRegion>,
+const NIL: usize = usize::MAX;
+
+struct RegionNode {
+    base: u64,
+    size: u64,
+    /// Largest size of any region in the subtree rooted at this node
+    max_size: u64,
+    priority: u64,
+    left: usize,
+    right: usize,
 }
 
-impl DisjointMemoryRegion {
-    fn check(&self) {
-        // Ensure that regions are sorted and non-overlapping
-        let mut last_end: Option<u64> = None;
-        for region in &self.regions {
-            if last_end.is_some() {
-                assert!(region.base >= last_end.unwrap());
-            }
-            last_end = Some(region.end)
+/// Regions ordered by base, where each subtree also records the largest
+/// region in it. This answers the lowest region at or above an address that
+/// is at least a given size in time logarithmic in the number of regions,
+/// by skipping every subtree whose largest region is too small.
+///
+/// It is a treap with the nodes kept in a vector. The priority of a node is
+/// a hash of its base rather than random, so that the tool stays
+/// deterministic.
+struct RegionIndex {
+    nodes: Vec<RegionNode>,
+    free: Vec<usize>,
+    root: usize,
+}
+
+impl Default for RegionIndex {
+    fn default() -> RegionIndex {
+        RegionIndex {
+            nodes: Vec::new(),
+            free: Vec::new(),
+            root: NIL,
         }
     }
+}
 
-    pub fn insert_region(&mut self, base: u64, end: u64) {
-        let mut insert_idx = self.regions.len();
-        for (idx, region) in self.regions.iter().enumerate() {
-            if end <= region.base {
-                insert_idx = idx;
-                break;
+impl RegionIndex {
+    fn insert(&mut self, base: u64, size: u64) {
+        // splitmix64 finaliser
+        let mut priority = base.wrapping_add(0x9e37_79b9_7f4a_7c15);
+        priority = (priority ^ (priority >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+        priority = (priority ^ (priority >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+        priority ^= priority >> 31;
+
+        let node = RegionNode {
+            base,
+            size,
+            max_size: size,
+            priority,
+            left: NIL,
+            right: NIL,
+        };
+        let idx = match self.free.pop() {
+            Some(idx) => {
+                self.nodes[idx] = node;
+                idx
             }
-        }
-        // FIXME: Should extend here if adjacent rather than
-        // inserting now
-        self.regions
-            .insert(insert_idx, MemoryRegion::new(base, end));
-        self.check();
+            None => {
+                self.nodes.push(node);
+                self.nodes.len() - 1
+            }
+        };
+
+        let (below, above) = self.split(self.root, base);
+        let below = self.merge(below, idx);
+        self.root = self.merge(below, above);
     }
 
-    pub fn remove_region(&mut self, base: u64, end: u64) {
-        let mut maybe_idx = None;
-        for (i, r) in self.regions.iter().enumerate() {
-            if base >= r.base && end <= r.end {
-                maybe_idx = Some(i);
-                break;
+    fn remove(&mut self, base: u64) {
+        let (below, rest) = self.split(self.root, base);
+        let (node, above) = self.split(rest, base + 1);
+        assert!(node != NIL && self.nodes[node].base == base);
+        self.free.push(node);
+        self.root = self.merge(below, above);
+    }
+
+    /// Base of the lowest region at or above 'lower_bound' that is at least
+    /// 'size' bytes.
+    fn first_fit(&self, size: u64, lower_bound: u64) -> Option<u64> {
+        self.first_fit_in(self.root, size, lower_bound)
+            .map(|idx| self.nodes[idx].base)
+    }
+
+    fn first_fit_in(&self, idx: usize, size: u64, lower_bound: u64) -> Option<usize> {
+        if self.max_size(idx) < size {
+            return None;
+        }
+        let node = &self.nodes[idx];
+        // Only the path to 'lower_bound' has to look at both children. Once a
+        // subtree is entirely above it, the sizes lead straight to the region.
+        if node.base >= lower_bound {
+            if let Some(found) = self.first_fit_in(node.left, size, lower_bound) {
+                return Some(found);
+            }
+            if node.size >= size {
+                return Some(idx);
             }
         }
-        if maybe_idx.is_none() {
-            panic!("Internal error: attempting to remove region [0x{base:x}-0x{end:x}) that is not currently covered");
+        self.first_fit_in(node.right, size, lower_bound)
+    }
+
+    fn max_size(&self, idx: usize) -> u64 {
+        if idx == NIL {
+            0
+        } else {
+            self.nodes[idx].max_size
         }
+    }
 
-        let idx = maybe_idx.unwrap();
+    fn update(&mut self, idx: usize) {
+        let node = &self.nodes[idx];
+        let max_size = node
+            .size
+            .max(self.max_size(node.left))
+            .max(self.max_size(node.right));
+        self.nodes[idx].max_size = max_size;
+    }
 
-        let region = self.regions[idx];
+    /// Split the subtree into the regions below 'base' and those at or above it.
+    fn split(&mut self, idx: usize, base: u64) -> (usize, usize) {
+        if idx == NIL {
+            return (NIL, NIL);
+        }
+        if self.nodes[idx].base < base {
+            let (below, above) = self.split(self.nodes[idx].right, base);
+            self.nodes[idx].right = below;
+            self.update(idx);
+            (idx, above)
+        } else {
+            let (below, above) = self.split(self.nodes[idx].left, base);
+            self.nodes[idx].left = above;
+            self.update(idx);
+            (below, idx)
+        }
+    }
 
-        if region.base == base && region.end == end {
-            // Covers exactly, so just remove
-            self.regions.remove(idx);
-        } else if region.base == base {
-            // Trim the start of the region
-            self.regions[idx] = MemoryRegion::new(end, region.end);
-        } else if region.end == end {
-            // Trim end of the region
-            self.regions[idx] = MemoryRegion::new(region.base, base);
+    /// Join two subtrees, where every region of 'below' is below every region
+    /// of 'above'.
+    fn merge(&mut self, below: usize, above: usize) -> usize {
+        if below == NIL {
+            return above;
+        }
+        if above == NIL {
+            return below;
+        }
+        if self.nodes[below].priority > self.nodes[above].priority {
+            let right = self.merge(self.nodes[below].right, above);
+            self.nodes[below].right = right;
+            self.update(below);
+            below
         } else {
-            // Splitting
-            self.regions[idx] = MemoryRegion::new(region.base, base);
-            self.regions
-                .insert(idx + 1, MemoryRegion::new(end, region.end));
+            let left = self.merge(below, self.nodes[above].left);
+            self.nodes[above].left = left;
+            self.update(above);
+            above
+        }
+    }
+}
+
+/// A set of disjoint memory regions, ordered by address.
+///
+/// The regions are kept in a map from their base to their end so that
+/// finding the region containing an address, and inserting or removing a
+/// region, take logarithmic time in the number of regions. They are also
+/// kept in a `RegionIndex`, so that finding the first region that is large
+/// enough takes logarithmic time as well.
+#[derive(Default)]
+pub struct DisjointMemoryRegion {
+    regions: BTreeMap<u64, u64>,
+    index: RegionIndex,
+}
+
+impl DisjointMemoryRegion {
+    /// The regions in order of address
+    pub fn regions(&self) -> impl DoubleEndedIterator<Item = MemoryRegion> + '_ {
+        self.regions
+            .iter()
+            .map(|(&base, &end)| MemoryRegion::new(base, end))
+    }
+
+    /// The region containing the given address, if any
+    fn containing(&self, addr: u64) -> Option<MemoryRegion> {
+        self.regions
+            .range(..=addr)
+            .next_back()
+            .filter(|(_, &end)| addr < end)
+            .map(|(&base, &end)| MemoryRegion::new(base, end))
+    }
+
+    pub fn insert_region(&mut self, base: u64, end: u64) {
+        // Ensure that the region does not overlap with its neighbours
+        if let Some((_, &prev_end)) = self.regions.range(..=base).next_back() {
+            assert!(base >= prev_end);
+        }
+        if let Some((&next_base, _)) = self.regions.range(base..).next() {
+            assert!(end <= next_base);
         }
+        // FIXME: Should extend here if adjacent rather than
+        // inserting now
+        self.add(base, end);
+    }
 
-        self.check();
+    fn add(&mut self, base: u64, end: u64) {
+        self.regions.insert(base, end);
+        self.index.insert(base, end - base);
+    }
+
+    fn take(&mut self, region: MemoryRegion) {
+        self.regions.remove(&region.base);
+        self.index.remove(region.base);
+    }
+
+    pub fn remove_region(&mut self, base: u64, end: u64) {
+        let region = match self.containing(base) {
+            Some(region) if end <= region.end => region,
+            _ => panic!("Internal error: attempting to remove region [0x{base:x}-0x{end:x}) that is not currently covered"),
+        };
+
+        self.take(region);
+        if region.base != base {
+            // Keep the start of the region
+            self.add(region.base, base);
+        }
+        if region.end != end {
+            // Keep the end of the region
+            self.add(end, region.end);
+        }
     }
 
     pub fn aligned_power_of_two_regions(
@@ -231,7 +397,7 @@ impl DisjointMemoryRegion {
         max_bits: u64,
     ) -> Vec<MemoryRegion> {
         let mut aligned_regions = Vec::new();
-        for region in &self.regions {
+        for region in self.regions() {
             aligned_regions.extend(region.aligned_power_of_two_regions(config, max_bits));
         }
 
@@ -245,40 +411,30 @@ impl DisjointMemoryRegion {
     /// 'best' may be something that best matches a power-of-two
     /// allocation
     pub fn allocate(&mut self, size: u64) -> u64 {
-        let mut region_to_remove: Option<MemoryRegion> = None;
-        for region in &self.regions {
-            if size <= region.size() {
-                region_to_remove = Some(*region);
-                break;
-            }
-        }
-
-        match region_to_remove {
-            Some(region) => {
-                self.remove_region(region.base, region.base + size);
-                region.base
+        match self.first_fit(size, 0) {
+            Some(base) => {
+                self.remove_region(base, base + size);
+                base
             }
             None => panic!("Unable to allocate {size} bytes"),
         }
     }
 
     pub fn allocate_from(&mut self, size: u64, lower_bound: u64) -> u64 {
-        let mut region_to_remove = None;
-        for region in &self.regions {
-            if size <= region.size() && region.base >= lower_bound {
-                region_to_remove = Some(*region);
-                break;
-            }
-        }
-
-        match region_to_remove {
-            Some(region) => {
-                self.remove_region(region.base, region.base + size);
-                region.base
+        match self.first_fit(size, lower_bound) {
+            Some(base) => {
+                self.remove_region(base, base + size);
+                base
             }
             None => panic!("Unable to allocate {size} bytes from lower_bound 0x{lower_bound:x}"),
         }
     }
+
+    /// The base of the first region at or above 'lower_bound' that is at
+    /// least 'size' bytes.
+    fn first_fit(&self, size: u64, lower_bound: u64) -> Option<u64> {
+        self.index.first_fit(size, lower_bound)
+    }
 }
 
 #[derive(Copy, Clone)]
@@ -289,9 +445,12 @@ pub struct KernelAllocation {
 }
 
 pub struct UntypedAllocator {
-    untyped_object: UntypedObject,
+    pub untyped_object: UntypedObject,
     allocation_point: u64,
     allocations: Vec<KernelAllocation>,
+    /// Bytes skipped over, to align an object or to pad up to a fixed
+    /// address, which no object will use.
+    wasted: u64,
 }
 
 impl UntypedAllocator {
@@ -304,6 +463,7 @@ impl UntypedAllocator {
             untyped_object,
             allocation_point,
             allocations,
+            wasted: 0,
         }
     }
 
@@ -314,6 +474,38 @@ impl UntypedAllocator {
     pub fn end(&self) -> u64 {
         self.untyped_object.region.end
     }
+
+    pub fn free_space(&self) -> u64 {
+        self.end() - self.watermark()
+    }
+
+    pub fn wasted(&self) -> u64 {
+        self.wasted
+    }
+
+    /// Bytes in use by objects
+    pub fn used(&self) -> u64 {
+        self.allocation_point - self.wasted
+    }
+
+    fn watermark(&self) -> u64 {
+        self.base() + self.allocation_point
+    }
+
+    /// The size class of the untyped, which is the alignment of its
+    /// watermark, objects up to this size fit without any padding.
+    fn size_class(&self) -> usize {
+        min(util::lsb(self.watermark()), 63) as usize
+    }
+
+    /// The space left once the watermark is aligned up to each alignment
+    /// above its size class, for as long as there is any.
+    fn aligned_free_space(&self) -> impl Iterator<Item = (usize, u64)> + '_ {
+        (self.size_class() + 1..64).map_while(|bits| {
+            let aligned = (self.watermark() | ((1 << bits) - 1)).checked_add(1)?;
+            (aligned < self.end()).then(|| (bits, self.end() - aligned))
+        })
+    }
 }
 
 /// Allocator for kernel objects.
@@ -326,8 +518,13 @@ impl UntypedAllocator {
 /// policy (basically a bump allocator with alignment).
 ///
 /// The only 'choice' this allocator has is which untyped object
-/// to use. The current algorithm is simply first fit: the first
-/// untyped that has sufficient space. This is not optimal.
+/// to use. It is best fit: an untyped that needs no padding to align
+/// the allocation is preferred, and of those the best is the one with
+/// the least space left over, then the one at the lowest address. If
+/// every untyped that fits needs padding, the best is the one with the
+/// least space left once it is aligned. The untyped are indexed by
+/// their size class and by their space at each alignment, so that
+/// neither case has to look at every untyped.
 ///
 /// Note: The allocator does not generate the Retype invocations;
 /// this must be done with more knowledge (specifically the destination
@@ -339,6 +536,58 @@ pub struct ObjectAllocator {
     pub init_capacity: u64,
     allocation_idx: u64,
     pub untyped: Vec<UntypedAllocator>,
+    /// For each size class, the free space and index of each untyped in it
+    /// that has any free space
+    size_classes: Vec<BTreeSet<(u64, usize)>>,
+    /// For each alignment, the space left once the watermark is aligned to it
+    /// and the index of each untyped whose watermark is less aligned, and
+    /// that still has space left once it is. This finds the best untyped for
+    /// objects that need padding without checking every untyped.
+    aligned: Vec<BTreeSet<(u64, usize)>>,
+}
+
+/// The sizes of the untyped objects to pad from 'watermark' up to 'target' with.
+///
+/// Untyped objects must be a power of two in size and aligned to their size.
+/// Padding with the largest objects possible needs the fewest objects, but
+/// their sizes go up to the largest alignment and back down again, so no two
+/// of them are the same size next to each other and each needs its own retype.
+/// Capping the size of the objects instead gives a run of objects of that size
+/// in the middle, which are created by a single retype, at the cost of more
+/// objects and so more cap slots. Every cap is tried, and the one giving the
+/// fewest runs of same-sized objects is used, as long as it needs no more than
+/// 'max_objects' objects.
+fn padding_sizes(watermark: u64, target: u64, max_objects: u64) -> Vec<u64> {
+    let sizes_up_to = |max_bits: u64, max_objects: u64| {
+        let mut sizes = Vec::new();
+        let mut watermark = watermark;
+        while watermark < target {
+            if sizes.len() as u64 == max_objects {
+                return None;
+            }
+            let bits = min(
+                min(util::lsb(watermark), util::msb(target - watermark)),
+                max_bits,
+            );
+            sizes.push(1 << bits);
+            watermark += 1 << bits;
+        }
+        Some(sizes)
+    };
+    let runs = |sizes: &[u64]| sizes.windows(2).filter(|w| w[0] != w[1]).count();
+
+    let mut best = sizes_up_to(63, u64::MAX).unwrap();
+    // From the largest cap down, so that of equally good choices the one
+    // with the fewest objects is used
+    for max_bits in (0..63).rev() {
+        if let Some(sizes) = sizes_up_to(max_bits, max_objects) {
+            if runs(&sizes) < runs(&best) {
+                best = sizes;
+            }
+        }
+    }
+
+    best
 }
 
 /// First entry is potential padding, then the actual allocation is the second
@@ -358,37 +607,78 @@ impl ObjectAllocator {
             .collect();
         untyped.sort_by(|a, b| a.untyped_object.base().cmp(&b.untyped_object.base()));
 
-        let mut capacity = 0;
-        for ut in &untyped {
-            capacity += ut.end() - (ut.base() + ut.allocation_point);
-        }
-
-        ObjectAllocator {
+        let capacity = untyped.iter().map(|ut| ut.free_space()).sum();
+        let mut allocator = ObjectAllocator {
             init_capacity: capacity,
             allocation_idx: 0,
             untyped,
+            size_classes: vec![BTreeSet::new(); 64],
+            aligned: vec![BTreeSet::new(); 64],
+        };
+        for idx in 0..allocator.untyped.len() {
+            allocator.index(idx, true);
         }
+
+        allocator
     }
 
     pub fn capacity(&self) -> u64 {
         let mut capacity = 0;
         for ut in &self.untyped {
-            capacity += ut.end() - (ut.base() + ut.allocation_point);
+            capacity += ut.free_space();
         }
 
         capacity
     }
 
     pub fn max_alloc_size(&self) -> u64 {
-        let mut largest_capacity = 0;
-        for ut in &self.untyped {
-            let ut_capacity = ut.end() - (ut.base() + ut.allocation_point);
-            if ut_capacity > largest_capacity {
-                largest_capacity = ut_capacity;
-            }
+        self.size_classes
+            .iter()
+            .filter_map(|class| class.last())
+            .map(|(free_space, _)| *free_space)
+            .max()
+            .unwrap_or(0)
+    }
+
+    /// The index of the untyped containing the given physical address, if any
+    fn untyped_containing(&self, phys_addr: u64) -> Option<usize> {
+        let idx = self.untyped.partition_point(|ut| ut.end() <= phys_addr);
+        if idx < self.untyped.len() && self.untyped[idx].base() <= phys_addr {
+            Some(idx)
+        } else {
+            None
         }
+    }
+
+    /// Move the watermark of an untyped, 'wasted' bytes of the space it is
+    /// moved over are not used by any object.
+    fn set_allocation_point(&mut self, idx: usize, allocation_point: u64, wasted: u64) {
+        self.index(idx, false);
+        let ut = &mut self.untyped[idx];
+        ut.allocation_point = allocation_point;
+        ut.wasted += wasted;
+        self.index(idx, true);
+    }
 
-        largest_capacity
+    /// Add the untyped to, or remove it from, the indexes of free space
+    fn index(&mut self, idx: usize, insert: bool) {
+        let update = |set: &mut BTreeSet<(u64, usize)>, free_space: u64| {
+            if insert {
+                set.insert((free_space, idx));
+            } else {
+                set.remove(&(free_space, idx));
+            }
+        };
+
+        let ut = &self.untyped[idx];
+        if ut.free_space() == 0 {
+            return;
+        }
+        let aligned: Vec<(usize, u64)> = ut.aligned_free_space().collect();
+        update(&mut self.size_classes[ut.size_class()], ut.free_space());
+        for (bits, free_space) in aligned {
+            update(&mut self.aligned[bits], free_space);
+        }
     }
 
     pub fn alloc(&mut self, size: u64) -> Option<KernelAllocation> {
@@ -399,30 +689,50 @@ impl ObjectAllocator {
         assert!(util::is_power_of_two(size));
         assert!(count > 0);
         let mem_size = count * size;
-        for ut in &mut self.untyped {
-            // See if this fits
-            let start = util::round_up(ut.base() + ut.allocation_point, size);
-            if start + mem_size <= ut.end() {
-                ut.allocation_point = (start - ut.base()) + mem_size;
-                self.allocation_idx += 1;
-                let allocation = KernelAllocation {
-                    untyped_cap_address: ut.untyped_object.cap,
-                    phys_addr: start,
-                    size: mem_size,
-                };
-                ut.allocations.push(allocation);
-                return Some(allocation);
-            }
+        let size_bits = size.ilog2() as usize;
+
+        // An untyped whose size class is at least the size of the objects
+        // needs no padding, the best is then the one with the least space.
+        let mut best: Option<(u64, u64, usize)> = self.size_classes[size_bits..]
+            .iter()
+            .filter_map(|class| class.range((mem_size, 0)..).next())
+            .map(|&(free_space, idx)| (0, free_space, idx))
+            .min();
+        // Otherwise the one with the least space left once it is aligned
+        if best.is_none() {
+            best = self.aligned[size_bits]
+                .range((mem_size, 0)..)
+                .next()
+                .map(|&(_, idx)| {
+                    let ut = &self.untyped[idx];
+                    let padding = util::round_up(ut.watermark(), size) - ut.watermark();
+                    (padding, ut.free_space(), idx)
+                });
+        }
+
+        if let Some((padding, _, idx)) = best {
+            let ut = &self.untyped[idx];
+            let start = ut.watermark() + padding;
+            let allocation = KernelAllocation {
+                untyped_cap_address: ut.untyped_object.cap,
+                phys_addr: start,
+                size: mem_size,
+            };
+            self.set_allocation_point(idx, (start - ut.base()) + mem_size, padding);
+            self.allocation_idx += 1;
+            self.untyped[idx].allocations.push(allocation);
+            return Some(allocation);
         }
 
         None
     }
 
     pub fn reserve(&mut self, alloc: (&UntypedObject, u64)) {
-        for ut in &mut self.untyped {
+        if let Some(idx) = self.untyped_containing(alloc.0.base()) {
+            let ut = &self.untyped[idx];
             if *alloc.0 == ut.untyped_object {
                 if ut.base() <= alloc.1 && alloc.1 <= ut.end() {
-                    ut.allocation_point = alloc.1 - ut.base();
+                    self.set_allocation_point(idx, alloc.1 - ut.base(), 0);
                     return;
                 } else {
                     panic!(
@@ -439,71 +749,277 @@ impl ObjectAllocator {
         );
     }
 
+    /// Allocate up to 'count' contiguous objects of 'size' bytes starting at
+    /// 'phys_addr', as many as fit in the untyped containing it. The size of
+    /// the allocation returned is that of all of the objects together.
+    /// The padding objects needed to reach 'phys_addr' are returned in order
+    /// of address, see `padding_sizes` for how they are chosen.
     pub fn find_fixed(
         &mut self,
         phys_addr: u64,
         size: u64,
+        count: u64,
+        max_padding_objects: u64,
     ) -> Result<Option<FixedAllocation>, FindFixedError> {
-        for ut in &mut self.untyped {
-            /* Find the right untyped */
-            if phys_addr >= ut.base() && phys_addr < ut.end() {
-                if phys_addr < ut.base() + ut.allocation_point {
-                    return Err(FindFixedError::AlreadyAllocated);
-                }
+        /* Find the right untyped */
+        let Some(idx) = self.untyped_containing(phys_addr) else {
+            return Ok(None);
+        };
+        let ut = &self.untyped[idx];
+        if phys_addr < ut.base() + ut.allocation_point {
+            return Err(FindFixedError::AlreadyAllocated);
+        }
 
-                let space_left = ut.end() - (ut.base() + ut.allocation_point);
-                if space_left < size {
-                    return Err(FindFixedError::TooLarge);
-                }
+        // At least one object has to fit after the padding
+        let space_left = ut.end() - phys_addr;
+        if space_left < size {
+            return Err(FindFixedError::TooLarge);
+        }
 
-                let mut watermark = ut.base() + ut.allocation_point;
-                let mut allocations: Option<Vec<KernelAllocation>>;
-
-                if phys_addr != watermark {
-                    allocations = Some(Vec::new());
-                    /* If the watermark isn't at the right place, we need to pad */
-                    let mut padding_required = phys_addr - watermark;
-                    // We are restricted in how much we can pad:
-                    // 1: Untyped objects must be power-of-two sized.
-                    // 2: Untyped objects must be aligned to their size.
-                    let mut padding_sizes = Vec::new();
-                    // We have two potential approaches for how we pad.
-                    // 1: Use largest objects possible respecting alignment
-                    // and size restrictions.
-                    // 2: Use a fixed size object multiple times. This will
-                    // create more objects, but as same sized objects can be
-                    // create in a batch, required fewer invocations.
-                    // For now we choose #1
-                    while padding_required > 0 {
-                        let wm_lsb = util::lsb(watermark);
-                        let sz_msb = util::msb(padding_required);
-                        let pad_object_size = 1 << min(wm_lsb, sz_msb);
-                        padding_sizes.push(pad_object_size);
-
-                        allocations.as_mut().unwrap().push(KernelAllocation {
-                            untyped_cap_address: ut.untyped_object.cap,
-                            phys_addr: watermark,
-                            size: pad_object_size,
-                        });
-
-                        watermark += pad_object_size;
-                        padding_required -= pad_object_size;
-                    }
-                } else {
-                    allocations = None;
-                }
+        let mut watermark = ut.base() + ut.allocation_point;
+        let allocations = if phys_addr != watermark {
+            /* If the watermark isn't at the right place, we need to pad */
+            let padding_sizes = padding_sizes(watermark, phys_addr, max_padding_objects);
+            let padding = padding_sizes
+                .into_iter()
+                .map(|pad_object_size| {
+                    let allocation = KernelAllocation {
+                        untyped_cap_address: ut.untyped_object.cap,
+                        phys_addr: watermark,
+                        size: pad_object_size,
+                    };
+                    watermark += pad_object_size;
+                    allocation
+                })
+                .collect();
+            Some(padding)
+        } else {
+            None
+        };
 
-                let obj = KernelAllocation {
-                    untyped_cap_address: ut.untyped_object.cap,
-                    phys_addr: watermark,
-                    size,
-                };
+        let obj = KernelAllocation {
+            untyped_cap_address: ut.untyped_object.cap,
+            phys_addr: watermark,
+            size: min(count, (ut.end() - watermark) / size) * size,
+        };
 
-                ut.allocation_point = (watermark + size) - ut.base();
-                return Ok(Some((allocations, obj)));
-            }
+        self.set_allocation_point(
+            idx,
+            (watermark + obj.size) - ut.base(),
+            phys_addr - ut.watermark(),
+        );
+        Ok(Some((allocations, obj)))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_disjoint_memory_region() {
+        let mut memory = DisjointMemoryRegion::default();
+        memory.insert_region(0x3000, 0x4000);
+        memory.insert_region(0x1000, 0x2000);
+        memory.remove_region(0x1400, 0x1800);
+        memory.remove_region(0x3000, 0x3400);
+        assert_eq!(
+            memory.regions().collect::<Vec<_>>(),
+            [
+                MemoryRegion::new(0x1000, 0x1400),
+                MemoryRegion::new(0x1800, 0x2000),
+                MemoryRegion::new(0x3400, 0x4000)
+            ]
+        );
+        assert_eq!(memory.allocate(0x800), 0x1800);
+        assert_eq!(memory.allocate_from(0x100, 0x1001), 0x3400);
+        assert_eq!(memory.allocate(0x400), 0x1000);
+    }
+
+    #[test]
+    #[should_panic]
+    fn test_disjoint_memory_region_overlap() {
+        let mut memory = DisjointMemoryRegion::default();
+        memory.insert_region(0x1000, 0x2000);
+        memory.insert_region(0x1800, 0x2800);
+    }
+
+    #[test]
+    fn test_find_fixed_count() {
+        const PAGE: u64 = 0x1000;
+
+        let untyped = [
+            UntypedObject::new(1, MemoryRegion::new(0x10000, 0x20000), true),
+            UntypedObject::new(2, MemoryRegion::new(0x20000, 0x40000), true),
+        ];
+        let mut allocator = ObjectAllocator::new(untyped.iter().collect());
+
+        // Only the objects that fit in the first untyped are allocated
+        let Ok(Some((padding, alloc))) = allocator.find_fixed(0x13000, PAGE, 32, 256) else {
+            panic!("fixed allocation failed");
+        };
+        // Three pages of padding in one retype rather than two retypes of
+        // 0x2000 and 0x1000
+        let padding_sizes: Vec<u64> = padding.unwrap().iter().map(|p| p.size).collect();
+        assert_eq!(padding_sizes, [0x1000, 0x1000, 0x1000]);
+        assert_eq!(alloc.untyped_cap_address, 1);
+        assert_eq!((alloc.phys_addr, alloc.size), (0x13000, 13 * PAGE));
+
+        // The rest continue from the start of the next one, with no padding
+        let Ok(Some((padding, alloc))) = allocator.find_fixed(0x20000, PAGE, 19, 256) else {
+            panic!("fixed allocation failed");
+        };
+        assert!(padding.is_none());
+        assert_eq!(alloc.untyped_cap_address, 2);
+        assert_eq!((alloc.phys_addr, alloc.size), (0x20000, 19 * PAGE));
+
+        assert!(matches!(
+            allocator.find_fixed(0x21000, PAGE, 1, 256),
+            Err(FindFixedError::AlreadyAllocated)
+        ));
+        assert!(matches!(
+            allocator.find_fixed(0x3f000, 2 * PAGE, 1, 256),
+            Err(FindFixedError::TooLarge)
+        ));
+    }
+
+    #[test]
+    fn test_padding_sizes() {
+        // The largest objects possible would be 0x1000, 0x2000, 0x4000, 0x8000,
+        // 0x2000 and 0x1000, taking six retypes for four sizes
+        let retypes = |sizes: &[u64]| 1 + sizes.windows(2).filter(|w| w[0] != w[1]).count();
+        let sizes = padding_sizes(0x1000, 0x13000, 256);
+        assert_eq!(sizes, [0x1000; 18]);
+        assert_eq!(retypes(&sizes), 1);
+
+        // With too few cap slots for that, 0x2000 objects leave one 0x1000
+        // object at each end
+        let sizes = padding_sizes(0x1000, 0x13000, 10);
+        assert_eq!(sizes.len(), 10);
+        assert_eq!(retypes(&sizes), 3);
+
+        // And with fewer still, the largest objects possible
+        let sizes = padding_sizes(0x1000, 0x13000, 6);
+        assert_eq!(sizes, [0x1000, 0x2000, 0x4000, 0x8000, 0x2000, 0x1000]);
+        assert_eq!(retypes(&sizes), 6);
+    }
+
+    #[test]
+    fn test_alloc_best_fit() {
+        let untyped = [
+            UntypedObject::new(1, MemoryRegion::new(0x10000, 0x20000), false),
+            UntypedObject::new(2, MemoryRegion::new(0x20000, 0x24000), false),
+            UntypedObject::new(3, MemoryRegion::new(0x40000, 0x80000), false),
+        ];
+        let mut allocator = ObjectAllocator::new(untyped.iter().collect());
+
+        // The smallest untyped that fits is used
+        let alloc = allocator.alloc(0x1000).unwrap();
+        assert_eq!((alloc.untyped_cap_address, alloc.phys_addr), (2, 0x20000));
+        // Then the one that needs no padding over the one with least space
+        let alloc = allocator.alloc(0x4000).unwrap();
+        assert_eq!((alloc.untyped_cap_address, alloc.phys_addr), (1, 0x10000));
+        let alloc = allocator.alloc(0x2000).unwrap();
+        assert_eq!((alloc.untyped_cap_address, alloc.phys_addr), (1, 0x14000));
+        allocator.alloc(0x1000).unwrap();
+        allocator.alloc_n(0x2000, 2).unwrap();
+        let alloc = allocator.alloc_n(0x8000, 7).unwrap();
+        assert_eq!((alloc.untyped_cap_address, alloc.phys_addr), (3, 0x40000));
+        // Padding is only used when every untyped that fits needs it
+        let alloc = allocator.alloc(0x4000).unwrap();
+        assert_eq!((alloc.untyped_cap_address, alloc.phys_addr), (3, 0x78000));
+        let alloc = allocator.alloc(0x4000).unwrap();
+        assert_eq!((alloc.untyped_cap_address, alloc.phys_addr), (3, 0x7c000));
+        let alloc = allocator.alloc(0x4000).unwrap();
+        assert_eq!((alloc.untyped_cap_address, alloc.phys_addr), (1, 0x1c000));
+        assert!(allocator.alloc(0x4000).is_none());
+
+        let usage: Vec<(u64, u64)> = allocator
+            .untyped
+            .iter()
+            .map(|ut| (ut.used(), ut.wasted()))
+            .collect();
+        assert_eq!(usage, [(0xe000, 0x2000), (0x2000, 0), (0x40000, 0)]);
+        assert_eq!(allocator.max_alloc_size(), 0x2000);
+    }
+
+    /// Many regions and untyped, as in a system with thousands of device
+    /// regions, which would take quadratic time if each operation was linear.
+    #[test]
+    fn test_many_regions() {
+        const REGIONS: u64 = 10_000;
+        const PAGE: u64 = 0x1000;
+
+        let mut memory = DisjointMemoryRegion::default();
+        // Inserted out of order to not favour either end
+        for i in (0..REGIONS).rev().step_by(2).chain((0..REGIONS).step_by(2)) {
+            memory.insert_region(i * 4 * PAGE, i * 4 * PAGE + 2 * PAGE);
+        }
+        // Punch a hole in the middle of each region, splitting it in two
+        for i in 0..REGIONS {
+            memory.remove_region(i * 4 * PAGE + PAGE / 2, i * 4 * PAGE + PAGE);
+        }
+        assert_eq!(memory.regions().count() as u64, 2 * REGIONS);
+        // Only the second half of each region is big enough
+        for i in 0..REGIONS {
+            assert_eq!(memory.allocate(PAGE), i * 4 * PAGE + PAGE);
+        }
+        assert_eq!(memory.regions().count() as u64, REGIONS);
+
+        // Every region a different size, growing with the address, so that
+        // every region above the first fit is big enough as well
+        let mut memory = DisjointMemoryRegion::default();
+        for i in (0..REGIONS).rev().step_by(2).chain((0..REGIONS).step_by(2)) {
+            let base = i * (i + 1) / 2 * PAGE;
+            memory.insert_region(base, base + (i + 1) * PAGE);
+        }
+        for i in 0..REGIONS {
+            assert_eq!(memory.allocate((i + 1) * PAGE), i * (i + 1) / 2 * PAGE);
+        }
+        assert_eq!(memory.regions().count(), 0);
+
+        let untyped: Vec<UntypedObject> = (0..REGIONS)
+            .map(|i| {
+                let region = MemoryRegion::new(i * 4 * PAGE, i * 4 * PAGE + 4 * PAGE);
+                UntypedObject::new(i, region, true)
+            })
+            .collect();
+        let mut allocator = ObjectAllocator::new(untyped.iter().rev().collect());
+        for i in (0..REGIONS).rev() {
+            let Ok(Some((padding, alloc))) =
+                allocator.find_fixed(i * 4 * PAGE + PAGE, PAGE, 1, 256)
+            else {
+                panic!("fixed allocation failed");
+            };
+            assert_eq!(padding.unwrap().len(), 1);
+            assert_eq!(alloc.untyped_cap_address, i);
         }
+        assert_eq!(allocator.max_alloc_size(), 2 * PAGE);
+        // Each untyped has room for two pages at its end
+        for i in 0..2 * REGIONS {
+            let alloc = allocator.alloc(PAGE).unwrap();
+            assert_eq!(alloc.untyped_cap_address, i / 2);
+        }
+        assert_eq!(allocator.max_alloc_size(), 0);
+        assert!(allocator.alloc(PAGE).is_none());
 
-        Ok(None)
+        // Watermarks only page aligned, so every allocation needs padding
+        let untyped: Vec<UntypedObject> = (0..REGIONS)
+            .map(|i| {
+                let region = MemoryRegion::new(i * 8 * PAGE, i * 8 * PAGE + 8 * PAGE);
+                UntypedObject::new(i, region, false)
+            })
+            .collect();
+        let mut allocator = ObjectAllocator::new(untyped.iter().rev().collect());
+        for ut in &untyped {
+            allocator.reserve((ut, ut.base() + PAGE));
+        }
+        for i in 0..REGIONS {
+            let alloc = allocator.alloc(4 * PAGE).unwrap();
+            assert_eq!(alloc.untyped_cap_address, i);
+            assert_eq!(alloc.phys_addr, i * 8 * PAGE + 4 * PAGE);
+        }
+        assert!(allocator.alloc(4 * PAGE).is_none());
+        assert!(allocator.untyped.iter().all(|ut| ut.wasted() == 3 * PAGE));
     }
 }
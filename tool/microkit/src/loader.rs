@@ -10,6 +10,7 @@ use crate::util::{kb, mask, mb, round_up, struct_to_bytes};
 use crate::MemoryRegion;
 use std::fs::File;
 use std::io::{BufWriter, Write};
+use std::ops::Range;
 use std::path::Path;
 
 const PAGE_TABLE_SIZE: usize = 4096;
@@ -78,12 +79,54 @@ impl Riscv64 {
     }
 }
 
+const REGION_TYPE_DATA: u64 = 1;
+const REGION_TYPE_ZERO: u64 = 2;
+
+/// The data of each region is placed in the image at the same alignment, up
+/// to this, as the address it is loaded at.
+const REGION_DATA_ALIGN: u64 = 8;
+
+/// Runs of zeroes shorter than this are left in the data of the region they
+/// are part of, as splitting the region would cost more in region metadata
+/// and loader output than it saves.
+const ZERO_REGION_MIN_SIZE: usize = 4096;
+
+/// Splits the given region data into spans of data and spans of zeroes, the
+/// latter are not included in the image and instead cleared by the loader.
+/// Each span is returned with whether it is all zeroes.
+fn split_zero_spans(data: &[u8]) -> Vec<(Range<usize>, bool)> {
+    let mut spans = Vec::new();
+    let mut data_start = 0;
+    let mut i = 0;
+    while let Some(zero_offset) = data[i..].iter().position(|b| *b == 0) {
+        let zero_start = i + zero_offset;
+        let zero_end = data[zero_start..]
+            .iter()
+            .position(|b| *b != 0)
+            .map_or(data.len(), |len| zero_start + len);
+
+        if zero_end - zero_start >= ZERO_REGION_MIN_SIZE {
+            if zero_start > data_start {
+                spans.push((data_start..zero_start, false));
+            }
+            spans.push((zero_start..zero_end, true));
+            data_start = zero_end;
+        }
+        i = zero_end;
+    }
+    if data_start < data.len() {
+        spans.push((data_start..data.len(), false));
+    }
+
+    spans
+}
+
 /// Checks that each region in the given list does not overlap with any other region.
 /// Panics upon finding an overlapping region
-fn check_non_overlapping(regions: &Vec<(u64, &[u8])>) {
+fn check_non_overlapping(regions: &Vec<(u64, &[u8], u64)>) {
     let mut checked: Vec<(u64, u64)> = Vec::new();
-    for (base, data) in regions {
-        let end = base + data.len() as u64;
+    for (base, _, size) in regions {
+        let end = base + size;
         // Check that this does not overlap with any checked regions
         for (b, e) in &checked {
             if !(end <= *b || *base >= *e) {
@@ -122,6 +165,7 @@ pub struct Loader<'a> {
     image: Vec<u8>,
     header: LoaderHeader64,
     region_metadata: Vec<LoaderRegion64>,
+    /// The data of each data region and its offset from the start of the region data
     regions: Vec<(u64, &'a [u8])>,
 }
 
@@ -133,7 +177,7 @@ impl<'a> Loader<'a> {
         initial_task_elf: &'a ElfFile,
         initial_task_phys_base: Option<u64>,
         reserved_region: MemoryRegion,
-        system_regions: Vec<(u64, &'a [u8])>,
+        system_regions: Vec<(u64, &'a [u8], u64)>,
     ) -> Loader<'a> {
         // Note: If initial_task_phys_base is not None, then it just this address
         // as the base physical address of the initial task, rather than the address
@@ -180,7 +224,7 @@ impl<'a> Loader<'a> {
                     panic!("Kernel does not have a consistent physical to virtual offset");
                 }
 
-                regions.push((segment.phys_addr, segment.data.as_slice()));
+                regions.push((segment.phys_addr, segment.data(), segment.mem_size()));
             }
         }
 
@@ -208,8 +252,7 @@ impl<'a> Loader<'a> {
         };
         let inittask_p_v_offset = inittask_first_vaddr - inittask_first_paddr;
 
-        // Note: For now we include any zeroes. We could optimize in the future
-        regions.push((inittask_first_paddr, &segment.data));
+        regions.push((inittask_first_paddr, segment.data(), segment.mem_size()));
 
         // Determine the pagetable variables
         assert!(kernel_first_vaddr.is_some());
@@ -234,7 +277,8 @@ impl<'a> Loader<'a> {
             .find(|segment| segment.loadable)
             .expect("Did not find loadable segment");
         let image_vaddr = image_segment.virt_addr;
-        let mut image = image_segment.data;
+        let mut image = vec![0; image_segment.mem_size() as usize];
+        image[..image_segment.data().len()].copy_from_slice(image_segment.data());
 
         if image_vaddr != elf.entry {
             panic!("The loader entry point must be the first byte in the image");
@@ -269,7 +313,7 @@ impl<'a> Loader<'a> {
         }
 
         let mut all_regions_with_loader = all_regions.clone();
-        all_regions_with_loader.push((image_vaddr, &image));
+        all_regions_with_loader.push((image_vaddr, &image, image.len() as u64));
         check_non_overlapping(&all_regions_with_loader);
 
         let flags = match config.hypervisor {
@@ -277,22 +321,59 @@ impl<'a> Loader<'a> {
             false => 0,
         };
 
-        let mut region_metadata = Vec::new();
+        // Any large runs of zeroes become zero regions that take up no space
+        // in the image, as does the part of a region past its data, such as
+        // the part of an ELF segment that is not backed by the file.
+        let mut region_spans: Vec<(u64, u64, Option<&[u8]>)> = Vec::new();
+        for (addr, data, size) in &all_regions {
+            let mut spans = split_zero_spans(data);
+            let data_size = data.len() as u64;
+            if *size > data_size {
+                match spans.last_mut() {
+                    Some((span, true)) => span.end = *size as usize,
+                    _ => spans.push((data.len()..*size as usize, true)),
+                }
+            }
+            for (span, zero) in spans {
+                let load_addr = addr + span.start as u64;
+                let size = span.len() as u64;
+                region_spans.push((load_addr, size, (!zero).then(|| &data[span])));
+            }
+        }
+
+        // The region data directly follows the header and region metadata,
+        // which directly follow the loader image. The loader copies a word at
+        // a time only where the source and destination are equally aligned,
+        // so each region's data is padded to the alignment of its load address.
+        let metadata_size = std::mem::size_of::<LoaderHeader64>() as u64
+            + (region_spans.len() * std::mem::size_of::<LoaderRegion64>()) as u64;
+        let data_base = image_vaddr + image.len() as u64 + metadata_size;
+        let mut region_metadata = Vec::with_capacity(region_spans.len());
+        let mut region_data = Vec::new();
         let mut offset: u64 = 0;
-        for (addr, data) in &all_regions {
-            region_metadata.push(LoaderRegion64 {
-                load_addr: *addr,
-                size: data.len() as u64,
-                offset,
-                r#type: 1,
-            });
-            offset += data.len() as u64;
+        for (load_addr, size, data) in region_spans {
+            match data {
+                None => region_metadata.push(LoaderRegion64 {
+                    load_addr,
+                    size,
+                    offset,
+                    r#type: REGION_TYPE_ZERO,
+                }),
+                Some(data) => {
+                    offset += load_addr.wrapping_sub(data_base + offset) & (REGION_DATA_ALIGN - 1);
+                    region_metadata.push(LoaderRegion64 {
+                        load_addr,
+                        size,
+                        offset,
+                        r#type: REGION_TYPE_DATA,
+                    });
+                    region_data.push((offset, data));
+                    offset += size;
+                }
+            }
         }
 
-        let size = std::mem::size_of::<LoaderHeader64>() as u64
-            + region_metadata.iter().fold(0_u64, |acc, x| {
-                acc + x.size + std::mem::size_of::<LoaderRegion64>() as u64
-            });
+        let size = metadata_size + offset;
 
         let header = LoaderHeader64 {
             magic,
@@ -305,14 +386,14 @@ impl<'a> Loader<'a> {
             v_entry,
             extra_device_addr_p,
             extra_device_size,
-            num_regions: all_regions.len() as u64,
+            num_regions: region_metadata.len() as u64,
         };
 
         Loader {
             image,
             header,
             region_metadata,
-            regions: all_regions,
+            regions: region_data,
         }
     }
 
@@ -342,11 +423,18 @@ impl<'a> Loader<'a> {
                 .expect("Failed to write region metadata to loader");
         }
 
-        // Now we can write out all the region data
-        for (_, data) in &self.regions {
+        // Now we can write out all the region data, along with the padding
+        // that aligns each region
+        let mut written = 0;
+        for (offset, data) in &self.regions {
+            let padding = [0; REGION_DATA_ALIGN as usize];
+            loader_buf
+                .write_all(&padding[..(offset - written) as usize])
+                .expect("Failed to write region padding to loader");
             loader_buf
                 .write_all(data)
                 .expect("Failed to write region data to loader");
+            written = offset + data.len() as u64;
         }
 
         loader_buf.flush().unwrap();
@@ -500,3 +588,33 @@ impl<'a> Loader<'a> {
         ]
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_split_zero_spans() {
+        let mut data = vec![1; 16];
+        data.extend(vec![0; ZERO_REGION_MIN_SIZE]);
+        data.extend(vec![2; 16]);
+        data.extend(vec![0; ZERO_REGION_MIN_SIZE - 1]);
+        data.extend(vec![3; 16]);
+        data.extend(vec![0; ZERO_REGION_MIN_SIZE + 1]);
+
+        let end = data.len();
+        let short_zeroes_end = 16 + ZERO_REGION_MIN_SIZE + 16 + ZERO_REGION_MIN_SIZE - 1 + 16;
+        assert_eq!(
+            split_zero_spans(&data),
+            [
+                (0..16, false),
+                (16..16 + ZERO_REGION_MIN_SIZE, true),
+                (16 + ZERO_REGION_MIN_SIZE..short_zeroes_end, false),
+                (short_zeroes_end..end, true),
+            ]
+        );
+
+        assert_eq!(split_zero_spans(&[]), []);
+        assert_eq!(split_zero_spans(&[0; 16]), [(0..16, false)]);
+    }
+}
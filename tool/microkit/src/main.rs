@@ -7,11 +7,11 @@
 // we want our asserts, even if the compiler figures out they hold true already during compile-time
 #![allow(clippy::assertions_on_constants)]
 
-use elf::ElfFile;
+use elf::{ElfFile, ElfSegment};
 use loader::Loader;
 use microkit_tool::{
-    elf, loader, sdf, sel4, util, DisjointMemoryRegion, FindFixedError, MemoryRegion,
-    ObjectAllocator, Region, UntypedObject, MAX_PDS, MAX_VMS, PD_MAX_NAME_LENGTH,
+    elf, loader, sdf, sel4, trace, util, DisjointMemoryRegion, FindFixedError, MemoryRegion,
+    ObjectAllocator, Region, UntypedAllocator, UntypedObject, MAX_PDS, MAX_VMS, PD_MAX_NAME_LENGTH,
     VM_MAX_NAME_LENGTH,
 };
 use sdf::{
@@ -20,8 +20,8 @@ use sdf::{
 };
 use sel4::{
     default_vm_attr, Aarch64Regs, Arch, ArmVmAttributes, BootInfo, Config, Invocation,
-    InvocationArgs, Object, ObjectType, PageSize, PlatformConfig, Rights, Riscv64Regs,
-    RiscvVirtualMemory, RiscvVmAttributes,
+    InvocationArgs, InvocationEncoder, Object, ObjectType, PageSize, PlatformConfig, Rights,
+    Riscv64Regs, RiscvVirtualMemory, RiscvVmAttributes,
 };
 use std::cmp::{max, min};
 use std::collections::{HashMap, HashSet};
@@ -29,10 +29,11 @@ use std::fs;
 use std::io::{BufWriter, Write};
 use std::iter::zip;
 use std::mem::size_of;
+use std::ops::Range;
 use std::path::{Path, PathBuf};
 use util::{
     comma_sep_u64, comma_sep_usize, human_size_strict, json_str, json_str_as_bool, json_str_as_u64,
-    monitor_serialise_names, monitor_serialise_u64_vec, struct_to_bytes,
+    monitor_serialise_names, monitor_serialise_u64_vec, par_map_mut, struct_to_bytes,
 };
 
 // Corresponds to the IPC buffer symbol in libmicrokit and the monitor
@@ -49,6 +50,7 @@ const REPLY_CAP_IDX: u64 = 4;
 const MONITOR_EP_CAP_IDX: u64 = 5;
 const TCB_CAP_IDX: u64 = 6;
 const SMC_CAP_IDX: u64 = 7;
+const LOGGER_CAP_IDX: u64 = 8;
 
 const BASE_OUTPUT_NOTIFICATION_CAP: u64 = 10;
 const BASE_OUTPUT_ENDPOINT_CAP: u64 = BASE_OUTPUT_NOTIFICATION_CAP + 64;
@@ -56,6 +58,7 @@ const BASE_IRQ_CAP: u64 = BASE_OUTPUT_ENDPOINT_CAP + 64;
 const BASE_PD_TCB_CAP: u64 = BASE_IRQ_CAP + 64;
 const BASE_VM_TCB_CAP: u64 = BASE_PD_TCB_CAP + 64;
 const BASE_VCPU_CAP: u64 = BASE_VM_TCB_CAP + 64;
+const BASE_UTILISATION_TCB_CAP: u64 = BASE_VCPU_CAP + 64;
 
 const MAX_SYSTEM_INVOCATION_SIZE: u64 = util::mb(128);
 
@@ -162,103 +165,135 @@ impl<'a> InitSystem<'a> {
         }
     }
 
+    /// Allocate physically contiguous objects of the same type, one for each
+    /// name, starting at the given physical address. The objects are created
+    /// with as few retypes as possible, one for each untyped they span.
+    ///
     /// Note: Fixed objects must be allocated in order!
-    pub fn allocate_fixed_object(
+    pub fn allocate_fixed_objects(
         &mut self,
         phys_address: u64,
         object_type: ObjectType,
-        name: String,
-    ) -> Object {
+        names: Vec<String>,
+    ) -> Vec<Object> {
         assert!(phys_address >= self.last_fixed_address);
         assert!(object_type.fixed_size(self.config).is_some());
 
         let alloc_size = object_type.fixed_size(self.config).unwrap();
+        let count = names.len() as u64;
 
-        // Find an untyped that contains the given address, it could either be
-        // in device memory or normal memory.
-        let device_ut = self.device_untyped.find_fixed(phys_address, alloc_size).unwrap_or_else(|err| {
-            match err {
-                FindFixedError::AlreadyAllocated => eprintln!("ERROR: attempted to allocate object '{name}' at 0x{phys_address:x} from reserved region, pick another physical address"),
-                FindFixedError::TooLarge => eprintln!("ERROR: attempted too allocate too large of an object '{name}' for this physical address 0x{phys_address:x}"),
-            }
-            std::process::exit(1);
-        });
-        let normal_ut = self.normal_untyped.find_fixed(phys_address, alloc_size).unwrap_or_else(|err| {
-            match err {
-                FindFixedError::AlreadyAllocated => eprintln!("ERROR: attempted to allocate object '{name}' at 0x{phys_address:x} from reserved region, pick another physical address"),
-                FindFixedError::TooLarge => eprintln!("ERROR: attempted too allocate too large of an object '{name}' for this physical address 0x{phys_address:x}"),
-            }
-            std::process::exit(1);
-        });
+        let mut kernel_objects = Vec::with_capacity(names.len());
+        let mut names = names.into_iter();
+        let mut phys_addr = phys_address;
+        while (kernel_objects.len() as u64) < count {
+            let remaining = count - kernel_objects.len() as u64;
+            let name = &names.as_slice()[0];
+
+            // Find an untyped that contains the given address, it could either be
+            // in device memory or normal memory.
+            let device_ut = self.device_untyped.find_fixed(phys_addr, alloc_size, remaining, self.config.fan_out_limit).unwrap_or_else(|err| {
+                match err {
+                    FindFixedError::AlreadyAllocated => eprintln!("ERROR: attempted to allocate object '{name}' at 0x{phys_addr:x} from reserved region, pick another physical address"),
+                    FindFixedError::TooLarge => eprintln!("ERROR: attempted too allocate too large of an object '{name}' for this physical address 0x{phys_addr:x}"),
+                }
+                std::process::exit(1);
+            });
+            let normal_ut = self.normal_untyped.find_fixed(phys_addr, alloc_size, remaining, self.config.fan_out_limit).unwrap_or_else(|err| {
+                match err {
+                    FindFixedError::AlreadyAllocated => eprintln!("ERROR: attempted to allocate object '{name}' at 0x{phys_addr:x} from reserved region, pick another physical address"),
+                    FindFixedError::TooLarge => eprintln!("ERROR: attempted too allocate too large of an object '{name}' for this physical address 0x{phys_addr:x}"),
+                }
+                std::process::exit(1);
+            });
 
-        // We should never have found the physical address in both device and normal untyped
-        assert!(!(device_ut.is_some() && normal_ut.is_some()));
+            // We should never have found the physical address in both device and normal untyped
+            assert!(!(device_ut.is_some() && normal_ut.is_some()));
 
-        let (padding, ut) = if let Some(x) = device_ut {
-            x
-        } else if let Some(x) = normal_ut {
-            x
-        } else {
-            eprintln!(
-                "ERROR: physical address 0x{phys_address:x} not in any valid region, below are the valid ranges of memory to be allocated from:"
-            );
-            eprintln!("valid ranges outside of main memory:");
-            for ut in &self.device_untyped.untyped {
-                eprintln!("     [0x{:0>12x}..0x{:0>12x})", ut.base(), ut.end());
-            }
-            eprintln!("valid ranges within main memory:");
-            for ut in &self.normal_untyped.untyped {
-                eprintln!("     [0x{:0>12x}..0x{:0>12x})", ut.base(), ut.end());
+            let (padding, ut) = if let Some(x) = device_ut {
+                x
+            } else if let Some(x) = normal_ut {
+                x
+            } else {
+                eprintln!(
+                    "ERROR: physical address 0x{phys_addr:x} not in any valid region, below are the valid ranges of memory to be allocated from:"
+                );
+                eprintln!("valid ranges outside of main memory:");
+                for ut in &self.device_untyped.untyped {
+                    eprintln!("     [0x{:0>12x}..0x{:0>12x})", ut.base(), ut.end());
+                }
+                eprintln!("valid ranges within main memory:");
+                for ut in &self.normal_untyped.untyped {
+                    eprintln!("     [0x{:0>12x}..0x{:0>12x})", ut.base(), ut.end());
+                }
+                std::process::exit(1);
+            };
+
+            // Padding is chosen to give runs of objects of the same size,
+            // each of which takes one retype. The padding never has more
+            // objects than a single retype can create.
+            let padding = padding.unwrap_or_default();
+            let mut pad_idx = 0;
+            while pad_idx < padding.len() {
+                let pad_ut = padding[pad_idx];
+                let pad_count = padding[pad_idx..]
+                    .iter()
+                    .take_while(|p| p.size == pad_ut.size)
+                    .count();
+                self.retype(
+                    pad_ut.untyped_cap_address,
+                    ObjectType::Untyped,
+                    pad_ut.size.ilog2() as u64,
+                    pad_count as u64,
+                );
+                pad_idx += pad_count;
             }
-            std::process::exit(1);
-        };
 
-        if let Some(padding_unwrapped) = padding {
-            for pad_ut in padding_unwrapped {
-                self.invocations.push(Invocation::new(
-                    self.config,
-                    InvocationArgs::UntypedRetype {
-                        untyped: pad_ut.untyped_cap_address,
-                        object_type: ObjectType::Untyped,
-                        size_bits: pad_ut.size.ilog2() as u64,
-                        root: self.cnode_cap,
-                        node_index: 1,
-                        node_depth: 1,
-                        node_offset: self.cap_slot,
-                        num_objects: 1,
-                    },
-                ));
-                self.cap_slot += 1;
+            let object_count = ut.size / alloc_size;
+            let base_cap_slot = self.retype(ut.untyped_cap_address, object_type, 0, object_count);
+            for (idx, name) in names.by_ref().take(object_count as usize).enumerate() {
+                let cap_addr = self.cnode_mask | (base_cap_slot + idx as u64);
+                let kernel_object = Object {
+                    object_type,
+                    cap_addr,
+                    phys_addr: ut.phys_addr + idx as u64 * alloc_size,
+                };
+                kernel_objects.push(kernel_object);
+                self.objects.push(kernel_object);
+                self.cap_address_names.insert(cap_addr, name);
             }
+            phys_addr += ut.size;
         }
 
-        let object_cap = self.cap_slot;
-        self.cap_slot += 1;
-        self.invocations.push(Invocation::new(
-            self.config,
-            InvocationArgs::UntypedRetype {
-                untyped: ut.untyped_cap_address,
-                object_type,
-                size_bits: 0,
-                root: self.cnode_cap,
-                node_index: 1,
-                node_depth: 1,
-                node_offset: object_cap,
-                num_objects: 1,
-            },
-        ));
+        self.last_fixed_address = phys_addr;
 
-        self.last_fixed_address = phys_address + alloc_size;
-        let cap_addr = self.cnode_mask | object_cap;
-        let kernel_object = Object {
-            object_type,
-            cap_addr,
-            phys_addr: phys_address,
-        };
-        self.objects.push(kernel_object);
-        self.cap_address_names.insert(cap_addr, name);
+        kernel_objects
+    }
 
-        kernel_object
+    /// Retype 'count' objects from the given untyped into the next cap slots,
+    /// returning the first of them.
+    fn retype(&mut self, untyped: u64, object_type: ObjectType, size_bits: u64, count: u64) -> u64 {
+        let base_cap_slot = self.cap_slot;
+        let mut to_alloc = count;
+        while to_alloc > 0 {
+            let call_count = min(to_alloc, self.config.fan_out_limit);
+            self.invocations.push(Invocation::new(
+                self.config,
+                InvocationArgs::UntypedRetype {
+                    untyped,
+                    object_type,
+                    size_bits,
+                    root: self.cnode_cap,
+                    node_index: 1,
+                    node_depth: 1,
+                    node_offset: self.cap_slot,
+                    num_objects: call_count,
+                },
+            ));
+            to_alloc -= call_count;
+            self.cap_slot += call_count;
+        }
+
+        base_cap_slot
     }
 
     pub fn allocate_objects(
@@ -358,6 +393,8 @@ struct BuiltSystem {
     invocation_data_size: u64,
     bootstrap_invocations: Vec<Invocation>,
     system_invocations: Vec<Invocation>,
+    /// Range of unfolded invocations each system invocation covers
+    system_invocation_origins: Vec<Range<usize>>,
     kernel_boot_info: BootInfo,
     reserved_region: MemoryRegion,
     fault_ep_cap_address: u64,
@@ -371,48 +408,135 @@ struct BuiltSystem {
     pd_setvar_values: Vec<Vec<u64>>,
     pd_stack_addrs: Vec<u64>,
     kernel_objects: Vec<Object>,
+    untyped_usage: Vec<UntypedAllocator>,
     initial_task_virt_region: MemoryRegion,
     initial_task_phys_region: MemoryRegion,
 }
 
-pub fn pd_write_symbols(
+/// The symbols, other than its setvar symbols, that are patched in the ELF of
+/// the PD at the given index along with the data they are patched with.
+fn pd_symbols(
+    pds: &[ProtectionDomain],
+    channels: &[Channel],
+    pd_resets: &[PdReset],
+    i: usize,
+) -> Vec<(&'static str, Vec<u8>)> {
+    let pd = &pds[i];
+    let mut symbols = Vec::new();
+
+    let name = pd.name.as_bytes();
+    let name_length = min(name.len(), PD_MAX_NAME_LENGTH);
+    symbols.push(("microkit_name", name[..name_length].to_vec()));
+    symbols.push(("microkit_passive", vec![pd.passive as u8]));
+
+    let mut notification_bits: u64 = 0;
+    let mut pp_bits: u64 = 0;
+    for channel in channels {
+        if channel.end_a.pd == i {
+            if channel.end_a.notify {
+                notification_bits |= 1 << channel.end_a.id;
+            }
+            if channel.end_a.pp {
+                pp_bits |= 1 << channel.end_a.id;
+            }
+        }
+        if channel.end_b.pd == i {
+            if channel.end_b.notify {
+                notification_bits |= 1 << channel.end_b.id;
+            }
+            if channel.end_b.pp {
+                pp_bits |= 1 << channel.end_b.id;
+            }
+        }
+    }
+
+    symbols.push(("microkit_irqs", pd.irq_bits().to_le_bytes().to_vec()));
+    symbols.push((
+        "microkit_notifications",
+        notification_bits.to_le_bytes().to_vec(),
+    ));
+    symbols.push(("microkit_pps", pp_bits.to_le_bytes().to_vec()));
+
+    // Utilisation reporters are given the same table of PD names as the
+    // monitor, along with the core each PD runs on.
+    if pd.utilisation_reporter {
+        let pd_names = pds.iter().map(|pd| &pd.name).collect();
+        let pd_cpus: Vec<u64> = pds.iter().map(|pd| pd.cpu).collect();
+        symbols.push((
+            "pd_names",
+            monitor_serialise_names(pd_names, MAX_PDS, PD_MAX_NAME_LENGTH),
+        ));
+        symbols.push(("pd_names_len", pds.len().to_le_bytes().to_vec()));
+        symbols.push(("pd_cpus", monitor_serialise_u64_vec(&pd_cpus)));
+    }
+
+    // The rings to poll are given by channel, along with the address of
+    // each ring in the PD.
+    if pd.poll_us != 0 {
+        let mut poll_channels: u64 = 0;
+        let mut poll_rings = [0u64; sdf::MAX_CHANNELS];
+        for &(id, vaddr) in &pd.consumed_rings {
+            poll_channels |= 1 << id;
+            poll_rings[id as usize] = vaddr;
+        }
+        let poll_rings: Vec<u8> = poll_rings.iter().flat_map(|v| v.to_le_bytes()).collect();
+        symbols.push(("microkit_poll_us", pd.poll_us.to_le_bytes().to_vec()));
+        symbols.push((
+            "microkit_poll_channels",
+            poll_channels.to_le_bytes().to_vec(),
+        ));
+        symbols.push(("microkit_poll_rings", poll_rings));
+    }
+
+    // A parent is given what it needs to reset each of its children that
+    // can be, indexed by the child's identifier.
+    let mut reset_table = None;
+    for reset in pd_resets.iter().filter(|reset| reset.parent == i) {
+        let table = reset_table.get_or_insert_with(|| {
+            vec![0u64; PD_RESET_MAX_CHILDREN * (3 + 3 * PD_RESET_MAX_REGIONS)]
+        });
+        let child_id = pds[reset.child].id.unwrap() as usize;
+        let entry = &mut table[child_id * (3 + 3 * PD_RESET_MAX_REGIONS)..];
+        entry[0] = reset.entry_point;
+        entry[1] = reset.stack_top;
+        entry[2] = reset.regions.len() as u64;
+        for (region_idx, region) in reset.regions.iter().enumerate() {
+            let region_entry = &mut entry[3 + 3 * region_idx..];
+            region_entry[0] = region.vaddr;
+            region_entry[1] = region.pristine.as_ref().map_or(0, |p| p.vaddr);
+            region_entry[2] = region.size;
+        }
+    }
+    if let Some(table) = reset_table {
+        symbols.push(("microkit_pd_resets", monitor_serialise_u64_vec(&table)));
+    }
+
+    symbols
+}
+
+fn pd_write_symbols(
     pds: &[ProtectionDomain],
     channels: &[Channel],
     pd_elf_files: &mut [ElfFile],
     pd_setvar_values: &[Vec<u64>],
+    pd_resets: &[PdReset],
 ) -> Result<(), String> {
-    for (i, pd) in pds.iter().enumerate() {
-        let elf = &mut pd_elf_files[i];
-        let name = pd.name.as_bytes();
-        let name_length = min(name.len(), PD_MAX_NAME_LENGTH);
-        elf.write_symbol("microkit_name", &name[..name_length])?;
-        elf.write_symbol("microkit_passive", &[pd.passive as u8])?;
-
-        let mut notification_bits: u64 = 0;
-        let mut pp_bits: u64 = 0;
-        for channel in channels {
-            if channel.end_a.pd == i {
-                if channel.end_a.notify {
-                    notification_bits |= 1 << channel.end_a.id;
-                }
-                if channel.end_a.pp {
-                    pp_bits |= 1 << channel.end_a.id;
-                }
-            }
-            if channel.end_b.pd == i {
-                if channel.end_b.notify {
-                    notification_bits |= 1 << channel.end_b.id;
-                }
-                if channel.end_b.pp {
-                    pp_bits |= 1 << channel.end_b.id;
-                }
+    // Each PD's symbols are independent of every other PD's, so the PDs are
+    // patched in parallel. Any error returned is that of the first PD.
+    let results = par_map_mut(pd_elf_files, |i, elf| {
+        let pd = &pds[i];
+        for (symbol, data) in pd_symbols(pds, channels, pd_resets, i) {
+            let result = elf.write_symbol(symbol, &data);
+            if result.is_err() && symbol == "microkit_pd_resets" {
+                return Err(format!(
+                    "No symbol named 'microkit_pd_resets' in ELF '{}' for PD '{}', which must call microkit_pd_reset to reset its children",
+                    pd.program_image.display(),
+                    pd.name
+                ));
             }
+            result?;
         }
 
-        elf.write_symbol("microkit_irqs", &pd.irq_bits().to_le_bytes())?;
-        elf.write_symbol("microkit_notifications", &notification_bits.to_le_bytes())?;
-        elf.write_symbol("microkit_pps", &pp_bits.to_le_bytes())?;
-
         for (setvar_idx, setvar) in pd.setvars.iter().enumerate() {
             let value = pd_setvar_values[i][setvar_idx];
             let result = elf.write_symbol(&setvar.symbol, &value.to_le_bytes());
@@ -425,9 +549,11 @@ pub fn pd_write_symbols(
                 ));
             }
         }
-    }
 
-    Ok(())
+        Ok(())
+    });
+
+    results.into_iter().collect()
 }
 
 /// Determine the physical memory regions for an ELF file with a given
@@ -444,12 +570,212 @@ fn phys_mem_regions_from_elf(elf: &ElfFile, alignment: u64) -> Vec<MemoryRegion>
         .map(|s| {
             MemoryRegion::new(
                 util::round_down(s.phys_addr, alignment),
-                util::round_up(s.phys_addr + s.data.len() as u64, alignment),
+                util::round_up(s.phys_addr + s.mem_size(), alignment),
             )
         })
         .collect()
 }
 
+/// Determine the permissions to map an ELF segment with.
+fn elf_segment_perms(segment: &ElfSegment) -> u8 {
+    let mut perms = 0;
+    if segment.is_readable() {
+        perms |= SysMapPerms::Read as u8;
+    }
+    if segment.is_writable() {
+        perms |= SysMapPerms::Write as u8;
+    }
+    if segment.is_executable() {
+        perms |= SysMapPerms::Execute as u8;
+    }
+
+    perms
+}
+
+/// Determine which segments of the PD ELFs can share frames.
+///
+/// A read-only segment that is identical to one of an earlier PD, for
+/// example because both PDs use the same program image, is backed by the
+/// same frames rather than getting a copy of its own. Segments containing
+/// a symbol that is patched per PD, as given by `pd_symbols` or a setvar,
+/// are never shared.
+///
+/// Returns, for each segment of each PD ELF, the PD and segment index of
+/// the segment it shares frames with, if any.
+fn pd_elf_shared_segments(
+    system: &SystemDescription,
+    pd_elf_files: &[ElfFile],
+    pd_resets: &[PdReset],
+) -> Vec<Vec<Option<(usize, usize)>>> {
+    // Keyed by the virtual address, permissions, size and data of the segment
+    let mut first_segments = HashMap::new();
+    let mut shared_segments = Vec::with_capacity(pd_elf_files.len());
+    for (pd_idx, (pd, pd_elf)) in zip(&system.protection_domains, pd_elf_files).enumerate() {
+        let symbols = pd_symbols(
+            &system.protection_domains,
+            &system.channels,
+            pd_resets,
+            pd_idx,
+        );
+        let patched_symbols: Vec<(u64, u64)> = symbols
+            .iter()
+            .map(|(symbol, _)| *symbol)
+            .chain(pd.setvars.iter().map(|setvar| setvar.symbol.as_str()))
+            .filter_map(|symbol| pd_elf.find_symbol(symbol).ok())
+            .collect();
+
+        let mut pd_shared_segments = Vec::with_capacity(pd_elf.segments.len());
+        for (seg_idx, segment) in pd_elf.segments.iter().enumerate() {
+            let segment_end = segment.virt_addr + segment.mem_size();
+            let patched = patched_symbols
+                .iter()
+                .any(|(vaddr, size)| *vaddr < segment_end && segment.virt_addr < vaddr + size);
+            if !segment.loadable || segment.is_writable() || patched {
+                pd_shared_segments.push(None);
+                continue;
+            }
+
+            let key = (
+                segment.virt_addr,
+                elf_segment_perms(segment),
+                segment.mem_size(),
+                segment.data(),
+            );
+            match first_segments.get(&key) {
+                Some(first) => pd_shared_segments.push(Some(*first)),
+                None => {
+                    first_segments.insert(key, (pd_idx, seg_idx));
+                    pd_shared_segments.push(None);
+                }
+            }
+        }
+        shared_segments.push(pd_shared_segments);
+    }
+
+    shared_segments
+}
+
+/// Most regions a parent restores when resetting a child, and the number of
+/// children the table of them has room for, see `microkit_pd_reset`.
+const PD_RESET_MAX_REGIONS: usize = 4;
+const PD_RESET_MAX_CHILDREN: usize = 64;
+
+/// A pristine copy of an ELF segment of a PD, mapped into its parent.
+struct PdResetPristine {
+    seg_idx: usize,
+    mr: String,
+    vaddr: u64,
+}
+
+/// A region of a PD that its parent restores when resetting it.
+struct PdResetRegion {
+    /// The MR holding the region, mapped into the parent at 'vaddr'
+    mr: String,
+    vaddr: u64,
+    size: u64,
+    /// Regions without a pristine copy, such as the stack, are zeroed
+    pristine: Option<PdResetPristine>,
+}
+
+/// Everything the parent of a PD with the reset attribute needs to reset it.
+struct PdReset {
+    parent: usize,
+    child: usize,
+    entry_point: u64,
+    stack_top: u64,
+    regions: Vec<PdResetRegion>,
+}
+
+/// Determine the regions of each PD with the reset attribute, and where in
+/// its parent they and their pristine copies are mapped.
+///
+/// A region is restored by copying the whole pristine copy over it, so the
+/// copy covers every page of the segment, including any zeroed data.
+fn pd_resets(
+    config: &Config,
+    system: &SystemDescription,
+    pd_elf_files: &[ElfFile],
+) -> Result<Vec<PdReset>, String> {
+    let page_size = config.minimum_page_size;
+    let mut parent_ranges: HashMap<usize, Vec<(u64, u64)>> = HashMap::new();
+    let mut resets = Vec::new();
+    for (child_idx, (pd, pd_elf)) in zip(&system.protection_domains, pd_elf_files).enumerate() {
+        if !pd.reset {
+            continue;
+        }
+
+        let parent_idx = pd.parent.unwrap();
+        let parent = &system.protection_domains[parent_idx];
+        let ranges = parent_ranges.entry(parent_idx).or_insert_with(|| {
+            let maps = parent.maps.iter().map(|map| {
+                let mr = system
+                    .memory_regions
+                    .iter()
+                    .find(|mr| mr.name == map.mr)
+                    .unwrap();
+                (map.vaddr, map.vaddr + mr.size)
+            });
+            let segments = virt_mem_regions_from_elf(&pd_elf_files[parent_idx], page_size)
+                .into_iter()
+                .map(|r| (r.base, r.end));
+            maps.chain(segments).collect()
+        });
+        let map_max_vaddr = config.pd_map_max_vaddr(parent.stack_size);
+        let mut allocate_vaddr = |size: u64| {
+            let vaddr = sdf::free_vaddr_below(map_max_vaddr, ranges.clone(), size).ok_or(format!(
+                "Error: no free virtual address range of 0x{:x} bytes in protection domain '{}' to reset its child '{}'",
+                size, parent.name, pd.name
+            ))?;
+            ranges.push((vaddr, vaddr + size));
+            Ok::<u64, String>(vaddr)
+        };
+
+        let mut regions = Vec::new();
+        for (seg_idx, segment) in pd_elf.segments.iter().enumerate() {
+            if !segment.loadable || !segment.is_writable() {
+                continue;
+            }
+            let base_vaddr = util::round_down(segment.virt_addr, page_size);
+            let end_vaddr = util::round_up(segment.virt_addr + segment.mem_size(), page_size);
+            let size = end_vaddr - base_vaddr;
+            regions.push(PdResetRegion {
+                mr: format!("ELF:{}-{}", pd.name, seg_idx),
+                vaddr: allocate_vaddr(size)?,
+                size,
+                pristine: Some(PdResetPristine {
+                    seg_idx,
+                    mr: format!("RESET:{}-{}", pd.name, seg_idx),
+                    vaddr: allocate_vaddr(size)?,
+                }),
+            });
+        }
+        regions.push(PdResetRegion {
+            mr: format!("STACK:{}", pd.name),
+            vaddr: allocate_vaddr(pd.stack_size)?,
+            size: pd.stack_size,
+            pristine: None,
+        });
+
+        if regions.len() > PD_RESET_MAX_REGIONS {
+            return Err(format!(
+                "Error: protection domain '{}' has too many writable segments to be reset, the maximum is {}",
+                pd.name,
+                PD_RESET_MAX_REGIONS - 1
+            ));
+        }
+
+        resets.push(PdReset {
+            parent: parent_idx,
+            child: child_idx,
+            entry_point: pd_elf.entry,
+            stack_top: config.pd_stack_top(),
+            regions,
+        });
+    }
+
+    Ok(resets)
+}
+
 /// Determine a single physical memory region for an ELF.
 ///
 /// Works as per phys_mem_regions_from_elf, but checks the ELF has a single
@@ -473,7 +799,7 @@ fn virt_mem_regions_from_elf(elf: &ElfFile, alignment: u64) -> Vec<MemoryRegion>
         .map(|s| {
             MemoryRegion::new(
                 util::round_down(s.virt_addr, alignment),
-                util::round_up(s.virt_addr + s.data.len() as u64, alignment),
+                util::round_up(s.virt_addr + s.mem_size(), alignment),
             )
         })
         .collect()
@@ -668,7 +994,7 @@ fn emulate_kernel_boot(
     // (or at least we hope it does!)
     // TODO: this loop could be done better in a functional way?
     let mut region_to_remove: Option<u64> = None;
-    for region in normal_memory.regions.iter().rev() {
+    for region in normal_memory.regions().rev() {
         let start = util::round_down(
             region.end - initial_objects_size,
             1 << initial_objects_align,
@@ -685,7 +1011,8 @@ fn emulate_kernel_boot(
     }
 
     let fixed_cap_count = 0x10;
-    let sched_control_cap_count = 1;
+    // The kernel creates one SchedControl cap for each core
+    let sched_control_cap_count = config.num_cores;
     let paging_cap_count = get_arch_n_paging(config, initial_task_virt_region);
     let page_cap_count = initial_task_virt_region.size() / config.minimum_page_size;
     let first_untyped_cap =
@@ -729,12 +1056,242 @@ fn emulate_kernel_boot(
     }
 }
 
+/// Bound the size of the system CNode (in slots) and of the system invocation
+/// table from the system description alone.
+///
+/// Both sizes feed into the physical memory layout, and therefore into the
+/// objects and invocations that `build_system` generates, so they have to be
+/// chosen before the system is built. The bounds count every cap the build can
+/// allocate and the worst case encoding of every invocation it can emit, and
+/// must be kept in step with `build_system` as it changes. Only the encoded
+/// invocations are written to the image, so the slack in the invocation table
+/// costs reserved memory but not image size.
+fn system_size_bounds(
+    config: &Config,
+    pd_elf_files: &[ElfFile],
+    system: &SystemDescription,
+    pd_resets: &[PdReset],
+) -> (u64, u64) {
+    let mr_by_name: HashMap<&str, &SysMemoryRegion> = system
+        .memory_regions
+        .iter()
+        .map(|mr| (mr.name.as_str(), mr))
+        .collect();
+    let virtual_machines: Vec<&VirtualMachine> = system
+        .protection_domains
+        .iter()
+        .filter_map(|pd| pd.virtual_machine.as_ref())
+        .collect();
+
+    let num_pds = system.protection_domains.len() as u64;
+    let num_vms = virtual_machines.len() as u64;
+    let num_log_buffers = system
+        .logger
+        .as_ref()
+        .map_or(0, |logger| logger.num_buffers);
+    let num_utilisation_reporters = system
+        .protection_domains
+        .iter()
+        .filter(|pd| pd.utilisation_reporter)
+        .count() as u64;
+    let num_vcpus: u64 = virtual_machines
+        .iter()
+        .map(|vm| vm.vcpus.len() as u64)
+        .sum();
+    let num_irqs: u64 = system
+        .protection_domains
+        .iter()
+        .map(|pd| pd.irqs.len() as u64)
+        .sum();
+    let num_channels = system.channels.len() as u64;
+
+    // Number of paging structures needed to map the given range. Ranges
+    // from different mappings sharing a structure are counted twice.
+    let paging_structures = |vaddr: u64, size: u64, page_size: PageSize| {
+        let spans = |bits: u64| {
+            (util::mask_bits(vaddr + size - 1, bits) - util::mask_bits(vaddr, bits)) / (1 << bits)
+                + 1
+        };
+        let mut count = spans(12 + 9 + 9);
+        if page_size == PageSize::Small {
+            count += spans(12 + 9);
+        }
+        if let Arch::Aarch64 = config.arch {
+            if !config.aarch64_vspace_s2_start_l1() {
+                count += spans(12 + 9 + 9 + 9);
+            }
+        }
+        count
+    };
+
+    // Pages created at a fixed physical address, any padding needed to reach
+    // them, pages created anywhere, and the copies of pages that are minted
+    // for each mapping.
+    let mut fixed_pages = 0;
+    let mut fixed_runs = 0;
+    let mut pages = 0;
+    let mut maps = 0;
+    let mut mapped_pages = 0;
+    let mut page_tables = 0;
+    for mr in &system.memory_regions {
+        if mr.phys_addr.is_some() {
+            fixed_pages += mr.page_count;
+            fixed_runs += 1;
+        } else {
+            pages += mr.page_count;
+        }
+    }
+    for (pd, pd_elf) in zip(&system.protection_domains, pd_elf_files) {
+        // The IPC buffer
+        pages += 1;
+        page_tables += paging_structures(0, config.minimum_page_size, PageSize::Small);
+
+        // The ELF segments, which all reside contiguously in the reserved region
+        for segment in pd_elf.segments.iter().filter(|s| s.loadable) {
+            let base_vaddr = util::round_down(segment.virt_addr, config.minimum_page_size);
+            let end_vaddr = util::round_up(
+                segment.virt_addr + segment.mem_size(),
+                config.minimum_page_size,
+            );
+            let segment_pages = (end_vaddr - base_vaddr) / config.minimum_page_size;
+            fixed_pages += segment_pages;
+            maps += 1;
+            mapped_pages += segment_pages;
+            page_tables += paging_structures(base_vaddr, end_vaddr - base_vaddr, PageSize::Small);
+        }
+
+        // The stack
+        let stack_pages = pd.stack_size / config.minimum_page_size;
+        pages += stack_pages;
+        maps += 1;
+        mapped_pages += stack_pages;
+        page_tables += paging_structures(
+            config.pd_stack_bottom(pd.stack_size),
+            pd.stack_size,
+            PageSize::Small,
+        );
+
+        for map in &pd.maps {
+            let mr = mr_by_name[map.mr.as_str()];
+            maps += 1;
+            mapped_pages += mr.page_count;
+            page_tables += paging_structures(map.vaddr, mr.size, mr.page_size);
+        }
+    }
+    // Children that can be reset have their writable segments and stack
+    // mapped into their parent, along with pristine copies of the segments
+    // that reside in the reserved region like the segments themselves.
+    for reset in pd_resets {
+        for region in &reset.regions {
+            let region_pages = region.size / config.minimum_page_size;
+            maps += 1;
+            mapped_pages += region_pages;
+            page_tables += paging_structures(region.vaddr, region.size, PageSize::Small);
+            if let Some(pristine) = &region.pristine {
+                fixed_pages += region_pages;
+                maps += 1;
+                mapped_pages += region_pages;
+                page_tables += paging_structures(pristine.vaddr, region.size, PageSize::Small);
+            }
+        }
+    }
+    fixed_runs += 1;
+    for vm in &virtual_machines {
+        for map in &vm.maps {
+            let mr = mr_by_name[map.mr.as_str()];
+            maps += 1;
+            mapped_pages += mr.page_count;
+            page_tables += paging_structures(map.vaddr, mr.size, mr.page_size);
+        }
+    }
+
+    // Padding a watermark up to a fixed address takes at most one untyped per
+    // bit while aligning the watermark and one per bit of the remaining gap,
+    // or at most a fan out's worth when that needs fewer retypes.
+    let padding = fixed_runs * max(2 * config.word_size, config.fan_out_limit);
+
+    let objects = pages
+        + (num_pds + num_vcpus) // TCBs
+        + num_vcpus // VCPUs
+        + (num_pds + num_vcpus) // Scheduling contexts
+        + (1 + num_pds) // Reply objects
+        + (1 + num_pds) // Endpoints
+        + num_pds // Notifications
+        + (num_pds + num_vms) // VSpaces
+        + page_tables
+        + (num_pds + num_vms); // CNodes
+
+    // Each group of invocations is given as the number of invocations and
+    // the number of raw words in each.
+    let mut invocation_data_size = 0;
+    let mut invocations = |count: u64, words: u64| {
+        invocation_data_size += count * InvocationEncoder::max_encoded_size(words);
+    };
+    let num_regs = match config.arch {
+        Arch::Aarch64 => Aarch64Regs::default().field_names().len(),
+        Arch::Riscv64 => Riscv64Regs::default().field_names().len(),
+    } as u64;
+    // Object creation, there are up to 16 groups of non-fixed objects
+    invocations(objects.div_ceil(config.fan_out_limit) + 16, 8);
+    invocations(fixed_pages + padding, 8);
+    // IRQ handlers: get, mint a badged notification, mint into the PD, set notification
+    invocations(num_irqs, 6);
+    invocations(num_irqs * 2, 8);
+    invocations(num_irqs, 2);
+    // ASID pool assignment
+    invocations(1, 2 * 2);
+    // Page copies and mappings
+    invocations(maps, 2 * 8);
+    invocations(maps, 2 * 5);
+    invocations(page_tables, 4);
+    invocations(num_pds, 5);
+    // Fault endpoint, input, reply and VSpace caps
+    invocations(num_pds + num_vcpus, 8);
+    invocations(num_pds, 8);
+    invocations(2, 2 * 8);
+    // Child PD TCBs, passive PDs, SMC, VM TCBs and vCPUs, channels and the logger
+    invocations(
+        3 * num_pds + 2 * num_vcpus + 4 * num_channels + num_log_buffers,
+        8,
+    );
+    // Scheduling
+    invocations(num_pds + num_vcpus, 7);
+    invocations(num_pds + num_vcpus, 6);
+    // TCB copies (benchmark configuration only), spaces, IPC buffers and registers
+    invocations(1 + num_utilisation_reporters, 2 * 7);
+    invocations(1 + num_vms, 2 * 6);
+    invocations(num_pds, 3);
+    invocations(num_pds, 3 + num_regs);
+    // Binding notifications and vCPUs, and resuming
+    invocations(2, 2 * 2);
+    invocations(1, 2);
+
+    let invocation_table_size = util::round_up(invocation_data_size, config.minimum_page_size);
+
+    // The invocation table pages and the page tables used to map them into
+    // the monitor come first in the system CNode.
+    let large_page_size = ObjectType::LargePage.fixed_size(config).unwrap();
+    let system_caps = invocation_table_size / config.minimum_page_size
+        + util::round_up(invocation_table_size, large_page_size) / large_page_size
+        + fixed_pages
+        + padding
+        + objects
+        + num_irqs * 2
+        + mapped_pages
+        + (num_pds + num_vcpus);
+    let system_cnode_size = max(system_caps, 2).next_power_of_two();
+
+    (system_cnode_size, invocation_table_size)
+}
+
+#[allow(clippy::too_many_arguments)]
 fn build_system(
     config: &Config,
     pd_elf_files: &Vec<ElfFile>,
     kernel_elf: &ElfFile,
     monitor_elf: &ElfFile,
     system: &SystemDescription,
+    pd_resets: &[PdReset],
     invocation_table_size: u64,
     system_cnode_size: u64,
 ) -> Result<BuiltSystem, String> {
@@ -764,10 +1321,28 @@ fn build_system(
     // and allows the monitor (initial task) to create memory regions
     // from this area, which can then be made available to the appropriate
     // protection domains
+    //
+    // Segments that are shared with an identical segment of another PD's ELF
+    // do not take up any space of their own.
+    let pd_elf_shared_segments = pd_elf_shared_segments(system, pd_elf_files, pd_resets);
     let mut pd_elf_size = 0;
-    for pd_elf in pd_elf_files {
-        for r in phys_mem_regions_from_elf(pd_elf, config.minimum_page_size) {
-            pd_elf_size += r.size();
+    for (pd_elf, shared_segments) in zip(pd_elf_files, &pd_elf_shared_segments) {
+        let loadable_segments = pd_elf
+            .segments
+            .iter()
+            .enumerate()
+            .filter(|(_, s)| s.loadable);
+        let regions = phys_mem_regions_from_elf(pd_elf, config.minimum_page_size);
+        for ((seg_idx, _), r) in zip(loadable_segments, regions) {
+            if shared_segments[seg_idx].is_none() {
+                pd_elf_size += r.size();
+            }
+        }
+    }
+    // As are the pristine copies of the segments of PDs that can be reset
+    for reset in pd_resets {
+        for region in reset.regions.iter().filter(|r| r.pristine.is_some()) {
+            pd_elf_size += region.size;
         }
     }
     let reserved_size = invocation_table_size + pd_elf_size;
@@ -856,7 +1431,7 @@ fn build_system(
     // object create during kernel bootstrap, and b/ the system CNode, which
     // contains caps to all objects that will be created in this process.
     // The system CNode is of `system_cnode_size`. (Note: see also description
-    // on how `system_cnode_size` is iteratively determined).
+    // on how `system_cnode_size` is determined in `main`).
     //
     // The system CNode is not available at startup and must be created (by retyping
     // memory from an untyped object). Once created the two CNodes must be arranged
@@ -1178,26 +1753,33 @@ fn build_system(
                 continue;
             }
 
+            let base_vaddr = util::round_down(segment.virt_addr, config.minimum_page_size);
+
+            // A segment identical to one of an earlier PD is mapped from the
+            // frames of that PD's segment rather than getting its own.
+            if let Some((owner_pd_idx, owner_seg_idx)) = pd_elf_shared_segments[i][seg_idx] {
+                let mp = SysMap {
+                    mr: format!(
+                        "ELF:{}-{}",
+                        system.protection_domains[owner_pd_idx].name, owner_seg_idx
+                    ),
+                    vaddr: base_vaddr,
+                    perms: elf_segment_perms(segment),
+                    cached: true,
+                    text_pos: None,
+                };
+                pd_extra_maps.entry(pd).or_default().push(mp);
+                continue;
+            }
+
             let segment_phys_addr = phys_addr_next + (segment.virt_addr % config.minimum_page_size);
             pd_elf_regions[i].push(Region::new(
                 format!("PD-ELF {}-{}", pd.name, seg_idx),
                 segment_phys_addr,
-                segment.data.len() as u64,
+                segment.mem_size(),
                 seg_idx,
             ));
 
-            let mut perms = 0;
-            if segment.is_readable() {
-                perms |= SysMapPerms::Read as u8;
-            }
-            if segment.is_writable() {
-                perms |= SysMapPerms::Write as u8;
-            }
-            if segment.is_executable() {
-                perms |= SysMapPerms::Execute as u8;
-            }
-
-            let base_vaddr = util::round_down(segment.virt_addr, config.minimum_page_size);
             let end_vaddr = util::round_up(
                 segment.virt_addr + segment.mem_size(),
                 config.minimum_page_size,
@@ -1218,15 +1800,11 @@ fn build_system(
             let mp = SysMap {
                 mr: mr.name.clone(),
                 vaddr: base_vaddr,
-                perms,
+                perms: elf_segment_perms(segment),
                 cached: true,
                 text_pos: None,
             };
-            if let Some(extra_maps) = pd_extra_maps.get_mut(pd) {
-                extra_maps.push(mp);
-            } else {
-                pd_extra_maps.insert(pd, vec![mp]);
-            }
+            pd_extra_maps.entry(pd).or_default().push(mp);
 
             // Add to extra_mrs at the end to avoid movement issues with the MR since it's used in
             // constructing the SysMap struct
@@ -1234,6 +1812,34 @@ fn build_system(
         }
     }
 
+    // The pristine copies of the writable segments of PDs that can be reset
+    // are loaded from the same data as the segments.
+    for reset in pd_resets {
+        let child = &system.protection_domains[reset.child];
+        for region in &reset.regions {
+            let Some(pristine) = &region.pristine else {
+                continue;
+            };
+            let segment = &pd_elf_files[reset.child].segments[pristine.seg_idx];
+            pd_elf_regions[reset.child].push(Region::new(
+                format!("PD-RESET {}-{}", child.name, pristine.seg_idx),
+                phys_addr_next + (segment.virt_addr % config.minimum_page_size),
+                segment.mem_size(),
+                pristine.seg_idx,
+            ));
+            extra_mrs.push(SysMemoryRegion {
+                name: pristine.mr.clone(),
+                size: region.size,
+                page_size: PageSize::Small,
+                page_count: region.size / PageSize::Small as u64,
+                phys_addr: Some(phys_addr_next),
+                text_pos: None,
+                kind: SysMemoryRegionKind::Elf,
+            });
+            phys_addr_next += region.size;
+        }
+    }
+
     assert!(phys_addr_next - (reserved_base + invocation_table_size) == pd_elf_size);
 
     // Here we create a memory region/mapping for the stack for each PD.
@@ -1265,6 +1871,31 @@ fn build_system(
         pd_extra_maps.get_mut(pd).unwrap().push(stack_map);
     }
 
+    // The parent of a PD that can be reset maps the regions it restores, and
+    // their pristine copies read-only.
+    for reset in pd_resets {
+        let parent = &system.protection_domains[reset.parent];
+        let parent_maps = pd_extra_maps.get_mut(parent).unwrap();
+        for region in &reset.regions {
+            parent_maps.push(SysMap {
+                mr: region.mr.clone(),
+                vaddr: region.vaddr,
+                perms: SysMapPerms::Read as u8 | SysMapPerms::Write as u8,
+                cached: true,
+                text_pos: None,
+            });
+            if let Some(pristine) = &region.pristine {
+                parent_maps.push(SysMap {
+                    mr: pristine.mr.clone(),
+                    vaddr: pristine.vaddr,
+                    perms: SysMapPerms::Read as u8,
+                    cached: true,
+                    text_pos: None,
+                });
+            }
+        }
+    }
+
     let mut all_mrs: Vec<&SysMemoryRegion> =
         Vec::with_capacity(system.memory_regions.len() + extra_mrs.len());
     for mr_set in [&system.memory_regions, &extra_mrs] {
@@ -1307,21 +1938,43 @@ fn build_system(
     // Sort based on the starting physical address
     fixed_pages.sort_by_key(|p| p.0);
 
-    // FIXME: At this point we can recombine them into
-    // groups to optimize allocation
-    for (phys_addr, mr) in fixed_pages {
+    // Pages that are physically contiguous and of the same size are allocated
+    // together, even if they are from different MRs, so that they can be
+    // created with a single retype.
+    let mut run_start = 0;
+    while run_start < fixed_pages.len() {
+        let mut run_end = run_start + 1;
+        while run_end < fixed_pages.len() {
+            let (prev_addr, prev_mr) = fixed_pages[run_end - 1];
+            let (addr, mr) = fixed_pages[run_end];
+            if mr.page_size != prev_mr.page_size || addr != prev_addr + prev_mr.page_size_bytes() {
+                break;
+            }
+            run_end += 1;
+        }
+        let run = &fixed_pages[run_start..run_end];
+        run_start = run_end;
+
+        let (phys_addr, mr) = run[0];
         let obj_type = match mr.page_size {
             PageSize::Small => ObjectType::SmallPage,
             PageSize::Large => ObjectType::LargePage,
         };
 
         let (page_size_human, page_size_label) = util::human_size_strict(mr.page_size as u64);
-        let name = format!(
-            "Page({} {}): MR={} @ {:x}",
-            page_size_human, page_size_label, mr.name, phys_addr
-        );
-        let page = init_system.allocate_fixed_object(phys_addr, obj_type, name);
-        mr_pages.get_mut(mr).unwrap().push(page);
+        let names = run
+            .iter()
+            .map(|(phys_addr, mr)| {
+                format!(
+                    "Page({} {}): MR={} @ {:x}",
+                    page_size_human, page_size_label, mr.name, phys_addr
+                )
+            })
+            .collect();
+        let pages = init_system.allocate_fixed_objects(phys_addr, obj_type, names);
+        for (&(_, mr), page) in zip(run, pages) {
+            mr_pages.get_mut(mr).unwrap().push(page);
+        }
     }
 
     // 3.2 Work out how many regular (non-fixed) page objects are required
@@ -1755,11 +2408,14 @@ fn build_system(
     );
     system_invocations.push(asid_invocation);
 
-    // Check that the user has not created any maps that clash with our extra maps
+    // Check that the user has not created any maps that clash with our extra maps,
+    // and that the extra maps do not clash with each other. The maps a parent is
+    // given to reset its children are placed clear of the parent's other maps,
+    // but are checked here like any other.
     for pd in &system.protection_domains {
         let curr_pd_extra_maps = &pd_extra_maps[pd];
-        for pd_map in &pd.maps {
-            for extra_map in curr_pd_extra_maps {
+        for (i, extra_map) in curr_pd_extra_maps.iter().enumerate() {
+            for pd_map in pd.maps.iter().chain(&curr_pd_extra_maps[..i]) {
                 let mr = all_mr_by_name[pd_map.mr.as_str()];
                 let base = pd_map.vaddr;
                 let end = base + mr.size;
@@ -2358,10 +3014,35 @@ fn build_system(
         }
     }
 
+    // Give every PD with a log buffer a badged copy of the logger's notification
+    if let Some(logger) = &system.logger {
+        let logger_notification_obj = &notification_objs[logger.pd];
+        for (pd_idx, _) in system.protection_domains.iter().enumerate() {
+            if pd_idx == logger.pd {
+                continue;
+            }
+            system_invocations.push(Invocation::new(
+                config,
+                InvocationArgs::CnodeMint {
+                    cnode: cnode_objs[pd_idx].cap_addr,
+                    dest_index: LOGGER_CAP_IDX,
+                    dest_depth: PD_CAP_BITS,
+                    src_root: root_cnode_cap,
+                    src_obj: logger_notification_obj.cap_addr,
+                    src_depth: config.cap_address_bits,
+                    rights: Rights::All as u64,
+                    // The logger drains every log buffer when it is notified
+                    // on channel 0
+                    badge: 1,
+                },
+            ));
+        }
+    }
+
     // All minting is complete at this point
 
     // Associate badges
-    // FIXME: This could use repeat
+    // Consecutive IRQs are folded into a repeat by Invocation::merge_repeats below
     for pd in &system.protection_domains {
         for (irq_cap_address, badged_notification_cap_address) in
             zip(&irq_cap_addresses[pd], &badged_irq_caps[pd])
@@ -2493,11 +3174,13 @@ fn build_system(
     // Initialise the TCBs
 
     // Set the scheduling parameters
+    // With MCS, the core a thread runs on is determined by the SchedControl cap used to
+    // configure its scheduling context, there is no separate affinity invocation.
     for (pd_idx, pd) in system.protection_domains.iter().enumerate() {
         system_invocations.push(Invocation::new(
             config,
             InvocationArgs::SchedControlConfigureFlags {
-                sched_control: kernel_boot_info.sched_control_cap,
+                sched_control: kernel_boot_info.sched_control_cap + pd.cpu,
                 sched_context: pd_sched_context_objs[pd_idx].cap_addr,
                 budget: pd.budget,
                 period: pd.period,
@@ -2508,12 +3191,12 @@ fn build_system(
         ));
     }
     for (vm_idx, vm) in virtual_machines.iter().enumerate() {
-        for vcpu_idx in 0..vm.vcpus.len() {
+        for (vcpu_idx, vcpu) in vm.vcpus.iter().enumerate() {
             let idx = vm_idx + vcpu_idx;
             system_invocations.push(Invocation::new(
                 config,
                 InvocationArgs::SchedControlConfigureFlags {
-                    sched_control: kernel_boot_info.sched_control_cap,
+                    sched_control: kernel_boot_info.sched_control_cap + vcpu.cpu,
                     sched_context: vm_sched_context_objs[idx].cap_addr,
                     budget: vm.budget,
                     period: vm.period,
@@ -2584,6 +3267,39 @@ fn build_system(
             },
         );
         system_invocations.push(tcb_cap_copy_invocation);
+
+        // Utilisation reporters are also given access to the TCB of every PD
+        for (pd_idx, pd) in system.protection_domains.iter().enumerate() {
+            if !pd.utilisation_reporter {
+                continue;
+            }
+            assert!(BASE_UTILISATION_TCB_CAP + (MAX_PDS as u64) <= PD_CAP_SIZE);
+            let mut reporter_tcb_copy_invocation = Invocation::new(
+                config,
+                InvocationArgs::CnodeCopy {
+                    cnode: cnode_objs[pd_idx].cap_addr,
+                    dest_index: BASE_UTILISATION_TCB_CAP,
+                    dest_depth: PD_CAP_BITS,
+                    src_root: root_cnode_cap,
+                    src_obj: pd_tcb_objs[0].cap_addr,
+                    src_depth: config.cap_address_bits,
+                    rights: Rights::All as u64,
+                },
+            );
+            reporter_tcb_copy_invocation.repeat(
+                system.protection_domains.len() as u32,
+                InvocationArgs::CnodeCopy {
+                    cnode: 0,
+                    dest_index: 1,
+                    dest_depth: 0,
+                    src_root: 0,
+                    src_obj: 1,
+                    src_depth: 0,
+                    rights: 0,
+                },
+            );
+            system_invocations.push(reporter_tcb_copy_invocation);
+        }
     }
 
     // Set VSpace and CSpace
@@ -2744,9 +3460,15 @@ fn build_system(
 
     // And now we are finally done. We have all the invocations
 
+    // Fold any runs of invocations that we have not already explicitly
+    // made use of repeat for.
+    let (system_invocations, system_invocation_origins) =
+        Invocation::merge_repeats(config, system_invocations);
+
     let mut system_invocation_data: Vec<u8> = Vec::new();
+    let mut encoder = InvocationEncoder::new();
     for system_invocation in &system_invocations {
-        system_invocation.add_raw_invocation(config, &mut system_invocation_data);
+        encoder.encode(config, system_invocation, &mut system_invocation_data);
     }
 
     let pd_setvar_values: Vec<Vec<u64>> = system
@@ -2785,6 +3507,7 @@ fn build_system(
         invocation_data: system_invocation_data,
         bootstrap_invocations,
         system_invocations,
+        system_invocation_origins,
         kernel_boot_info,
         reserved_region,
         fault_ep_cap_address: fault_ep_endpoint_object.cap_addr,
@@ -2798,6 +3521,7 @@ fn build_system(
         pd_setvar_values,
         pd_stack_addrs,
         kernel_objects,
+        untyped_usage: kao.untyped.into_iter().chain(kad.untyped).collect(),
         initial_task_phys_region,
         initial_task_virt_region,
     })
@@ -2854,6 +3578,28 @@ fn write_report<W: std::io::Write>(
         "     # of allocated objects: {}",
         comma_sep_usize(built_system.kernel_objects.len())
     )?;
+    writeln!(buf, "\n# Untyped Usage\n")?;
+    // Wasted memory was skipped over to align objects or to pad up to a
+    // fixed address, untyped that were not used at all are left out.
+    let mut total_wasted = 0;
+    for ut in &built_system.untyped_usage {
+        if ut.used() == 0 && ut.wasted() == 0 {
+            continue;
+        }
+        total_wasted += ut.wasted();
+        writeln!(
+            buf,
+            "     cap=0x{:x} [0x{:0>12x}..0x{:0>12x}) {:<6} used: {:>13} wasted: {:>13} free: {:>13}",
+            ut.untyped_object.cap,
+            ut.base(),
+            ut.end(),
+            if ut.untyped_object.is_device { "device" } else { "normal" },
+            comma_sep_u64(ut.used()),
+            comma_sep_u64(ut.wasted()),
+            comma_sep_u64(ut.free_space())
+        )?;
+    }
+    writeln!(buf, "     total wasted: {}", comma_sep_u64(total_wasted))?;
     writeln!(buf, "\n# Bootstrap Kernel Invocations Summary\n")?;
     writeln!(
         buf,
@@ -2895,8 +3641,20 @@ fn write_report<W: std::io::Write>(
         invocation.report_fmt(buf, config, &built_system.cap_lookup);
     }
     writeln!(buf, "\n# System Kernel Invocations Detail\n")?;
-    for (i, invocation) in built_system.system_invocations.iter().enumerate() {
-        write!(buf, "    0x{i:04x} ")?;
+    // The monitor reports a failed invocation by its index after runs have been
+    // folded into repeats (and which repeat of it failed), so print both that and
+    // the range of invocations it was folded from.
+    let invocations = built_system
+        .system_invocations
+        .iter()
+        .zip(&built_system.system_invocation_origins);
+    for (i, (invocation, origin)) in invocations.enumerate() {
+        let (first, last) = (origin.start, origin.end - 1);
+        if first == last {
+            write!(buf, "    0x{i:04x} (0x{first:04x})        ")?;
+        } else {
+            write!(buf, "    0x{i:04x} (0x{first:04x}-0x{last:04x}) ")?;
+        }
         invocation.report_fmt(buf, config, &built_system.cap_lookup);
     }
 
@@ -2904,7 +3662,8 @@ fn write_report<W: std::io::Write>(
 }
 
 fn print_usage() {
-    println!("usage: microkit [-h] [-o OUTPUT] [-r REPORT] --board BOARD --config CONFIG [--search-path [SEARCH_PATH ...]] system")
+    println!("usage: microkit [-h] [-o OUTPUT] [-r REPORT] --board BOARD --config CONFIG [--search-path [SEARCH_PATH ...]] system");
+    println!("       microkit trace [-h] ...")
 }
 
 fn print_help(available_boards: &[String]) {
@@ -2920,6 +3679,130 @@ fn print_help(available_boards: &[String]) {
     println!("  --search-path [SEARCH_PATH ...]");
 }
 
+fn print_trace_usage() {
+    println!("usage: microkit trace [-h] [-o OUTPUT] --report REPORT --dump DUMP --dump-base DUMP_BASE [--frequency FREQUENCY]")
+}
+
+fn print_trace_help() {
+    print_trace_usage();
+    println!("\nConvert the trace buffers of protection domains in a dump of physical memory to a Chrome trace.");
+    println!("\noptions:");
+    println!("  -h, --help, show this help message and exit");
+    println!("  -o, --output OUTPUT, defaults to trace.json");
+    println!("  -r, --report REPORT, the report from building the image");
+    println!("  --dump DUMP, raw dump of physical memory");
+    println!("  --dump-base DUMP_BASE, physical address of the start of the dump");
+    println!(
+        "  --frequency FREQUENCY, of the timestamps in Hz, overriding the one recorded by each PD"
+    );
+}
+
+struct TraceArgs<'a> {
+    report: &'a str,
+    dump: &'a str,
+    dump_base: u64,
+    frequency: Option<u64>,
+    output: &'a str,
+}
+
+impl<'a> TraceArgs<'a> {
+    /// 'args' are the arguments following 'trace'
+    pub fn parse(args: &'a [String]) -> TraceArgs<'a> {
+        let mut output = "trace.json";
+        let mut report = None;
+        let mut dump = None;
+        let mut dump_base = None;
+        let mut frequency = None;
+
+        let parse_number = |flag: &str, value: &str| {
+            let parsed = match value.strip_prefix("0x") {
+                Some(hex) => u64::from_str_radix(hex, 16),
+                None => value.parse::<u64>(),
+            };
+            parsed.unwrap_or_else(|_| {
+                eprintln!("microkit: error: argument {flag}: invalid number '{value}'");
+                std::process::exit(1);
+            })
+        };
+
+        let mut i = 0;
+        let mut unknown = vec![];
+        while i < args.len() {
+            let flag = args[i].as_str();
+            if flag == "-h" || flag == "--help" {
+                print_trace_help();
+                std::process::exit(0);
+            }
+            if ![
+                "-o",
+                "--output",
+                "-r",
+                "--report",
+                "--dump",
+                "--dump-base",
+                "--frequency",
+            ]
+            .contains(&flag)
+            {
+                unknown.push(args[i].clone());
+                i += 1;
+                continue;
+            }
+            if i == args.len() - 1 {
+                eprintln!("microkit: error: argument {flag}: expected one argument");
+                std::process::exit(1);
+            }
+            let value = &args[i + 1];
+            match flag {
+                "-o" | "--output" => output = value,
+                "-r" | "--report" => report = Some(value.as_str()),
+                "--dump" => dump = Some(value.as_str()),
+                "--dump-base" => dump_base = Some(parse_number(flag, value)),
+                "--frequency" => frequency = Some(parse_number(flag, value)),
+                _ => unreachable!(),
+            }
+            i += 2;
+        }
+
+        if !unknown.is_empty() {
+            print_trace_usage();
+            eprintln!(
+                "microkit: error: unrecognised arguments: {}",
+                unknown.join(" ")
+            );
+            std::process::exit(1);
+        }
+
+        let mut missing_args = Vec::new();
+        if report.is_none() {
+            missing_args.push("--report");
+        }
+        if dump.is_none() {
+            missing_args.push("--dump");
+        }
+        if dump_base.is_none() {
+            missing_args.push("--dump-base");
+        }
+
+        if !missing_args.is_empty() {
+            print_trace_usage();
+            eprintln!(
+                "microkit: error: the following arguments are required: {}",
+                missing_args.join(", ")
+            );
+            std::process::exit(1);
+        }
+
+        TraceArgs {
+            report: report.unwrap(),
+            dump: dump.unwrap(),
+            dump_base: dump_base.unwrap(),
+            frequency,
+            output,
+        }
+    }
+}
+
 struct Args<'a> {
     system: &'a str,
     board: &'a str,
@@ -3054,6 +3937,20 @@ impl<'a> Args<'a> {
 }
 
 fn main() -> Result<(), String> {
+    let env_args: Vec<_> = std::env::args().collect();
+
+    // Converting a trace does not need the SDK
+    if env_args.get(1).is_some_and(|arg| arg == "trace") {
+        let args = TraceArgs::parse(&env_args[2..]);
+        return trace::run(
+            args.report,
+            args.dump,
+            args.dump_base,
+            args.frequency,
+            args.output,
+        );
+    }
+
     let exe_path = std::env::current_exe().unwrap();
     let sdk_env = std::env::var("MICROKIT_SDK");
     let sdk_dir = match sdk_env {
@@ -3096,7 +3993,6 @@ fn main() -> Result<(), String> {
     }
     available_boards.sort();
 
-    let env_args: Vec<_> = std::env::args().collect();
     let args = Args::parse(&env_args, &available_boards);
 
     let board_path = boards_path.join(args.board);
@@ -3274,6 +4170,7 @@ fn main() -> Result<(), String> {
         hypervisor,
         benchmark: args.config == "benchmark",
         fpu: json_str_as_bool(&kernel_config_json, "HAVE_FPU")?,
+        num_cores: json_str_as_u64(&kernel_config_json, "MAX_NUM_NODES")?,
         arm_pa_size_bits,
         arm_smc,
         riscv_pt_levels: Some(RiscvVirtualMemory::Sv39),
@@ -3294,7 +4191,7 @@ fn main() -> Result<(), String> {
         "Microkit tool has various assumptions about the word size being 64-bits."
     );
 
-    let system = match parse(args.system, &xml, &kernel_config) {
+    let mut system = match parse(args.system, &xml, &kernel_config) {
         Ok(system) => system,
         Err(err) => {
             eprintln!("{err}");
@@ -3327,13 +4224,28 @@ fn main() -> Result<(), String> {
     }
 
     // Get the elf files for each pd:
-    let mut pd_elf_files = Vec::with_capacity(system.protection_domains.len());
-    for pd in &system.protection_domains {
-        match get_full_path(&pd.program_image, &search_paths) {
-            Some(path) => {
-                let elf = ElfFile::from_path(&path).unwrap();
-                pd_elf_files.push(elf);
+    let mut pd_elf_paths = Vec::with_capacity(system.protection_domains.len());
+    for (pd_idx, pd) in system.protection_domains.iter().enumerate() {
+        // The logger is provided by the SDK rather than found on the search path
+        if system
+            .logger
+            .as_ref()
+            .is_some_and(|logger| logger.pd == pd_idx)
+        {
+            let logger_elf_path = elf_path.join(&pd.program_image);
+            if !logger_elf_path.exists() {
+                eprintln!(
+                    "Error: logger ELF '{}' does not exist",
+                    logger_elf_path.display()
+                );
+                std::process::exit(1);
             }
+            pd_elf_paths.push(logger_elf_path);
+            continue;
+        }
+
+        match get_full_path(&pd.program_image, &search_paths) {
+            Some(path) => pd_elf_paths.push(path),
             None => {
                 return Err(format!(
                     "unable to find program image: '{}'",
@@ -3342,44 +4254,48 @@ fn main() -> Result<(), String> {
             }
         }
     }
+    // Reading and parsing the ELFs is independent per PD, so it is done in parallel
+    let mut pd_elf_files = par_map_mut(&mut pd_elf_paths, |_, path| ElfFile::from_path(path))
+        .into_iter()
+        .collect::<Result<Vec<_>, _>>()?;
 
-    let mut invocation_table_size = kernel_config.minimum_page_size;
-    let mut system_cnode_size = 2;
+    sdf::add_buffers(&kernel_config, &mut system, &pd_elf_files)?;
 
-    let mut built_system;
-    loop {
-        built_system = build_system(
-            &kernel_config,
-            &pd_elf_files,
-            &kernel_elf,
-            &monitor_elf,
-            &system,
-            invocation_table_size,
-            system_cnode_size,
-        )?;
-        println!("BUILT: system_cnode_size={} built_system.number_of_system_caps={} invocation_table_size={} built_system.invocation_data_size={}",
-                 system_cnode_size, built_system.number_of_system_caps, invocation_table_size, built_system.invocation_data_size);
+    let pd_resets = pd_resets(&kernel_config, &system, &pd_elf_files)?;
 
-        if built_system.number_of_system_caps <= system_cnode_size
-            && built_system.invocation_data_size <= invocation_table_size
-        {
-            break;
-        }
+    // Both sizes feed into the layout of the system, so they are fixed from
+    // upper bounds before it is built, and the system is only built once.
+    let (system_cnode_size, invocation_table_size) =
+        system_size_bounds(&kernel_config, &pd_elf_files, &system, &pd_resets);
+    let invocation_table_size = min(invocation_table_size, MAX_SYSTEM_INVOCATION_SIZE);
+    let built_system = build_system(
+        &kernel_config,
+        &pd_elf_files,
+        &kernel_elf,
+        &monitor_elf,
+        &system,
+        &pd_resets,
+        invocation_table_size,
+        system_cnode_size,
+    )?;
 
-        // Recalculate the sizes for the next iteration
-        let new_invocation_table_size = util::round_up(
-            built_system.invocation_data_size,
-            kernel_config.minimum_page_size,
+    if built_system.invocation_data_size > invocation_table_size {
+        if invocation_table_size == MAX_SYSTEM_INVOCATION_SIZE {
+            return Err(format!(
+                "system requires {} bytes of invocation data, more than the maximum of {} bytes",
+                built_system.invocation_data_size, MAX_SYSTEM_INVOCATION_SIZE
+            ));
+        }
+        panic!(
+            "Internal error: system requires {} bytes of invocation data, more than the bound of {} bytes",
+            built_system.invocation_data_size, invocation_table_size
         );
-        let new_system_cnode_size = 2_u64.pow(
-            built_system
-                .number_of_system_caps
-                .next_power_of_two()
-                .ilog2(),
+    }
+    if built_system.number_of_system_caps > system_cnode_size {
+        panic!(
+            "Internal error: system requires {} caps, more than the bound of {} caps",
+            built_system.number_of_system_caps, system_cnode_size
         );
-
-        invocation_table_size = max(invocation_table_size, new_invocation_table_size);
-        system_cnode_size = max(system_cnode_size, new_system_cnode_size);
     }
 
     // At this point we just need to patch the files (in memory) and write out the final image.
@@ -3438,8 +4354,9 @@ fn main() -> Result<(), String> {
     monitor_elf.write_symbol(monitor_config.untyped_info_symbol_name, &untyped_info_data)?;
 
     let mut bootstrap_invocation_data: Vec<u8> = Vec::new();
+    let mut encoder = InvocationEncoder::new();
     for invocation in &built_system.bootstrap_invocations {
-        invocation.add_raw_invocation(&kernel_config, &mut bootstrap_invocation_data);
+        encoder.encode(&kernel_config, invocation, &mut bootstrap_invocation_data);
     }
 
     let (_, bootstrap_invocation_data_size) =
@@ -3515,7 +4432,12 @@ fn main() -> Result<(), String> {
         &system.channels,
         &mut pd_elf_files,
         &built_system.pd_setvar_values,
+        &pd_resets,
     )?;
+    if let Some(logger) = &system.logger {
+        pd_elf_files[logger.pd]
+            .write_symbol("log_buffers_len", &logger.num_buffers.to_le_bytes())?;
+    }
 
     // Generate the report
     let report = match std::fs::File::create(args.report) {
@@ -3545,13 +4467,14 @@ fn main() -> Result<(), String> {
     }
     report_buf.flush().unwrap();
 
-    let mut loader_regions: Vec<(u64, &[u8])> = vec![(
+    let mut loader_regions: Vec<(u64, &[u8], u64)> = vec![(
         built_system.reserved_region.base,
         &built_system.invocation_data,
+        built_system.invocation_data.len() as u64,
     )];
     for (i, regions) in built_system.pd_elf_regions.iter().enumerate() {
         for r in regions {
-            loader_regions.push((r.addr, r.data(&pd_elf_files[i])));
+            loader_regions.push((r.addr, r.data(&pd_elf_files[i]), r.size));
         }
     }
 
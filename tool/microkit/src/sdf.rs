@@ -16,8 +16,9 @@
 /// but few seem to be concerned with giving any introspection regarding the parsed
 /// XML. The roxmltree project allows us to work on a lower-level than something based
 /// on serde and so we can report proper user errors.
-use crate::sel4::{Config, IrqTrigger, PageSize};
-use crate::util::str_to_bool;
+use crate::elf::ElfFile;
+use crate::sel4::{Arch, Config, IrqTrigger, PageSize};
+use crate::util::{self, str_to_bool};
 use crate::MAX_PDS;
 use std::path::{Path, PathBuf};
 
@@ -31,12 +32,25 @@ use std::path::{Path, PathBuf};
 /// This means we are left with 62 bits for the ID.
 /// IDs start at zero.
 const PD_MAX_ID: u64 = 61;
+/// Must match MICROKIT_MAX_CHANNELS in libmicrokit
+pub const MAX_CHANNELS: usize = PD_MAX_ID as usize + 1;
 const VCPU_MAX_ID: u64 = PD_MAX_ID;
 
 const PD_MAX_PRIORITY: u8 = 254;
 /// In microseconds
 const BUDGET_DEFAULT: u64 = 1000;
 
+/// The logger drains the log buffers when nothing else is running
+const LOGGER_PRIORITY_DEFAULT: u64 = 0;
+const LOGGER_PD_NAME: &str = "logger";
+const LOGGER_PROGRAM_IMAGE: &str = "logger.elf";
+/// Where the log buffers are mapped in the logger, one after the other
+const LOGGER_BUFFERS_VADDR: u64 = 0x10_000_000;
+
+/// The trace buffer of a PD is the memory region with this prefix followed by
+/// the name of the PD.
+pub const TRACE_MR_PREFIX: &str = "trace_";
+
 /// Default to a stack size of 8KiB
 const PD_DEFAULT_STACK_SIZE: u64 = 0x2000;
 const PD_MIN_STACK_SIZE: u64 = 0x1000;
@@ -177,6 +191,20 @@ pub struct ProtectionDomain {
     pub passive: bool,
     pub stack_size: u64,
     pub smc: bool,
+    /// CPU core the PD is scheduled on
+    pub cpu: u64,
+    /// Only valid in the benchmark configuration
+    pub utilisation_reporter: bool,
+    /// Size of the trace buffer, zero when the PD is not traced
+    pub trace_size: u64,
+    /// How long to poll the rings the PD consumes before blocking, zero
+    /// when the PD does not poll
+    pub poll_us: u64,
+    /// Channel identifier and virtual address of each ring the PD consumes
+    pub consumed_rings: Vec<(u64, u64)>,
+    /// Only valid for child protection domains, whether the parent can reset
+    /// the PD to its initial state
+    pub reset: bool,
     pub program_image: PathBuf,
     pub maps: Vec<SysMap>,
     pub irqs: Vec<SysIrq>,
@@ -206,6 +234,8 @@ pub struct VirtualMachine {
 #[derive(Debug, PartialEq, Eq, Hash)]
 pub struct VirtualCpu {
     pub id: u64,
+    /// CPU core the vCPU is scheduled on
+    pub cpu: u64,
 }
 
 /// To avoid code duplication for handling protection domains
@@ -362,9 +392,17 @@ impl ProtectionDomain {
             // The SMC field is only available in certain configurations
             // but we do the error-checking further down.
             "smc",
+            "cpu",
+            // Only available in the benchmark configuration, error-checking is
+            // done further down.
+            "utilisation_reporter",
+            "trace_size",
+            // Only available on AArch64, error-checking is done further down.
+            "poll_us",
         ];
         if is_child {
             attrs.push("id");
+            attrs.push("reset");
         }
         check_attributes(xml_sdf, node, &attrs)?;
 
@@ -413,6 +451,21 @@ impl ProtectionDomain {
             false
         };
 
+        let reset = if let Some(xml_reset) = node.attribute("reset") {
+            match str_to_bool(xml_reset) {
+                Some(val) => val,
+                None => {
+                    return Err(value_error(
+                        xml_sdf,
+                        node,
+                        "reset must be 'true' or 'false'".to_string(),
+                    ))
+                }
+            }
+        } else {
+            false
+        };
+
         let stack_size = if let Some(xml_stack_size) = node.attribute("stack_size") {
             sdf_parse_number(xml_stack_size, node)?
         } else {
@@ -450,6 +503,70 @@ impl ProtectionDomain {
             }
         }
 
+        let cpu = parse_cpu(config, xml_sdf, node)?;
+
+        let utilisation_reporter =
+            if let Some(xml_utilisation_reporter) = node.attribute("utilisation_reporter") {
+                match str_to_bool(xml_utilisation_reporter) {
+                    Some(val) => val,
+                    None => {
+                        return Err(value_error(
+                            xml_sdf,
+                            node,
+                            "utilisation_reporter must be 'true' or 'false'".to_string(),
+                        ))
+                    }
+                }
+            } else {
+                false
+            };
+
+        if utilisation_reporter && !config.benchmark {
+            return Err(value_error(
+                xml_sdf,
+                node,
+                "utilisation_reporter is only available in the benchmark configuration".to_string(),
+            ));
+        }
+
+        let trace_size = if let Some(xml_trace_size) = node.attribute("trace_size") {
+            sdf_parse_number(xml_trace_size, node)?
+        } else {
+            0
+        };
+
+        if trace_size % config.page_sizes()[0] != 0 {
+            return Err(value_error(
+                xml_sdf,
+                node,
+                "trace_size is not a multiple of the page size".to_string(),
+            ));
+        }
+
+        let poll_us = if let Some(xml_poll_us) = node.attribute("poll_us") {
+            sdf_parse_number(xml_poll_us, node)?
+        } else {
+            0
+        };
+
+        if poll_us != 0 {
+            // The time spent polling is measured with the generic timer
+            if !matches!(config.arch, Arch::Aarch64) {
+                return Err(value_error(
+                    xml_sdf,
+                    node,
+                    "poll_us is only available on AArch64".to_string(),
+                ));
+            }
+            if passive {
+                return Err(value_error(
+                    xml_sdf,
+                    node,
+                    "poll_us is not available for passive protection domains".to_string(),
+                ));
+            }
+        }
+
         #[allow(clippy::manual_range_contains)]
         if stack_size < PD_MIN_STACK_SIZE || stack_size > PD_MAX_STACK_SIZE {
             return Err(value_error(
@@ -662,6 +779,12 @@ impl ProtectionDomain {
             passive,
             stack_size,
             smc,
+            cpu,
+            utilisation_reporter,
+            trace_size,
+            poll_us,
+            consumed_rings: vec![],
+            reset,
             program_image: program_image.unwrap(),
             maps,
             irqs,
@@ -681,7 +804,11 @@ impl VirtualMachine {
         xml_sdf: &XmlSystemDescription,
         node: &roxmltree::Node,
     ) -> Result<VirtualMachine, String> {
-        check_attributes(xml_sdf, node, &["name", "budget", "period", "priority"])?;
+        check_attributes(
+            xml_sdf,
+            node,
+            &["name", "budget", "period", "priority", "cpu"],
+        )?;
 
         let name = checked_lookup(xml_sdf, node, "name")?.to_string();
         // If we do not have an explicit budget the period is equal to the default budget.
@@ -710,6 +837,10 @@ impl VirtualMachine {
             0
         };
 
+        // Each vCPU can be placed on its own core, by default they are
+        // placed on the same core as the virtual machine.
+        let vm_cpu = parse_cpu(config, xml_sdf, node)?;
+
         let mut vcpus: Vec<VirtualCpu> = Vec::new();
         let mut maps = Vec::new();
         for child in node.children() {
@@ -720,7 +851,7 @@ impl VirtualMachine {
             let child_name = child.tag_name().name();
             match child_name {
                 "vcpu" => {
-                    check_attributes(xml_sdf, &child, &["id"])?;
+                    check_attributes(xml_sdf, &child, &["id", "cpu"])?;
                     let id = checked_lookup(xml_sdf, &child, "id")?
                         .parse::<u64>()
                         .unwrap();
@@ -744,7 +875,13 @@ impl VirtualMachine {
                         }
                     }
 
-                    vcpus.push(VirtualCpu { id });
+                    let cpu = if child.attribute("cpu").is_some() {
+                        parse_cpu(config, xml_sdf, &child)?
+                    } else {
+                        vm_cpu
+                    };
+
+                    vcpus.push(VirtualCpu { id, cpu });
                 }
                 "map" => {
                     // Virtual machines do not have program images and so we do not allow
@@ -952,6 +1089,460 @@ impl Channel {
     }
 }
 
+/// A single-producer, single-consumer ring between two PDs, see
+/// libmicrokit's microkit_ring.h. A ring is shorthand for a memory region
+/// mapped into both PDs and a channel between them, so parsing one adds
+/// the maps and setvars to each PD and returns the region and channel.
+fn ring_from_xml(
+    config: &Config,
+    xml_sdf: &XmlSystemDescription,
+    node: &roxmltree::Node,
+    pds: &mut [ProtectionDomain],
+) -> Result<(SysMemoryRegion, Channel), String> {
+    check_attributes(xml_sdf, node, &["name", "size"])?;
+
+    let name = checked_lookup(xml_sdf, node, "name")?;
+    let page_size = config.page_sizes()[0];
+    let size = if let Some(xml_size) = node.attribute("size") {
+        sdf_parse_number(xml_size, node)?
+    } else {
+        page_size
+    };
+
+    if size == 0 || size % page_size != 0 {
+        return Err(value_error(
+            xml_sdf,
+            node,
+            "size is not a multiple of the page size".to_string(),
+        ));
+    }
+
+    let mut producer = None;
+    let mut consumer = None;
+    for child in node.children() {
+        if !child.is_element() {
+            continue;
+        }
+
+        let end = match child.tag_name().name() {
+            "producer" => &mut producer,
+            "consumer" => &mut consumer,
+            child_name => {
+                let pos = xml_sdf.doc.text_pos_at(child.range().start);
+                return Err(format!(
+                    "Error: invalid XML element '{}': {}",
+                    child_name,
+                    loc_string(xml_sdf, pos)
+                ));
+            }
+        };
+
+        if end.is_some() {
+            return Err(value_error(
+                xml_sdf,
+                node,
+                "exactly one producer and one consumer must be specified".to_string(),
+            ));
+        }
+
+        check_attributes(xml_sdf, &child, &["pd", "id", "vaddr", "setvar_vaddr"])?;
+        let end_pd = checked_lookup(xml_sdf, &child, "pd")?;
+        let id = sdf_parse_number(checked_lookup(xml_sdf, &child, "id")?, &child)?;
+        let vaddr = sdf_parse_number(checked_lookup(xml_sdf, &child, "vaddr")?, &child)?;
+
+        if id > PD_MAX_ID {
+            return Err(value_error(
+                xml_sdf,
+                &child,
+                format!("id must be < {}", PD_MAX_ID + 1),
+            ));
+        }
+
+        let Some(pd_idx) = pds.iter().position(|pd| pd.name == end_pd) else {
+            return Err(value_error(
+                xml_sdf,
+                &child,
+                format!("invalid PD name '{end_pd}'"),
+            ));
+        };
+        let pd = &mut pds[pd_idx];
+
+        let max_vaddr = config.pd_map_max_vaddr(pd.stack_size);
+        if vaddr >= max_vaddr {
+            return Err(value_error(
+                xml_sdf,
+                &child,
+                format!("vaddr (0x{vaddr:x}) must be less than 0x{max_vaddr:x}"),
+            ));
+        }
+
+        if let Some(setvar_vaddr) = child.attribute("setvar_vaddr") {
+            if pd
+                .setvars
+                .iter()
+                .any(|setvar| setvar.symbol == setvar_vaddr)
+            {
+                return Err(value_error(
+                    xml_sdf,
+                    &child,
+                    format!("setvar on symbol '{setvar_vaddr}' already exists"),
+                ));
+            }
+
+            pd.setvars.push(SysSetVar {
+                symbol: setvar_vaddr.to_string(),
+                kind: SysSetVarKind::Vaddr { address: vaddr },
+            });
+        }
+
+        if child.tag_name().name() == "consumer" {
+            pd.consumed_rings.push((id, vaddr));
+        }
+
+        // Both ends write to the ring, the producer its tail index and the
+        // consumer its head index.
+        pd.maps.push(SysMap {
+            mr: name.to_string(),
+            vaddr,
+            perms: SysMapPerms::Read as u8 | SysMapPerms::Write as u8,
+            cached: true,
+            text_pos: Some(xml_sdf.doc.text_pos_at(child.range().start)),
+        });
+
+        *end = Some(ChannelEnd {
+            pd: pd_idx,
+            id,
+            notify: true,
+            pp: false,
+        });
+    }
+
+    let (Some(producer), Some(consumer)) = (producer, consumer) else {
+        return Err(value_error(
+            xml_sdf,
+            node,
+            "exactly one producer and one consumer must be specified".to_string(),
+        ));
+    };
+
+    if producer.pd == consumer.pd {
+        return Err(value_error(
+            xml_sdf,
+            node,
+            "producer and consumer must be different protection domains".to_string(),
+        ));
+    }
+
+    let mr = SysMemoryRegion {
+        name: name.to_string(),
+        size,
+        page_size: page_size.into(),
+        page_count: size / page_size,
+        phys_addr: None,
+        text_pos: Some(xml_sdf.doc.text_pos_at(node.range().start)),
+        kind: SysMemoryRegionKind::User,
+    };
+
+    Ok((
+        mr,
+        Channel {
+            end_a: producer,
+            end_b: consumer,
+        },
+    ))
+}
+
+/// The logger is a protection domain, provided by the SDK, which prints
+/// what the other protection domains write to their log buffers.
+#[derive(Debug)]
+pub struct Logger {
+    /// Index of the logger in the list of protection domains
+    pub pd: usize,
+    /// Number of log buffers, one for every other protection domain
+    pub num_buffers: u64,
+    /// Size in bytes of each log buffer
+    pub buffer_size: u64,
+}
+
+fn logger_from_xml(
+    config: &Config,
+    xml_sdf: &XmlSystemDescription,
+    node: &roxmltree::Node,
+) -> Result<(ProtectionDomain, u64), String> {
+    check_attributes(xml_sdf, node, &["priority", "buffer_size"])?;
+
+    let priority = if let Some(xml_priority) = node.attribute("priority") {
+        sdf_parse_number(xml_priority, node)?
+    } else {
+        LOGGER_PRIORITY_DEFAULT
+    };
+    if priority > PD_MAX_PRIORITY as u64 {
+        return Err(value_error(
+            xml_sdf,
+            node,
+            format!("priority must be between 0 and {PD_MAX_PRIORITY}"),
+        ));
+    }
+
+    let page_size = config.page_sizes()[0];
+    let buffer_size = if let Some(xml_buffer_size) = node.attribute("buffer_size") {
+        sdf_parse_number(xml_buffer_size, node)?
+    } else {
+        page_size
+    };
+    if buffer_size == 0 || buffer_size % page_size != 0 {
+        return Err(value_error(
+            xml_sdf,
+            node,
+            "buffer_size is not a multiple of the page size".to_string(),
+        ));
+    }
+
+    let pd = ProtectionDomain {
+        id: None,
+        name: LOGGER_PD_NAME.to_string(),
+        // This downcast is safe as we have checked that this is less than
+        // the maximum PD priority, which fits in a u8.
+        priority: priority as u8,
+        budget: BUDGET_DEFAULT,
+        period: BUDGET_DEFAULT,
+        passive: false,
+        stack_size: PD_DEFAULT_STACK_SIZE,
+        smc: false,
+        cpu: 0,
+        utilisation_reporter: false,
+        trace_size: 0,
+        poll_us: 0,
+        consumed_rings: vec![],
+        reset: false,
+        program_image: PathBuf::from(LOGGER_PROGRAM_IMAGE),
+        maps: vec![],
+        irqs: vec![],
+        setvars: vec![],
+        child_pds: vec![],
+        virtual_machine: None,
+        has_children: false,
+        parent: None,
+        text_pos: xml_sdf.doc.text_pos_at(node.range().start),
+    };
+
+    Ok((pd, buffer_size))
+}
+
+/// Find the highest address below the stack of a PD at which 'size' bytes do
+/// not overlap any of its maps or the loadable segments of its ELF.
+fn free_vaddr_below_stack(
+    config: &Config,
+    pd: &ProtectionDomain,
+    pd_elf: &ElfFile,
+    mrs: &[SysMemoryRegion],
+    size: u64,
+    what: &str,
+) -> Result<u64, String> {
+    let page_size = config.page_sizes()[0];
+    let maps = pd.maps.iter().map(|map| {
+        let mr_size = mrs
+            .iter()
+            .find(|mr| mr.name == map.mr)
+            .map_or(0, |mr| mr.size);
+        (map.vaddr, map.vaddr + mr_size)
+    });
+    let segments = pd_elf
+        .segments
+        .iter()
+        .filter(|segment| segment.loadable)
+        .map(|segment| {
+            (
+                util::round_down(segment.virt_addr, page_size),
+                util::round_up(segment.virt_addr + segment.mem_size(), page_size),
+            )
+        });
+
+    free_vaddr_below(
+        config.pd_map_max_vaddr(pd.stack_size),
+        maps.chain(segments).collect(),
+        size,
+    )
+    .ok_or(format!(
+        "Error: no free virtual address range of 0x{:x} bytes for the {} of protection domain '{}'",
+        size, what, pd.name
+    ))
+}
+
+/// Find the highest address below 'top' at which 'size' bytes do not overlap
+/// any of the given ranges, if there is one.
+pub fn free_vaddr_below(top: u64, mut ranges: Vec<(u64, u64)>, size: u64) -> Option<u64> {
+    // Going from the highest range down, once the buffer has been moved below a
+    // range it cannot overlap any range that starts above it.
+    ranges.sort_by_key(|&(start, _)| std::cmp::Reverse(start));
+
+    let mut vaddr = top.checked_sub(size)?;
+    for (start, end) in ranges {
+        if start < vaddr + size && vaddr < end {
+            vaddr = start.checked_sub(size)?;
+        }
+    }
+
+    Some(vaddr)
+}
+
+/// Create a log buffer for every PD other than the logger, mapped into both
+/// the PD and the logger. The logger must be the last PD.
+fn add_log_buffers(
+    config: &Config,
+    pds: &mut [ProtectionDomain],
+    pd_elf_files: &[ElfFile],
+    mrs: &mut Vec<SysMemoryRegion>,
+    buffer_size: u64,
+) -> Result<(), String> {
+    let page_size = config.page_sizes()[0];
+    let logger_idx = pds.len() - 1;
+    let (clients, logger) = pds.split_at_mut(logger_idx);
+    let logger = &mut logger[0];
+    // Anything wrong with the maps is reported at the logger element
+    let text_pos = Some(logger.text_pos);
+
+    for (i, (pd, pd_elf)) in clients.iter_mut().zip(pd_elf_files).enumerate() {
+        let mr = SysMemoryRegion {
+            name: format!("{}_{}", LOGGER_PD_NAME, pd.name),
+            size: buffer_size,
+            page_size: page_size.into(),
+            page_count: buffer_size / page_size,
+            phys_addr: None,
+            text_pos,
+            kind: SysMemoryRegionKind::User,
+        };
+
+        let vaddr = free_vaddr_below_stack(config, pd, pd_elf, mrs, buffer_size, "log buffer")?;
+        pd.maps.push(SysMap {
+            mr: mr.name.clone(),
+            vaddr,
+            perms: SysMapPerms::Read as u8 | SysMapPerms::Write as u8,
+            cached: true,
+            text_pos,
+        });
+        pd.setvars.push(SysSetVar {
+            symbol: "microkit_log_buffer".to_string(),
+            kind: SysSetVarKind::Vaddr { address: vaddr },
+        });
+        pd.setvars.push(SysSetVar {
+            symbol: "microkit_log_buffer_size".to_string(),
+            kind: SysSetVarKind::Size {
+                mr: mr.name.clone(),
+            },
+        });
+
+        logger.maps.push(SysMap {
+            mr: mr.name.clone(),
+            vaddr: LOGGER_BUFFERS_VADDR + i as u64 * buffer_size,
+            perms: SysMapPerms::Read as u8 | SysMapPerms::Write as u8,
+            cached: true,
+            text_pos,
+        });
+        if i == 0 {
+            logger.setvars.push(SysSetVar {
+                symbol: "log_buffers".to_string(),
+                kind: SysSetVarKind::Vaddr {
+                    address: LOGGER_BUFFERS_VADDR,
+                },
+            });
+            logger.setvars.push(SysSetVar {
+                symbol: "log_buffer_size".to_string(),
+                kind: SysSetVarKind::Size {
+                    mr: mr.name.clone(),
+                },
+            });
+        }
+
+        mrs.push(mr);
+    }
+
+    Ok(())
+}
+
+/// Create a trace buffer for every PD with a trace_size, see microkit_trace.h.
+/// The buffers are named so that 'microkit trace' can find them in the report.
+fn add_trace_buffers(
+    config: &Config,
+    pds: &mut [ProtectionDomain],
+    pd_elf_files: &[ElfFile],
+    mrs: &mut Vec<SysMemoryRegion>,
+) -> Result<(), String> {
+    let page_size = config.page_sizes()[0];
+
+    for (pd, pd_elf) in pds.iter_mut().zip(pd_elf_files) {
+        if pd.trace_size == 0 {
+            continue;
+        }
+        let text_pos = Some(pd.text_pos);
+        let mr = SysMemoryRegion {
+            name: format!("{}{}", TRACE_MR_PREFIX, pd.name),
+            size: pd.trace_size,
+            page_size: page_size.into(),
+            page_count: pd.trace_size / page_size,
+            phys_addr: None,
+            text_pos,
+            kind: SysMemoryRegionKind::User,
+        };
+
+        let vaddr = free_vaddr_below_stack(config, pd, pd_elf, mrs, pd.trace_size, "trace buffer")?;
+        pd.maps.push(SysMap {
+            mr: mr.name.clone(),
+            vaddr,
+            perms: SysMapPerms::Read as u8 | SysMapPerms::Write as u8,
+            cached: true,
+            text_pos,
+        });
+        pd.setvars.push(SysSetVar {
+            symbol: "microkit_trace_buffer".to_string(),
+            kind: SysSetVarKind::Vaddr { address: vaddr },
+        });
+        pd.setvars.push(SysSetVar {
+            symbol: "microkit_trace_buffer_size".to_string(),
+            kind: SysSetVarKind::Size {
+                mr: mr.name.clone(),
+            },
+        });
+
+        mrs.push(mr);
+    }
+
+    Ok(())
+}
+
+/// Create the trace and log buffers of the system.
+///
+/// This is done once the PDs' ELFs have been loaded rather than when parsing,
+/// so that each buffer is placed clear of the PD's ELF segments as well as its
+/// maps.
+pub fn add_buffers(
+    config: &Config,
+    system: &mut SystemDescription,
+    pd_elf_files: &[ElfFile],
+) -> Result<(), String> {
+    let pds = &mut system.protection_domains;
+    let mrs = &mut system.memory_regions;
+
+    // Trace buffers are placed first so that log buffers are placed around them
+    add_trace_buffers(config, pds, pd_elf_files, mrs)?;
+    if let Some(logger) = &system.logger {
+        add_log_buffers(config, pds, pd_elf_files, mrs, logger.buffer_size)?;
+    }
+
+    // The buffers are named after their PD, which might clash with a memory
+    // region from the SDF.
+    for mr in mrs.iter() {
+        if mrs.iter().filter(|x| mr.name == x.name).count() > 1 {
+            return Err(format!(
+                "Error: duplicate memory region name '{}'.",
+                mr.name
+            ));
+        }
+    }
+
+    Ok(())
+}
+
 struct XmlSystemDescription<'a> {
     filename: &'a str,
     doc: &'a roxmltree::Document<'a>,
@@ -962,6 +1553,7 @@ pub struct SystemDescription {
     pub protection_domains: Vec<ProtectionDomain>,
     pub memory_regions: Vec<SysMemoryRegion>,
     pub channels: Vec<Channel>,
+    pub logger: Option<Logger>,
 }
 
 fn check_maps(
@@ -1068,6 +1660,33 @@ fn value_error(xml_sdf: &XmlSystemDescription, node: &roxmltree::Node, err: Stri
     )
 }
 
+/// Parse the optional 'cpu' attribute shared by protection domains and virtual machines.
+/// Defaults to the boot core.
+fn parse_cpu(
+    config: &Config,
+    xml_sdf: &XmlSystemDescription,
+    node: &roxmltree::Node,
+) -> Result<u64, String> {
+    let cpu = if let Some(xml_cpu) = node.attribute("cpu") {
+        sdf_parse_number(xml_cpu, node)?
+    } else {
+        0
+    };
+
+    if cpu >= config.num_cores {
+        return Err(value_error(
+            xml_sdf,
+            node,
+            format!(
+                "cpu must be less than the number of cores the kernel is configured for ({})",
+                config.num_cores
+            ),
+        ));
+    }
+
+    Ok(cpu)
+}
+
 fn check_no_text(xml_sdf: &XmlSystemDescription, node: &roxmltree::Node) -> Result<(), String> {
     let name = node.tag_name().name();
     let pos = xml_sdf.doc.text_pos_at(node.range().start);
@@ -1204,6 +1823,10 @@ pub fn parse(filename: &str, xml: &str, config: &Config) -> Result<SystemDescrip
     // via an index in the list of PDs. This means that we have to parse all PDs first and
     // then parse the channels.
     let mut channel_nodes = Vec::new();
+    // Likewise for rings, which also add maps to the PDs at each end.
+    let mut ring_nodes = Vec::new();
+    let mut logger_buffer_size = None;
+    let mut logger_root_pd = None;
 
     for child in system.children() {
         if !child.is_element() {
@@ -1216,6 +1839,21 @@ pub fn parse(filename: &str, xml: &str, config: &Config) -> Result<SystemDescrip
                 root_pds.push(ProtectionDomain::from_xml(config, &xml_sdf, &child, false)?)
             }
             "channel" => channel_nodes.push(child),
+            "ring" => ring_nodes.push(child),
+            "logger" => {
+                if logger_buffer_size.is_some() {
+                    let pos = xml_sdf.doc.text_pos_at(child.range().start);
+                    return Err(format!(
+                        "Error: logger must only be specified once: {}",
+                        loc_string(&xml_sdf, pos)
+                    ));
+                }
+                let (logger_pd, buffer_size) = logger_from_xml(config, &xml_sdf, &child)?;
+                logger_buffer_size = Some(buffer_size);
+                // The logger is placed after every other root PD, and so is
+                // the last PD once they are flattened.
+                logger_root_pd = Some(logger_pd);
+            }
             "memory_region" => mrs.push(SysMemoryRegion::from_xml(config, &xml_sdf, &child)?),
             "virtual_machine" => {
                 let pos = xml_sdf.doc.text_pos_at(child.range().start);
@@ -1235,12 +1873,39 @@ pub fn parse(filename: &str, xml: &str, config: &Config) -> Result<SystemDescrip
         }
     }
 
-    let pds = pd_flatten(&xml_sdf, root_pds)?;
+    if let Some(logger_pd) = logger_root_pd {
+        root_pds.push(logger_pd);
+    }
+
+    let mut pds = pd_flatten(&xml_sdf, root_pds)?;
 
     for node in channel_nodes {
         channels.push(Channel::from_xml(&xml_sdf, &node, &pds)?);
     }
 
+    for node in ring_nodes {
+        let (mr, channel) = ring_from_xml(config, &xml_sdf, &node, &mut pds)?;
+        mrs.push(mr);
+        channels.push(channel);
+    }
+
+    for pd in &pds {
+        if pd.poll_us != 0 && pd.consumed_rings.is_empty() {
+            return Err(format!(
+                "Error: protection domain '{}' has poll_us but does not consume any rings: {}",
+                pd.name,
+                loc_string(&xml_sdf, pd.text_pos)
+            ));
+        }
+    }
+
+    // The trace and log buffers are added by add_buffers once the ELFs are loaded
+    let logger = logger_buffer_size.map(|buffer_size| Logger {
+        pd: pds.len() - 1,
+        num_buffers: pds.len() as u64 - 1,
+        buffer_size,
+    });
+
     // Now that we have parsed everything in the system description we can validate any
     // global properties (e.g no duplicate PD names etc).
 
@@ -1461,5 +2126,6 @@ pub fn parse(filename: &str, xml: &str, config: &Config) -> Result<SystemDescrip
         protection_domains: pds,
         memory_regions: mrs,
         channels,
+        logger,
     })
 }
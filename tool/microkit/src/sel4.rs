@@ -4,14 +4,18 @@
 // SPDX-License-Identifier: BSD-2-Clause
 //
 
+use crate::util::{varint_encode, zigzag_encode, VARINT_MAX_LEN};
 use crate::UntypedObject;
 use serde::Deserialize;
 use std::collections::HashMap;
 use std::io::{BufWriter, Write};
+use std::ops::Range;
 
 #[derive(Clone)]
 pub struct BootInfo {
     pub fixed_cap_count: u64,
+    /// First of the SchedControl caps, there is one per core with the
+    /// cap for core N at `sched_control_cap + N`.
     pub sched_control_cap: u64,
     pub paging_cap_count: u64,
     pub page_cap_count: u64,
@@ -61,6 +65,8 @@ pub struct Config {
     pub hypervisor: bool,
     pub benchmark: bool,
     pub fpu: bool,
+    /// Number of CPU cores the kernel has been configured for (CONFIG_MAX_NUM_NODES)
+    pub num_cores: u64,
     /// ARM-specific, number of physical address bits
     pub arm_pa_size_bits: Option<usize>,
     /// ARM-specific, where or not SMC forwarding is allowed
@@ -688,6 +694,51 @@ impl Aarch64Regs {
     pub const LEN: usize = 36;
 }
 
+/// Encodes invocations into the compact format that the monitor decodes
+/// at runtime.
+///
+/// Each invocation starts with its command word as an unsigned LEB128 varint,
+/// followed by the rest of its words as zig-zag encoded varints. If the previous
+/// invocation had the same command word then each word is encoded as the difference
+/// from the corresponding word of the previous invocation. Invocations of the same
+/// kind tend to be generated together and only differ by small amounts (e.g the next
+/// cap slot or page), so most words end up taking a single byte rather than eight.
+#[derive(Default, Clone)]
+pub struct InvocationEncoder {
+    prev: Option<(u64, Vec<u64>)>,
+}
+
+impl InvocationEncoder {
+    pub fn new() -> InvocationEncoder {
+        InvocationEncoder { prev: None }
+    }
+
+    /// Upper bound on the encoded size of an invocation with the given number
+    /// of raw words (service, extra caps, arguments and any repeat increments),
+    /// regardless of what was encoded before it.
+    pub fn max_encoded_size(words: u64) -> u64 {
+        (1 + words) * VARINT_MAX_LEN
+    }
+
+    /// Appends the encoded invocation to the given data
+    pub fn encode(&mut self, config: &Config, invocation: &Invocation, data: &mut Vec<u8>) {
+        let (cmd, words) = invocation.raw_words(config);
+
+        varint_encode(cmd, data);
+        let prev_words = match &self.prev {
+            Some((prev_cmd, prev_words)) if *prev_cmd == cmd => Some(prev_words),
+            _ => None,
+        };
+        for (i, word) in words.iter().enumerate() {
+            let base = prev_words.map_or(0, |prev| prev[i]);
+            varint_encode(zigzag_encode(word.wrapping_sub(base) as i64), data);
+        }
+
+        self.prev = Some((cmd, words));
+    }
+}
+
+#[derive(Clone)]
 pub struct Invocation {
     /// There is some careful context to be aware of when using this field.
     /// The 'InvocationLabel' is abstract and does not represent the actual
@@ -718,34 +769,30 @@ impl Invocation {
     }
 
     /// Convert our higher-level representation of a seL4 invocation
-    /// into raw bytes that will be given to the monitor to interpret
+    /// into the raw words that will be given to the monitor to interpret
     /// at runtime.
-    /// Appends to the given data
-    pub fn add_raw_invocation(&self, config: &Config, data: &mut Vec<u8>) {
+    /// Returns the command word (the message tag with the repeat count in the
+    /// upper 32 bits) and the service, extra caps and arguments. If the
+    /// invocation is repeated, these are followed by the service, extra caps
+    /// and arguments increments.
+    fn raw_words(&self, config: &Config) -> (u64, Vec<u64>) {
         let (service, args, extra_caps): (u64, Vec<u64>, Vec<u64>) =
             self.args.clone().get_args(config);
 
-        // To potentionally save some allocation, we reserve enough space for all the invocation args
-        data.reserve(2 + args.len() * 8 + extra_caps.len() * 8);
-
-        let mut tag = Invocation::message_info_new(
+        let mut cmd = Invocation::message_info_new(
             self.label_raw as u64,
             0,
             extra_caps.len() as u64,
             args.len() as u64,
         );
         if let Some((count, _)) = self.repeat {
-            tag |= ((count - 1) as u64) << 32;
+            cmd |= ((count - 1) as u64) << 32;
         }
 
-        data.extend(tag.to_le_bytes());
-        data.extend(service.to_le_bytes());
-        for arg in extra_caps {
-            data.extend(arg.to_le_bytes());
-        }
-        for arg in args {
-            data.extend(arg.to_le_bytes());
-        }
+        let mut words = Vec::with_capacity(2 * (1 + extra_caps.len() + args.len()));
+        words.push(service);
+        words.extend(extra_caps);
+        words.extend(args);
 
         if let Some((_, repeat)) = self.repeat.clone() {
             // Assert that the variant of the invocation arguments is the
@@ -753,14 +800,122 @@ impl Invocation {
             assert!(std::mem::discriminant(&self.args) == std::mem::discriminant(&repeat));
 
             let (repeat_service, repeat_args, repeat_extra_caps) = repeat.get_args(config);
-            data.extend(repeat_service.to_le_bytes());
-            for cap in repeat_extra_caps {
-                data.extend(cap.to_le_bytes());
+            words.push(repeat_service);
+            words.extend(repeat_extra_caps);
+            words.extend(repeat_args);
+        }
+
+        (cmd, words)
+    }
+
+    /// Fold runs of invocations that only differ by a constant stride into
+    /// a single repeated invocation. This reduces both the size of the
+    /// invocation data and the number of invocations the monitor has to decode.
+    ///
+    /// A run is only folded if the repeated invocation encodes smaller than the
+    /// invocations it replaces. Short runs of invocations that already encode as
+    /// small deltas from each other are often cheaper left as they are.
+    ///
+    /// Returns the folded invocations along with the range of original
+    /// invocations that each of them covers. The monitor reports failures by the
+    /// folded index, so the report uses these to relate it back.
+    pub fn merge_repeats(
+        config: &Config,
+        invocations: Vec<Invocation>,
+    ) -> (Vec<Invocation>, Vec<Range<usize>>) {
+        let mut merged: Vec<Invocation> = Vec::with_capacity(invocations.len());
+        let mut origins: Vec<Range<usize>> = Vec::with_capacity(invocations.len());
+        // Encoder state as of the end of 'merged', so that each run is costed
+        // against what it will actually be encoded after.
+        let mut encoder = InvocationEncoder::new();
+        // The run currently being built, the index of its first invocation and
+        // its stride once it has more than one invocation.
+        let mut run: Vec<Invocation> = Vec::new();
+        let mut run_start = 0;
+        let mut stride: Option<InvocationArgs> = None;
+
+        for (idx, invocation) in invocations.into_iter().enumerate() {
+            if let Some(last) = run.last() {
+                let extendable = last.repeat.is_none()
+                    && invocation.repeat.is_none()
+                    && run.len() < u32::MAX as usize;
+                let next_stride = if extendable {
+                    last.args.stride(&invocation.args)
+                } else {
+                    None
+                };
+                if next_stride.is_some() && (run.len() == 1 || next_stride == stride) {
+                    stride = next_stride;
+                    run.push(invocation);
+                    continue;
+                }
+
+                Invocation::finish_run(
+                    config,
+                    &mut encoder,
+                    &mut merged,
+                    &mut origins,
+                    run_start,
+                    std::mem::take(&mut run),
+                    stride.take(),
+                );
+            }
+            run_start = idx;
+            run.push(invocation);
+        }
+        if !run.is_empty() {
+            Invocation::finish_run(
+                config,
+                &mut encoder,
+                &mut merged,
+                &mut origins,
+                run_start,
+                run,
+                stride,
+            );
+        }
+
+        (merged, origins)
+    }
+
+    fn finish_run(
+        config: &Config,
+        encoder: &mut InvocationEncoder,
+        merged: &mut Vec<Invocation>,
+        origins: &mut Vec<Range<usize>>,
+        start: usize,
+        run: Vec<Invocation>,
+        stride: Option<InvocationArgs>,
+    ) {
+        let mut data = Vec::new();
+        if let Some(stride) = stride {
+            let mut folded = run[0].clone();
+            folded.repeat(run.len() as u32, stride);
+            let mut folded_encoder = encoder.clone();
+            folded_encoder.encode(config, &folded, &mut data);
+            let folded_size = data.len();
+
+            data.clear();
+            let mut unfolded_encoder = encoder.clone();
+            for invocation in &run {
+                unfolded_encoder.encode(config, invocation, &mut data);
             }
-            for arg in repeat_args {
-                data.extend(arg.to_le_bytes());
+
+            if folded_size < data.len() {
+                *encoder = folded_encoder;
+                merged.push(folded);
+                origins.push(start..start + run.len());
+                return;
+            }
+            *encoder = unfolded_encoder;
+        } else {
+            for invocation in &run {
+                encoder.encode(config, invocation, &mut data);
             }
         }
+
+        origins.extend((start..start + run.len()).map(|idx| idx..idx + 1));
+        merged.extend(run);
     }
 
     /// With how count is used when we convert the invocation, it is limited to a u32.
@@ -1169,6 +1324,127 @@ impl InvocationArgs {
         }
     }
 
+    /// Returns all the fields of the invocation, if they are all plain numbers
+    /// that can be incremented by a repeated invocation.
+    fn numeric_fields_mut(&mut self) -> Option<Vec<&mut u64>> {
+        match self {
+            InvocationArgs::TcbSetSchedParams {
+                tcb,
+                authority,
+                mcp,
+                priority,
+                sched_context,
+                fault_ep,
+            } => Some(vec![tcb, authority, mcp, priority, sched_context, fault_ep]),
+            InvocationArgs::TcbSetSpace {
+                tcb,
+                fault_ep,
+                cspace_root,
+                cspace_root_data,
+                vspace_root,
+                vspace_root_data,
+            } => Some(vec![
+                tcb,
+                fault_ep,
+                cspace_root,
+                cspace_root_data,
+                vspace_root,
+                vspace_root_data,
+            ]),
+            InvocationArgs::TcbSetIpcBuffer {
+                tcb,
+                buffer,
+                buffer_frame,
+            } => Some(vec![tcb, buffer, buffer_frame]),
+            InvocationArgs::TcbResume { tcb } => Some(vec![tcb]),
+            InvocationArgs::TcbBindNotification { tcb, notification } => {
+                Some(vec![tcb, notification])
+            }
+            InvocationArgs::AsidPoolAssign { asid_pool, vspace } => Some(vec![asid_pool, vspace]),
+            InvocationArgs::IrqHandlerSetNotification {
+                irq_handler,
+                notification,
+            } => Some(vec![irq_handler, notification]),
+            InvocationArgs::PageTableMap {
+                page_table,
+                vspace,
+                vaddr,
+                attr,
+            } => Some(vec![page_table, vspace, vaddr, attr]),
+            InvocationArgs::PageMap {
+                page,
+                vspace,
+                vaddr,
+                rights,
+                attr,
+            } => Some(vec![page, vspace, vaddr, rights, attr]),
+            InvocationArgs::CnodeCopy {
+                cnode,
+                dest_index,
+                dest_depth,
+                src_root,
+                src_obj,
+                src_depth,
+                rights,
+            } => Some(vec![
+                cnode, dest_index, dest_depth, src_root, src_obj, src_depth, rights,
+            ]),
+            InvocationArgs::CnodeMint {
+                cnode,
+                dest_index,
+                dest_depth,
+                src_root,
+                src_obj,
+                src_depth,
+                rights,
+                badge,
+            } => Some(vec![
+                cnode, dest_index, dest_depth, src_root, src_obj, src_depth, rights, badge,
+            ]),
+            InvocationArgs::SchedControlConfigureFlags {
+                sched_control,
+                sched_context,
+                budget,
+                period,
+                extra_refills,
+                badge,
+                flags,
+            } => Some(vec![
+                sched_control,
+                sched_context,
+                budget,
+                period,
+                extra_refills,
+                badge,
+                flags,
+            ]),
+            InvocationArgs::ArmVcpuSetTcb { vcpu, tcb } => Some(vec![vcpu, tcb]),
+            // These have fields that are not plain numbers (e.g the object type)
+            InvocationArgs::UntypedRetype { .. }
+            | InvocationArgs::TcbWriteRegisters { .. }
+            | InvocationArgs::IrqControlGetTrigger { .. } => None,
+        }
+    }
+
+    /// Returns the difference between each field of this invocation and the next,
+    /// in the form used for the arguments of a repeated invocation.
+    /// Returns None if the invocations cannot be expressed as a repeat.
+    fn stride(&self, next: &InvocationArgs) -> Option<InvocationArgs> {
+        if std::mem::discriminant(self) != std::mem::discriminant(next) {
+            return None;
+        }
+
+        let mut prev = self.clone();
+        let mut stride = next.clone();
+        let prev_fields = prev.numeric_fields_mut()?;
+        let stride_fields = stride.numeric_fields_mut()?;
+        for (stride_field, prev_field) in stride_fields.into_iter().zip(prev_fields) {
+            *stride_field = stride_field.wrapping_sub(*prev_field);
+        }
+
+        Some(stride)
+    }
+
     fn get_args(self, config: &Config) -> (u64, Vec<u64>, Vec<u64>) {
         match self {
             InvocationArgs::UntypedRetype {
@@ -1321,7 +1597,7 @@ impl InvocationArgs {
     }
 }
 
-#[derive(Clone)]
+#[derive(Clone, PartialEq, Eq)]
 #[allow(dead_code, clippy::large_enum_variant)]
 pub enum InvocationArgs {
     UntypedRetype {
@@ -1431,3 +1707,232 @@ pub enum InvocationArgs {
         tcb: u64,
     },
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn test_config() -> Config {
+        Config {
+            arch: Arch::Aarch64,
+            word_size: 64,
+            minimum_page_size: 4096,
+            paddr_user_device_top: 1 << 40,
+            kernel_frame_size: 1 << 12,
+            init_cnode_bits: 12,
+            cap_address_bits: 64,
+            fan_out_limit: 256,
+            hypervisor: true,
+            benchmark: false,
+            fpu: true,
+            num_cores: 1,
+            arm_pa_size_bits: Some(40),
+            arm_smc: None,
+            riscv_pt_levels: None,
+            invocations_labels: serde_json::json!({
+                "UntypedRetype": 1,
+                "TCBResume": 12,
+                "ARMPageMap": 40,
+            }),
+            device_regions: vec![],
+            normal_regions: vec![],
+        }
+    }
+
+    fn page_map(page: u64, vaddr: u64) -> InvocationArgs {
+        InvocationArgs::PageMap {
+            page,
+            vspace: 0x20,
+            vaddr,
+            rights: 3,
+            attr: 0,
+        }
+    }
+
+    fn page_map_stride(page: u64, vaddr: u64) -> InvocationArgs {
+        InvocationArgs::PageMap {
+            page,
+            vspace: 0,
+            vaddr,
+            rights: 0,
+            attr: 0,
+        }
+    }
+
+    fn retype(node_offset: u64, num_objects: u64) -> InvocationArgs {
+        InvocationArgs::UntypedRetype {
+            untyped: 0x10,
+            object_type: ObjectType::SmallPage,
+            size_bits: 0,
+            root: 2,
+            node_index: 0,
+            node_depth: 1,
+            node_offset,
+            num_objects,
+        }
+    }
+
+    fn page_maps(config: &Config, pages: Range<u64>, vaddr_step: u64) -> Vec<Invocation> {
+        pages
+            .clone()
+            .map(|page| {
+                let vaddr = 0x200000u64.wrapping_add((page - pages.start).wrapping_mul(vaddr_step));
+                Invocation::new(config, page_map(page, vaddr))
+            })
+            .collect()
+    }
+
+    /// Decode the invocation data the way the monitor does, expanding repeats
+    /// back into one command word and set of words per invocation.
+    fn decode(data: &[u8]) -> Vec<(u64, Vec<u64>)> {
+        fn varint(data: &[u8], offset: &mut usize) -> u64 {
+            let mut value = 0;
+            let mut shift = 0;
+            loop {
+                let byte = data[*offset];
+                *offset += 1;
+                value |= ((byte & 0x7f) as u64) << shift;
+                if byte & 0x80 == 0 {
+                    return value;
+                }
+                shift += 7;
+            }
+        }
+
+        let mut decoded = Vec::new();
+        let mut prev: Option<(u64, Vec<u64>)> = None;
+        let mut offset = 0;
+        while offset < data.len() {
+            let cmd = varint(data, &mut offset);
+            let iterations = (cmd >> 32) + 1;
+            let tag = cmd & 0xffffffff;
+            let extra_caps = (tag >> 7) & 0x3;
+            let length = tag & 0x7f;
+            let mut word_count = (1 + extra_caps + length) as usize;
+            if iterations > 1 {
+                word_count *= 2;
+            }
+
+            let mut words = Vec::with_capacity(word_count);
+            for i in 0..word_count {
+                let base = match &prev {
+                    Some((prev_cmd, prev_words)) if *prev_cmd == cmd => prev_words[i],
+                    _ => 0,
+                };
+                let zigzag = varint(data, &mut offset);
+                let delta = ((zigzag >> 1) as i64 ^ -((zigzag & 1) as i64)) as u64;
+                words.push(base.wrapping_add(delta));
+            }
+
+            let base_count = word_count / iterations.min(2) as usize;
+            for i in 0..iterations {
+                let expanded = (0..base_count)
+                    .map(|j| {
+                        let incr = if i > 0 { words[base_count + j] } else { 0 };
+                        words[j].wrapping_add(incr.wrapping_mul(i))
+                    })
+                    .collect();
+                decoded.push((tag, expanded));
+            }
+            prev = Some((cmd, words));
+        }
+
+        decoded
+    }
+
+    #[test]
+    fn test_stride() {
+        let stride = page_map(4, 0x1000).stride(&page_map(5, 0x2000));
+        assert!(stride == Some(page_map_stride(1, 0x1000)));
+
+        // Fields that stay the same, or go down, are still a valid stride.
+        let stride = page_map(5, 0x2000).stride(&page_map(5, 0x1000));
+        assert!(stride == Some(page_map_stride(0, 0x1000u64.wrapping_neg())));
+        let stride = page_map(5, 0x1000).stride(&page_map(5, 0x1000));
+        assert!(stride == Some(page_map_stride(0, 0)));
+
+        // A different variant, or one with non-numeric fields, is not.
+        assert!(page_map(4, 0x1000)
+            .stride(&InvocationArgs::TcbResume { tcb: 4 })
+            .is_none());
+        assert!(retype(0, 1).stride(&retype(1, 1)).is_none());
+    }
+
+    #[test]
+    fn test_merge_repeats() {
+        let config = test_config();
+
+        let mut invocations = page_maps(&config, 0x100..0x110, 0x1000);
+        invocations.extend(page_maps(&config, 0x200..0x210, 0x1000u64.wrapping_neg()));
+        let (merged, origins) = Invocation::merge_repeats(&config, invocations);
+        assert_eq!(merged.len(), 2);
+        assert_eq!(origins, [0..16, 16..32]);
+        assert!(merged[0].repeat == Some((16, page_map_stride(1, 0x1000))));
+        assert!(merged[1].repeat == Some((16, page_map_stride(1, 0x1000u64.wrapping_neg()))));
+
+        // Runs end at an invocation of another variant, and invocations
+        // with non-numeric fields are left as they are.
+        let mut invocations = page_maps(&config, 0x100..0x110, 0x1000);
+        invocations.push(Invocation::new(
+            &config,
+            InvocationArgs::TcbResume { tcb: 7 },
+        ));
+        invocations.extend((0..4).map(|i| Invocation::new(&config, retype(i, 1))));
+        invocations.extend(page_maps(&config, 0x110..0x120, 0x1000));
+        let (merged, origins) = Invocation::merge_repeats(&config, invocations);
+        assert_eq!(
+            origins,
+            [0..16, 16..17, 17..18, 18..19, 19..20, 20..21, 21..37]
+        );
+        assert!(merged[0].repeat.is_some() && merged[6].repeat.is_some());
+        assert!(merged[1..6]
+            .iter()
+            .all(|invocation| invocation.repeat.is_none()));
+    }
+
+    #[test]
+    fn test_merge_repeats_already_repeated() {
+        let config = test_config();
+
+        // An invocation that is already repeated is never extended, even when
+        // the invocations around it continue its stride.
+        let mut repeated = Invocation::new(&config, page_map(0x110, 0x210000));
+        repeated.repeat(16, page_map_stride(1, 0x1000));
+        let mut invocations = page_maps(&config, 0x100..0x110, 0x1000);
+        invocations.push(repeated);
+        invocations.extend(page_maps(&config, 0x120..0x130, 0x1000));
+        let (merged, origins) = Invocation::merge_repeats(&config, invocations);
+        assert_eq!(origins, [0..16, 16..17, 17..33]);
+        assert!(merged
+            .iter()
+            .all(|invocation| invocation.repeat.as_ref().map(|r| r.0) == Some(16)));
+    }
+
+    #[test]
+    fn test_merge_repeats_round_trip() {
+        let config = test_config();
+
+        let mut invocations = page_maps(&config, 0x100..0x120, 0x1000);
+        invocations.push(Invocation::new(
+            &config,
+            InvocationArgs::TcbResume { tcb: 7 },
+        ));
+        invocations.extend((0..3).map(|i| Invocation::new(&config, retype(i, 1))));
+        invocations.extend(page_maps(&config, 0x100..0x102, 0x1000));
+        invocations.extend(page_maps(&config, 0x300..0x308, 0x1000u64.wrapping_neg()));
+        let expected: Vec<(u64, Vec<u64>)> = invocations
+            .iter()
+            .map(|invocation| invocation.raw_words(&config))
+            .collect();
+
+        let (merged, _) = Invocation::merge_repeats(&config, invocations);
+        assert!(merged.len() < expected.len());
+        let mut encoder = InvocationEncoder::new();
+        let mut data = Vec::new();
+        for invocation in &merged {
+            encoder.encode(&config, invocation, &mut data);
+        }
+
+        assert_eq!(decode(&data), expected);
+    }
+}
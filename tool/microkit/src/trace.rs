@@ -0,0 +1,471 @@
+//
+// Copyright 2024, UNSW
+//
+// SPDX-License-Identifier: BSD-2-Clause
+//
+
+// Conversion of the trace buffers recorded by libmicrokit, see
+// libmicrokit/include/microkit_trace.h, into the Chrome trace event format
+// which is understood by Perfetto and chrome://tracing.
+//
+// The trace buffers are found in a dump of physical memory taken from the
+// running (or stopped) system. The report produced when building the image
+// lists the physical address of every page of every memory region, which is
+// enough to reassemble each buffer from the dump.
+
+use crate::sdf::TRACE_MR_PREFIX;
+use serde_json::json;
+use std::collections::BTreeMap;
+use std::fs::File;
+use std::io::{Read, Seek, SeekFrom};
+
+/// "MKTRACE1", must match MICROKIT_TRACE_MAGIC
+const TRACE_MAGIC: u64 = 0x3145434152544b4d;
+const TRACE_HEADER_SIZE: usize = 32;
+const TRACE_RECORD_SIZE: usize = 16;
+
+// Must match the MICROKIT_TRACE_* events in microkit.h
+const TRACE_NOTIFY: u8 = 1;
+const TRACE_IRQ_ACK: u8 = 2;
+const TRACE_PPCALL_BEGIN: u8 = 3;
+const TRACE_PPCALL_END: u8 = 4;
+const TRACE_NOTIFIED: u8 = 5;
+const TRACE_PROTECTED_BEGIN: u8 = 6;
+const TRACE_PROTECTED_END: u8 = 7;
+const TRACE_FAULT: u8 = 8;
+
+#[derive(Debug, PartialEq, Eq)]
+pub struct TraceBuffer {
+    pub pd: String,
+    /// Physical address and size of each page of the buffer, in order
+    pub pages: Vec<(u64, u64)>,
+}
+
+#[derive(Debug, PartialEq, Eq)]
+pub struct TraceRecord {
+    pub timestamp: u64,
+    pub event: u8,
+    pub channel: u8,
+    pub arg: u32,
+}
+
+#[derive(Debug, PartialEq, Eq)]
+pub struct Trace {
+    /// Frequency of the timestamps in Hz, zero when the PD did not know it
+    pub frequency: u64,
+    /// Oldest record first
+    pub records: Vec<TraceRecord>,
+}
+
+/// Parse a page size as printed by human_size_strict, e.g. "4 KiB"
+fn parse_page_size(s: &str) -> Option<u64> {
+    let (count, label) = s.split_once(' ')?;
+    let count: u64 = count.replace(',', "").parse().ok()?;
+    let bits = match label {
+        "bytes" => 0,
+        "KiB" => 10,
+        "MiB" => 20,
+        "GiB" => 30,
+        _ => return None,
+    };
+    Some(count << bits)
+}
+
+/// Find the pages of every trace buffer in the 'Allocated Kernel Objects
+/// Detail' section of a report. The lines of interest look like:
+///
+/// ```text
+/// Page(4 KiB): MR=trace_client #0        10 cap_addr=1a phys_addr=60100000
+/// ```
+pub fn trace_buffers_from_report(report: &str) -> Result<Vec<TraceBuffer>, String> {
+    let mut pages: BTreeMap<String, Vec<(u64, u64, u64)>> = BTreeMap::new();
+
+    for line in report.lines() {
+        let Some(rest) = line.trim_start().strip_prefix("Page(") else {
+            continue;
+        };
+        let Some((size, rest)) = rest.split_once("): MR=") else {
+            continue;
+        };
+        let Some(rest) = rest.strip_prefix(TRACE_MR_PREFIX) else {
+            continue;
+        };
+        let Some((pd, rest)) = rest.split_once(" #") else {
+            continue;
+        };
+
+        let malformed = || format!("malformed trace buffer page in report: '{}'", line.trim());
+        let page_size = parse_page_size(size).ok_or_else(malformed)?;
+        let idx = rest
+            .split_whitespace()
+            .next()
+            .and_then(|idx| idx.parse::<u64>().ok())
+            .ok_or_else(malformed)?;
+        let phys_addr = rest
+            .split_once("phys_addr=")
+            .and_then(|(_, addr)| u64::from_str_radix(addr.trim(), 16).ok())
+            .ok_or_else(malformed)?;
+
+        pages
+            .entry(pd.to_string())
+            .or_default()
+            .push((idx, phys_addr, page_size));
+    }
+
+    let mut buffers = Vec::new();
+    for (pd, mut pd_pages) in pages {
+        pd_pages.sort_by_key(|&(idx, _, _)| idx);
+        for (i, &(idx, _, _)) in pd_pages.iter().enumerate() {
+            if idx != i as u64 {
+                return Err(format!(
+                    "page {i} of the trace buffer of PD '{pd}' is missing from the report"
+                ));
+            }
+        }
+        buffers.push(TraceBuffer {
+            pd,
+            pages: pd_pages
+                .into_iter()
+                .map(|(_, phys_addr, size)| (phys_addr, size))
+                .collect(),
+        });
+    }
+
+    Ok(buffers)
+}
+
+/// Read the contents of a trace buffer from a dump of physical memory
+/// starting at 'dump_base'.
+pub fn read_trace_buffer<R: Read + Seek>(
+    dump: &mut R,
+    dump_base: u64,
+    buffer: &TraceBuffer,
+) -> Result<Vec<u8>, String> {
+    let mut data = Vec::new();
+    for &(phys_addr, size) in &buffer.pages {
+        if phys_addr < dump_base {
+            return Err(format!(
+                "trace buffer of PD '{}' at 0x{phys_addr:x} is below the start of the dump at 0x{dump_base:x}",
+                buffer.pd
+            ));
+        }
+        let start = data.len();
+        data.resize(start + size as usize, 0);
+        dump.seek(SeekFrom::Start(phys_addr - dump_base))
+            .and_then(|_| dump.read_exact(&mut data[start..]))
+            .map_err(|e| {
+                format!(
+                    "could not read the trace buffer of PD '{}' at 0x{phys_addr:x} from the dump: {e}",
+                    buffer.pd
+                )
+            })?;
+    }
+
+    Ok(data)
+}
+
+fn read_u64(data: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(data[offset..offset + 8].try_into().unwrap())
+}
+
+/// Decode a trace buffer, returning None if the PD never started tracing.
+pub fn decode_trace_buffer(pd: &str, data: &[u8]) -> Result<Option<Trace>, String> {
+    if data.len() < TRACE_HEADER_SIZE || read_u64(data, 0) != TRACE_MAGIC {
+        return Ok(None);
+    }
+
+    let frequency = read_u64(data, 8);
+    let count = read_u64(data, 16);
+    let capacity = read_u64(data, 24);
+    if capacity == 0 || capacity > ((data.len() - TRACE_HEADER_SIZE) / TRACE_RECORD_SIZE) as u64 {
+        return Err(format!(
+            "trace buffer of PD '{pd}' has an invalid capacity of {capacity} records"
+        ));
+    }
+
+    let records = (count.saturating_sub(capacity)..count)
+        .map(|n| {
+            let offset = TRACE_HEADER_SIZE + (n % capacity) as usize * TRACE_RECORD_SIZE;
+            let record = &data[offset..offset + TRACE_RECORD_SIZE];
+            TraceRecord {
+                timestamp: read_u64(record, 0),
+                event: record[8],
+                channel: record[9],
+                arg: u32::from_le_bytes(record[12..16].try_into().unwrap()),
+            }
+        })
+        .collect();
+
+    Ok(Some(Trace { frequency, records }))
+}
+
+/// Convert the traces of each PD to a Chrome trace, with one thread per PD.
+/// Timestamps are in microseconds from the first recorded event. A
+/// 'frequency' given by the user overrides the one recorded by the PDs.
+pub fn chrome_trace(
+    traces: &[(String, Trace)],
+    frequency: Option<u64>,
+) -> Result<serde_json::Value, String> {
+    let mut frequencies = Vec::with_capacity(traces.len());
+    for (pd, trace) in traces {
+        match frequency.unwrap_or(trace.frequency) {
+            0 => {
+                return Err(format!(
+                    "the timestamp frequency of PD '{pd}' is not known, it must be given with --frequency"
+                ))
+            }
+            f => frequencies.push(f),
+        }
+    }
+
+    let to_us = |timestamp: u64, frequency: u64| timestamp as f64 * 1_000_000.0 / frequency as f64;
+    let start = traces
+        .iter()
+        .zip(&frequencies)
+        .flat_map(|((_, trace), &frequency)| {
+            trace
+                .records
+                .iter()
+                .map(move |record| to_us(record.timestamp, frequency))
+        })
+        .fold(f64::INFINITY, f64::min);
+
+    let mut events = Vec::new();
+    for (tid, ((pd, trace), &frequency)) in traces.iter().zip(&frequencies).enumerate() {
+        events.push(json!({
+            "name": "thread_name",
+            "ph": "M",
+            "pid": 0,
+            "tid": tid,
+            "args": { "name": pd },
+        }));
+
+        for record in &trace.records {
+            let ch = record.channel;
+            let (ph, name) = match record.event {
+                TRACE_NOTIFY if record.arg == 1 => ("i", format!("deferred notify {ch}")),
+                TRACE_NOTIFY => ("i", format!("notify {ch}")),
+                TRACE_IRQ_ACK if record.arg == 1 => ("i", format!("deferred irq_ack {ch}")),
+                TRACE_IRQ_ACK => ("i", format!("irq_ack {ch}")),
+                TRACE_PPCALL_BEGIN => ("B", format!("ppcall {ch}")),
+                TRACE_PPCALL_END => ("E", format!("ppcall {ch}")),
+                TRACE_NOTIFIED => ("i", format!("notified {ch}")),
+                TRACE_PROTECTED_BEGIN => ("B", format!("protected {ch}")),
+                TRACE_PROTECTED_END => ("E", format!("protected {ch}")),
+                TRACE_FAULT => ("i", format!("fault from child {ch}")),
+                event => {
+                    return Err(format!(
+                        "trace buffer of PD '{pd}' contains an unknown event {event}"
+                    ))
+                }
+            };
+
+            let mut event = json!({
+                "name": name,
+                "ph": ph,
+                "ts": to_us(record.timestamp, frequency) - start,
+                "pid": 0,
+                "tid": tid,
+            });
+            match record.event {
+                // Instant events are scoped to their thread
+                TRACE_NOTIFY | TRACE_IRQ_ACK | TRACE_NOTIFIED => event["s"] = json!("t"),
+                TRACE_FAULT => {
+                    event["s"] = json!("t");
+                    event["args"] = json!({ "label": record.arg });
+                }
+                _ => event["args"] = json!({ "label": record.arg }),
+            }
+            events.push(event);
+        }
+    }
+
+    Ok(json!({
+        "traceEvents": events,
+        "displayTimeUnit": "ns",
+    }))
+}
+
+/// Entry point of 'microkit trace'
+pub fn run(
+    report_path: &str,
+    dump_path: &str,
+    dump_base: u64,
+    frequency: Option<u64>,
+    output_path: &str,
+) -> Result<(), String> {
+    let report = std::fs::read_to_string(report_path)
+        .map_err(|e| format!("could not read report '{report_path}': {e}"))?;
+    let buffers = trace_buffers_from_report(&report)?;
+    if buffers.is_empty() {
+        return Err(format!(
+            "report '{report_path}' does not contain any trace buffers, is 'trace_size' set on any protection domains?"
+        ));
+    }
+
+    let mut dump =
+        File::open(dump_path).map_err(|e| format!("could not open dump '{dump_path}': {e}"))?;
+    let mut traces = Vec::new();
+    for buffer in &buffers {
+        let data = read_trace_buffer(&mut dump, dump_base, buffer)?;
+        match decode_trace_buffer(&buffer.pd, &data)? {
+            Some(trace) => traces.push((buffer.pd.clone(), trace)),
+            None => eprintln!(
+                "microkit: warning: PD '{}' has not written to its trace buffer",
+                buffer.pd
+            ),
+        }
+    }
+
+    let trace = chrome_trace(&traces, frequency)?;
+    let output =
+        File::create(output_path).map_err(|e| format!("could not create '{output_path}': {e}"))?;
+    serde_json::to_writer(output, &trace)
+        .map_err(|e| format!("could not write '{output_path}': {e}"))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Cursor;
+
+    fn trace_buffer(frequency: u64, count: u64, capacity: u64, records: &[TraceRecord]) -> Vec<u8> {
+        let mut data = Vec::new();
+        for value in [TRACE_MAGIC, frequency, count, capacity] {
+            data.extend_from_slice(&value.to_le_bytes());
+        }
+        for record in records {
+            data.extend_from_slice(&record.timestamp.to_le_bytes());
+            data.extend_from_slice(&[record.event, record.channel, 0, 0]);
+            data.extend_from_slice(&record.arg.to_le_bytes());
+        }
+        data.resize(4096, 0);
+        data
+    }
+
+    fn record(timestamp: u64, event: u8, channel: u8) -> TraceRecord {
+        TraceRecord {
+            timestamp,
+            event,
+            channel,
+            arg: 0,
+        }
+    }
+
+    #[test]
+    fn test_trace_buffers_from_report() {
+        let report = "\
+# Allocated Kernel Objects Detail
+
+    Page(4 KiB): MR=trace_client #1                      10 cap_addr=1b phys_addr=60102000
+    Page(4 KiB): MR=client_data #0                        10 cap_addr=1c phys_addr=60103000
+    Page(4 KiB): MR=trace_client #0                      10 cap_addr=1a phys_addr=60100000
+    Page(2 MiB): MR=trace_server #0                      11 cap_addr=1d phys_addr=60200000
+";
+        assert_eq!(
+            trace_buffers_from_report(report).unwrap(),
+            vec![
+                TraceBuffer {
+                    pd: "client".to_string(),
+                    pages: vec![(0x60100000, 0x1000), (0x60102000, 0x1000)],
+                },
+                TraceBuffer {
+                    pd: "server".to_string(),
+                    pages: vec![(0x60200000, 0x200000)],
+                },
+            ]
+        );
+    }
+
+    #[test]
+    fn test_trace_buffers_from_report_missing_page() {
+        let report = "    Page(4 KiB): MR=trace_client #1      10 cap_addr=1b phys_addr=60102000\n";
+        assert!(trace_buffers_from_report(report).is_err());
+    }
+
+    #[test]
+    fn test_read_trace_buffer() {
+        let mut dump = vec![0u8; 0x3000];
+        dump[0x2000] = 1;
+        dump[0x0000] = 2;
+        let buffer = TraceBuffer {
+            pd: "client".to_string(),
+            pages: vec![(0x60102000, 0x1000), (0x60100000, 0x1000)],
+        };
+        let data = read_trace_buffer(&mut Cursor::new(dump), 0x60100000, &buffer).unwrap();
+        assert_eq!(data.len(), 0x2000);
+        assert_eq!((data[0], data[0x1000]), (1, 2));
+    }
+
+    #[test]
+    fn test_decode_trace_buffer_wrapped() {
+        // Five records written to a ring of three, the oldest two were overwritten
+        let records = [
+            record(4, TRACE_NOTIFY, 0),
+            record(5, TRACE_NOTIFIED, 1),
+            record(3, TRACE_IRQ_ACK, 2),
+        ];
+        let data = trace_buffer(1000, 5, 3, &records);
+        let trace = decode_trace_buffer("client", &data).unwrap().unwrap();
+        assert_eq!(trace.frequency, 1000);
+        assert_eq!(
+            trace
+                .records
+                .iter()
+                .map(|r| r.timestamp)
+                .collect::<Vec<_>>(),
+            [3, 4, 5]
+        );
+    }
+
+    #[test]
+    fn test_decode_trace_buffer_not_started() {
+        assert_eq!(decode_trace_buffer("client", &[0u8; 4096]).unwrap(), None);
+    }
+
+    #[test]
+    fn test_chrome_trace() {
+        let data = trace_buffer(
+            1_000_000,
+            4,
+            200,
+            &[
+                record(10, TRACE_PPCALL_BEGIN, 1),
+                record(12, TRACE_PPCALL_END, 1),
+                record(15, TRACE_NOTIFY, 0),
+                record(16, 99, 0),
+            ],
+        );
+        let trace = decode_trace_buffer("client", &data).unwrap().unwrap();
+        // The unknown event is an error
+        assert!(chrome_trace(&[("client".to_string(), trace)], None).is_err());
+
+        let data = trace_buffer(
+            0,
+            3,
+            200,
+            &[
+                record(10, TRACE_PPCALL_BEGIN, 1),
+                record(12, TRACE_PPCALL_END, 1),
+                record(15, TRACE_NOTIFY, 0),
+            ],
+        );
+        let traces = [(
+            "client".to_string(),
+            decode_trace_buffer("client", &data).unwrap().unwrap(),
+        )];
+        // The PD did not know the frequency
+        assert!(chrome_trace(&traces, None).is_err());
+
+        let json = chrome_trace(&traces, Some(1_000_000)).unwrap();
+        let events = json["traceEvents"].as_array().unwrap();
+        assert_eq!(events.len(), 4);
+        assert_eq!(events[0]["args"]["name"], "client");
+        assert_eq!(events[1]["ph"], "B");
+        assert_eq!(events[1]["ts"], 0.0);
+        assert_eq!(events[2]["ph"], "E");
+        assert_eq!(events[2]["ts"], 2.0);
+        assert_eq!(events[3]["name"], "notify 0");
+        assert_eq!(events[3]["ts"], 5.0);
+    }
+}
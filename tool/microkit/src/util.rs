@@ -6,6 +6,7 @@
 
 use crate::sel4::Object;
 use serde_json;
+use std::thread;
 
 pub fn msb(x: u64) -> u64 {
     64 - x.leading_zeros() as u64 - 1
@@ -218,6 +219,74 @@ pub fn monitor_serialise_names(
     names_bytes
 }
 
+/// Maximum number of bytes `varint_encode` produces for a single value.
+pub const VARINT_MAX_LEN: u64 = 10;
+
+/// Appends the unsigned LEB128 encoding of the given value.
+pub fn varint_encode(mut value: u64, data: &mut Vec<u8>) {
+    loop {
+        let byte = (value & 0x7f) as u8;
+        value >>= 7;
+        if value == 0 {
+            data.push(byte);
+            break;
+        }
+        data.push(byte | 0x80);
+    }
+}
+
+/// Maps signed values to unsigned values such that values with a small
+/// magnitude, positive or negative, end up small.
+/// E.g 0 => 0, -1 => 1, 1 => 2, -2 => 3, ...
+pub fn zigzag_encode(value: i64) -> u64 {
+    ((value << 1) ^ (value >> 63)) as u64
+}
+
+/// Applies `f` to each item along with its index, spreading the items across
+/// as many threads as there are CPUs. The results are in the order of the
+/// items, so they do not depend on how the work was split up.
+pub fn par_map_mut<T, R, F>(items: &mut [T], f: F) -> Vec<R>
+where
+    T: Send,
+    R: Send,
+    F: Fn(usize, &mut T) -> R + Sync,
+{
+    let threads = thread::available_parallelism().map_or(1, |n| n.get());
+    if threads == 1 || items.len() <= 1 {
+        return items
+            .iter_mut()
+            .enumerate()
+            .map(|(i, item)| f(i, item))
+            .collect();
+    }
+
+    let chunk_size = items.len().div_ceil(threads);
+    let f = &f;
+    thread::scope(|scope| {
+        let handles: Vec<_> = items
+            .chunks_mut(chunk_size)
+            .enumerate()
+            .map(|(chunk_idx, chunk)| {
+                scope.spawn(move || {
+                    chunk
+                        .iter_mut()
+                        .enumerate()
+                        .map(|(i, item)| f(chunk_idx * chunk_size + i, item))
+                        .collect::<Vec<R>>()
+                })
+            })
+            .collect();
+        handles
+            .into_iter()
+            .flat_map(|handle| {
+                handle
+                    .join()
+                    .unwrap_or_else(|err| std::panic::resume_unwind(err))
+            })
+            .collect()
+    })
+}
+
 #[cfg(test)]
 mod tests {
     // Note this useful idiom: importing names from outer (for mod tests) scope.
@@ -233,4 +302,38 @@ mod tests {
         assert_eq!(lsb(36), 2);
         assert_eq!(lsb(37), 0);
     }
+
+    #[test]
+    fn test_varint_encode() {
+        let mut data = Vec::new();
+        varint_encode(0, &mut data);
+        varint_encode(0x7f, &mut data);
+        varint_encode(0x80, &mut data);
+        varint_encode(u64::MAX, &mut data);
+        assert_eq!(
+            data,
+            [0x00, 0x7f, 0x80, 0x01, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01]
+        );
+    }
+
+    #[test]
+    fn test_zigzag_encode() {
+        assert_eq!(zigzag_encode(0), 0);
+        assert_eq!(zigzag_encode(-1), 1);
+        assert_eq!(zigzag_encode(1), 2);
+        assert_eq!(zigzag_encode(-2), 3);
+        assert_eq!(zigzag_encode(i64::MIN), u64::MAX);
+    }
+
+    #[test]
+    fn test_par_map_mut() {
+        let mut items: Vec<u64> = (0..1000).collect();
+        let results = par_map_mut(&mut items, |i, item| {
+            *item *= 2;
+            i
+        });
+        assert_eq!(results, (0..1000).collect::<Vec<usize>>());
+        assert_eq!(items, (0..1000).map(|i| i * 2).collect::<Vec<u64>>());
+        assert!(par_map_mut(&mut [] as &mut [u64], |i, _| i).is_empty());
+    }
 }
@@ -19,6 +19,7 @@ const DEFAULT_KERNEL_CONFIG: sel4::Config = sel4::Config {
     hypervisor: true,
     benchmark: false,
     fpu: true,
+    num_cores: 4,
     arm_pa_size_bits: Some(40),
     arm_smc: None,
     riscv_pt_levels: None,
@@ -237,6 +238,22 @@ mod protection_domain {
         )
     }
 
+    #[test]
+    fn test_parent_has_reset() {
+        check_error(
+            "pd_parent_has_reset.system",
+            "Error: invalid attribute 'reset' on element 'protection_domain': ",
+        )
+    }
+
+    #[test]
+    fn test_child_invalid_reset() {
+        check_error(
+            "pd_child_invalid_reset.system",
+            "Error: reset must be 'true' or 'false' on element 'protection_domain'",
+        )
+    }
+
     #[test]
     fn test_child_missing_id() {
         check_missing("pd_child_missing_id.system", "id", "protection_domain")
@@ -274,6 +291,30 @@ mod protection_domain {
         )
     }
 
+    #[test]
+    fn test_invalid_cpu() {
+        check_error(
+            "pd_invalid_cpu.system",
+            "Error: cpu must be less than the number of cores the kernel is configured for (4) on element 'protection_domain'",
+        )
+    }
+
+    #[test]
+    fn test_utilisation_reporter_not_benchmark() {
+        check_error(
+            "pd_utilisation_reporter_not_benchmark.system",
+            "Error: utilisation_reporter is only available in the benchmark configuration on element 'protection_domain'",
+        )
+    }
+
+    #[test]
+    fn test_unaligned_trace_size() {
+        check_error(
+            "pd_unaligned_trace_size.system",
+            "Error: trace_size is not a multiple of the page size on element 'protection_domain'",
+        )
+    }
+
     #[test]
     fn test_overlapping_maps() {
         check_error(
@@ -324,6 +365,14 @@ mod virtual_machine {
         )
     }
 
+    #[test]
+    fn test_invalid_vcpu_cpu() {
+        check_error(
+            "vm_invalid_vcpu_cpu.system",
+            "Error: cpu must be less than the number of cores the kernel is configured for (4) on element 'vcpu'",
+        )
+    }
+
     #[test]
     fn test_overlapping_maps() {
         check_error(
@@ -439,6 +488,80 @@ mod channel {
     }
 }
 
+#[cfg(test)]
+mod ring {
+    use super::*;
+
+    #[test]
+    fn test_missing_consumer() {
+        check_error(
+            "ring_missing_consumer.system",
+            "Error: exactly one producer and one consumer must be specified on element 'ring': ",
+        )
+    }
+
+    #[test]
+    fn test_same_pd() {
+        check_error(
+            "ring_same_pd.system",
+            "Error: producer and consumer must be different protection domains on element 'ring': ",
+        )
+    }
+
+    #[test]
+    fn test_duplicate_channel_id() {
+        check_error(
+            "ring_duplicate_channel_id.system",
+            "Error: duplicate channel id: 0 in protection domain: 'test1' @",
+        )
+    }
+
+    #[test]
+    fn test_poll_without_ring() {
+        check_error(
+            "ring_poll_without_ring.system",
+            "Error: protection domain 'test2' has poll_us but does not consume any rings: ",
+        )
+    }
+
+    #[test]
+    fn test_poll_passive() {
+        check_error(
+            "ring_poll_passive.system",
+            "Error: poll_us is not available for passive protection domains on element 'protection_domain': ",
+        )
+    }
+}
+
+#[cfg(test)]
+mod logger {
+    use super::*;
+
+    #[test]
+    fn test_duplicate() {
+        check_error(
+            "logger_duplicate.system",
+            "Error: logger must only be specified once: ",
+        )
+    }
+
+    #[test]
+    fn test_invalid_buffer_size() {
+        check_error(
+            "logger_invalid_buffer_size.system",
+            "Error: buffer_size is not a multiple of the page size on element 'logger': ",
+        )
+    }
+
+    #[test]
+    fn test_duplicate_pd_name() {
+        check_error(
+            "logger_duplicate_pd_name.system",
+            "Error: duplicate protection domain name 'logger'.",
+        )
+    }
+}
+
 #[cfg(test)]
 mod system {
     use super::*;